@@ -0,0 +1,551 @@
+// ============================================================================
+// bench.c - timing benchmarks for the BFS block IO layer
+//
+// benchQueueDepth reads random blocks of a BFS disk image, BENCHREQS at a
+// time, first with plain pread's, then through bioSubmit/bioReap at queue
+// depths 1, 2, 4 .. BIOQDEPTH, and prints the rate achieved by each.  Run it
+// as "main bench".  The image is normally small enough to sit in the page
+// cache, so this measures the cost of issuing IO, not of the device
+//
+// benchStress runs the file system from many threads at once.  First, teams
+// of 1, 2, 4 .. STRESSTHREADS threads each read the whole of one shared file,
+// through descriptors of their own, and the rate each team achieves is
+// printed.  Next, teams of the same sizes make STRESSPREADS random fsPread's
+// each, all through one descriptor.  Then STRESSWRITERS threads create, write
+// (front to back with fsWrite, or back to front with fsPwrite), check, rename
+// and delete files of their own, while readers keep reading the shared file.
+// Every read is checked, and at the end, so is every file left; and once all
+// are deleted, every block must be free again.  Run it as "main stress".  It
+// formats a scratch image, STRESSDISK, and removes it when done.  The number
+// of CPUs online is printed first: a team larger than that cannot read any
+// faster, but only share the same CPUs
+//
+// benchFreeRun times mapFindRun against a naive search, a bit at a time, of
+// the same fragmented bitmap, for runs of a range of lengths.  Run it as
+// "main alloc".  It does not touch BFSDISK
+// ============================================================================
+
+#include <pthread.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "bench.h"
+#include "bfs.h"
+#include "bio.h"
+#include "fs.h"
+#include "map.h"
+
+typedef struct {          // One benchStress thread
+  pthread_t thread;
+  i32 id;                 // 0, 1 .. within its team
+  i32 loop;               // reader: 1 => at EOF, start again, till g_stop
+  i32 fd;                 // pread reader: the descriptor its team shares
+  i64 bytes;              // # of bytes read, or written
+  i32 bad;                // # of reads that returned the wrong bytes
+  i32 len[STRESSNAMES];   // writer: length of each of its files. -1 => none
+  i32 round[STRESSNAMES]; // writer: round that wrote each of them
+} StressArg;
+
+static i8  g_buf[BIOQDEPTH][BYTESPERBLOCK];   // one buffer per request
+static u32 g_seed = 12345;                    // for benchRandDbn
+static i32 g_stop = 0;                        // 1 => looping readers stop
+static u64 g_bits[ALLOCBITS / 64];            // benchFreeRun's bitmap
+
+
+
+// ============================================================================
+// Return a pseudo-random DBN, anywhere on the disk
+// ============================================================================
+static i32 benchRandDbn() {
+  g_seed = g_seed * 1103515245 + 12345;
+  return (g_seed >> 8) % bioNumBlocks();
+}
+
+
+
+// ============================================================================
+// Return the time now, in seconds
+// ============================================================================
+static double benchNow() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+
+// ============================================================================
+// Print one line of results: 'secs' taken for BENCHREQS reads
+// ============================================================================
+static void benchReport(str label, i32 depth, double secs) {
+  double iops = BENCHREQS / secs;
+  double mbps = iops * bioBlockSize() / (1024.0 * 1024.0);
+  printf("%-8s %5d %12.0f %10.1f \n", label, depth, iops, mbps);
+}
+
+
+
+// ============================================================================
+// Read BENCHREQS random blocks through bioSubmit/bioReap, keeping 'depth'
+// requests in flight.  Each request has a buffer of its own; its tag is the
+// index of that buffer, so a finished request's buffer can go straight to
+// the next one.  Return the time taken, in seconds
+// ============================================================================
+static double benchDepth(i32 depth) {
+  u64 tags[BIOQDEPTH];
+  i32 submitted = 0;
+  i32 finished  = 0;
+
+  double t0 = benchNow();
+  for (i32 i = 0; i < depth && submitted < BENCHREQS; ++i) {
+    BioReq req = { BIOOPREAD, benchRandDbn(), 1, g_buf[i] };
+    bioSubmit(&req, (u64)i);
+    ++submitted;
+  }
+  while (finished < BENCHREQS) {
+    i32 n = bioReap(1, tags, depth);
+    finished += n;
+    for (i32 i = 0; i < n && submitted < BENCHREQS; ++i) {
+      BioReq req = { BIOOPREAD, benchRandDbn(), 1, g_buf[tags[i]] };
+      bioSubmit(&req, tags[i]);
+      ++submitted;
+    }
+  }
+  return benchNow() - t0;
+}
+
+
+
+// ============================================================================
+// Time random block reads of the BFS disk held in file 'path': first with
+// pread, one at a time; then via io_uring at each queue depth from 1 up to
+// BIOQDEPTH.  If io_uring is unavailable, say so; the "uring" rows then
+// measure the pread fallback.  On success, return 0
+// ============================================================================
+i32 benchQueueDepth(str path) {
+  printf("\n%-8s %5s %12s %10s \n", "mode", "depth", "IOs/sec", "MB/sec");
+
+  bioOpen(path, BIOPREAD);
+  double t0 = benchNow();
+  for (i32 i = 0; i < BENCHREQS; ++i) bioRead(benchRandDbn(), g_buf[0]);
+  benchReport("pread", 1, benchNow() - t0);
+  bioClose();
+
+  bioOpen(path, BIOURING);
+  if (bioMode() != BIOURING) {
+    printf("(io_uring unavailable: falling back to pread) \n");
+  }
+  for (i32 depth = 1; depth <= BIOQDEPTH; depth *= 2) {
+    benchReport("uring", depth, benchDepth(depth));
+  }
+  bioClose();
+  return 0;
+}
+
+
+
+// ============================================================================
+// Return byte 'i' of the file that writer 'id' writes in round 'round'
+// ============================================================================
+static i8 benchByte(i32 id, i32 round, i32 i) {
+  return (i8)(id * 31 + round * 7 + i);
+}
+
+
+
+// ============================================================================
+// Return a pseudo-random number, from the generator whose state is *seed
+// ============================================================================
+static u32 benchRand(u32* seed) {
+  *seed = *seed * 1103515245 + 12345;
+  return *seed >> 8;
+}
+
+
+
+// ============================================================================
+// Check 'numb' bytes read from offset 'pos' of the shared file: each 8-byte
+// word holds its own offset in the file.  Return 1 if so
+// ============================================================================
+static i32 benchWords(i64* words, i64 pos, i32 numb) {
+  for (i32 k = 0; k < numb / (i32)sizeof(i64); ++k) {
+    if (words[k] != pos + k * (i64)sizeof(i64)) return 0;
+  }
+  return 1;
+}
+
+
+
+// ============================================================================
+// Reader thread: open the shared file, and read it, STRESSREAD bytes at a
+// time, checking each piece, until end-of-file - or, if 'loop', over and
+// over, until g_stop
+// ============================================================================
+static void* benchReader(void* arg) {
+  StressArg* a = (StressArg*)arg;
+  i64 words[STRESSREAD / sizeof(i64)];
+  i32 fd  = fsOpen("shared");
+  i64 pos = 0;
+  while (!a->loop || !__atomic_load_n(&g_stop, __ATOMIC_ACQUIRE)) {
+    i32 n = fsRead(fd, STRESSREAD, words);
+    if (n == 0 && !a->loop) break;
+    if (n == 0) {
+      fsSeek(fd, 0, SEEK_SET);
+      pos = 0;
+      continue;
+    }
+    if (!benchWords(words, pos, n)) ++a->bad;
+    a->bytes += n;
+    pos      += n;
+  }
+  fsClose(fd);
+  return NULL;
+}
+
+
+
+// ============================================================================
+// Positional reader thread: make STRESSPREADS fsPread's, each of STRESSREAD
+// bytes from a random offset in the shared file, through the descriptor its
+// whole team shares, checking each piece
+// ============================================================================
+static void* benchPreader(void* arg) {
+  StressArg* a = (StressArg*)arg;
+  i64 words[STRESSREAD / sizeof(i64)];
+  u32 seed = 1 + a->id;
+  for (i32 i = 0; i < STRESSPREADS; ++i) {
+    i64 pos  = (benchRand(&seed) % (STRESSBYTES / sizeof(i64))) * sizeof(i64);
+    i32 n    = fsPread(a->fd, pos, STRESSREAD, words);
+    i32 want = STRESSREAD;
+    if (want > STRESSBYTES - pos) want = (i32)(STRESSBYTES - pos);
+    if (n != want || !benchWords(words, pos, n)) ++a->bad;
+    a->bytes += n;
+  }
+  return NULL;
+}
+
+
+
+// ============================================================================
+// Check that writer 'a's file 'name' holds what round 'round' wrote: 'len'
+// bytes.  Return 1 if so
+// ============================================================================
+static i32 benchCheckFile(StressArg* a, str name, i32 round, i32 len) {
+  static __thread i8 got[STRESSFILE + 1];
+  i32 fd = fsOpen(name);
+  if (fd < 0) return 0;
+  i32 n  = fsRead(fd, STRESSFILE + 1, got);
+  fsClose(fd);
+  if (n != len) return 0;
+  for (i32 i = 0; i < len; ++i) {
+    if (got[i] != benchByte(a->id, round, i)) return 0;
+  }
+  return 1;
+}
+
+
+
+// ============================================================================
+// Writer thread: for each of STRESSROUNDS rounds, create (or overwrite) one
+// of its STRESSNAMES files, write it in pieces of random size, and check it.
+// Every so often, rename the file away and back, or delete it
+// ============================================================================
+static void* benchWriter(void* arg) {
+  StressArg* a = (StressArg*)arg;
+  static __thread i8 buf[STRESSFILE];
+  u32  seed = 1 + a->id;
+  char name[FNAMESIZE];
+  char temp[FNAMESIZE];
+  sprintf(temp, "w%d-temp", a->id);
+
+  for (i32 r = 0; r < STRESSROUNDS; ++r) {
+    i32 k   = r % STRESSNAMES;
+    i32 len = 1 + benchRand(&seed) % STRESSFILE;
+    sprintf(name, "w%d-%d", a->id, k);
+    for (i32 i = 0; i < len; ++i) buf[i] = benchByte(a->id, r, i);
+
+    i32 fd = fsCreate(name);
+    if (r % 2 == 0) {                         // front to back, at the cursor
+      for (i32 off = 0; off < len; ) {
+        i32 n = 1 + benchRand(&seed) % STRESSPIECE;
+        if (n > len - off) n = len - off;
+        fsWrite(fd, n, buf + off);
+        off += n;
+      }
+    } else {                                  // back to front, at offsets
+      for (i32 end = len; end > 0; ) {
+        i32 n = 1 + benchRand(&seed) % STRESSPIECE;
+        if (n > end) n = end;
+        end -= n;
+        fsPwrite(fd, end, n, buf + end);
+      }
+    }
+    fsClose(fd);
+    a->bytes   += len;
+    a->len[k]   = len;
+    a->round[k] = r;
+    if (!benchCheckFile(a, name, r, len)) ++a->bad;
+
+    if (r % 4 == 3) {
+      if (fsRename(name, temp) != 0 || fsRename(temp, name) != 0) ++a->bad;
+    }
+    if (r % 5 == 4) {
+      if (fsDelete(name) != 0) ++a->bad;
+      a->len[k] = -1;
+    }
+  }
+  return NULL;
+}
+
+
+
+// ============================================================================
+// Start 'num' threads of a team, running 'fn' on 'args'
+// ============================================================================
+static void benchStart(StressArg* args, i32 num, void* (*fn)(void*)) {
+  for (i32 i = 0; i < num; ++i) {
+    if (pthread_create(&args[i].thread, NULL, fn, &args[i]) != 0) {
+      FATAL(ENOMEM);
+    }
+  }
+}
+
+
+
+// ============================================================================
+// Wait for the 'num' threads of a team to finish.  Add up the bytes they
+// moved into *bytes, and return the number of bad reads they saw
+// ============================================================================
+static i32 benchJoin(StressArg* args, i32 num, i64* bytes) {
+  i32 bad = 0;
+  for (i32 i = 0; i < num; ++i) {
+    pthread_join(args[i].thread, NULL);
+    *bytes += args[i].bytes;
+    bad    += args[i].bad;
+  }
+  return bad;
+}
+
+
+
+// ============================================================================
+// Run the stress test described at the top of this file, on a freshly
+// formatted STRESSDISK.  Print the read rate achieved by each team of readers,
+// then whether every check passed.  If so, return 0; otherwise 1
+// ============================================================================
+i32 benchStress() {
+  fsSetDisk(STRESSDISK);
+  fsFormat(STRESSBLOCKS, STRESSINODES, STRESSBSIZE);
+  fsMount();
+  i32 numFree = g_super.numFree;
+
+  static i64 words[STRESSREAD / sizeof(i64)];
+  i32 fd = fsCreate("shared");
+  for (i64 off = 0; off < STRESSBYTES; off += STRESSREAD) {
+    for (i32 k = 0; k < STRESSREAD / (i32)sizeof(i64); ++k) {
+      words[k] = off + k * (i64)sizeof(i64);
+    }
+    fsWrite(fd, STRESSREAD, words);
+  }
+
+  StressArg rd[STRESSTHREADS];
+  StressArg wr[STRESSWRITERS];
+  i32 bad = 0;
+
+  printf("\nCPUs online: %ld \n", sysconf(_SC_NPROCESSORS_ONLN));
+  printf("\n%-8s %10s \n", "readers", "MB/sec");
+  for (i32 num = 1; num <= STRESSTHREADS; num *= 2) {
+    memset(rd, 0, sizeof(rd));
+    for (i32 i = 0; i < num; ++i) rd[i].id = i;
+    double t0 = benchNow();
+    benchStart(rd, num, benchReader);
+    i64 bytes = 0;
+    bad += benchJoin(rd, num, &bytes);
+    double secs = benchNow() - t0;
+    if (bytes != num * (i64)STRESSBYTES) ++bad;   // each read it all
+    printf("%-8d %10.1f \n", num, bytes / secs / (1024.0 * 1024.0));
+  }
+
+  printf("\n%-8s %10s \n", "preaders", "MB/sec");
+  for (i32 num = 1; num <= STRESSTHREADS; num *= 2) {
+    memset(rd, 0, sizeof(rd));
+    for (i32 i = 0; i < num; ++i) {
+      rd[i].id = i;
+      rd[i].fd = fd;
+    }
+    double t0 = benchNow();
+    benchStart(rd, num, benchPreader);
+    i64 bytes = 0;
+    bad += benchJoin(rd, num, &bytes);
+    double secs = benchNow() - t0;
+    printf("%-8d %10.1f \n", num, bytes / secs / (1024.0 * 1024.0));
+  }
+
+  memset(rd, 0, sizeof(rd));
+  memset(wr, 0, sizeof(wr));
+  for (i32 i = 0; i < STRESSTHREADS / 2; ++i) {
+    rd[i].id   = i;
+    rd[i].loop = 1;
+  }
+  for (i32 i = 0; i < STRESSWRITERS; ++i) wr[i].id = i;
+
+  __atomic_store_n(&g_stop, 0, __ATOMIC_RELEASE);
+  double t0 = benchNow();
+  benchStart(rd, STRESSTHREADS / 2, benchReader);
+  benchStart(wr, STRESSWRITERS, benchWriter);
+  i64 written = 0;
+  i64 read    = 0;
+  bad += benchJoin(wr, STRESSWRITERS, &written);
+  __atomic_store_n(&g_stop, 1, __ATOMIC_RELEASE);
+  bad += benchJoin(rd, STRESSTHREADS / 2, &read);
+  double secs = benchNow() - t0;
+  printf("\n%d writers, %d readers: %.1f MB written, %.1f MB read, in %.2fs \n",
+         STRESSWRITERS, STRESSTHREADS / 2, written / (1024.0 * 1024.0),
+         read / (1024.0 * 1024.0), secs);
+
+  // Every file must hold what was last written to it; then delete them all
+
+  char name[FNAMESIZE];
+  for (i32 i = 0; i < STRESSWRITERS; ++i) {
+    for (i32 k = 0; k < STRESSNAMES; ++k) {
+      sprintf(name, "w%d-%d", i, k);
+      if (wr[i].len[k] < 0) {
+        if (fsOpen(name) != EFNF) ++bad;
+        continue;
+      }
+      if (!benchCheckFile(&wr[i], name, wr[i].round[k], wr[i].len[k])) ++bad;
+      if (fsDelete(name) != 0) ++bad;
+    }
+  }
+  fsClose(fd);
+  if (fsDelete("shared") != 0) ++bad;
+
+  // Once committed, every block freed must be free on disk
+
+  fsUnmount();
+  fsMount();
+  if (g_super.numFree != numFree) ++bad;
+  fsUnmount();
+  remove(STRESSDISK);
+  fsSetDisk(NULL);
+
+  printf("stress: %s \n", (bad == 0) ? "OK" : "FAILED");
+  return (bad == 0) ? 0 : 1;
+}
+
+
+
+// ============================================================================
+// Fill g_bits with runs of blocks in use, of 1 to 512 bits, and runs of free
+// blocks, of 1 to 32 - with, every 1M bits or so, one of 2048
+// ============================================================================
+static void benchFragment() {
+  u32 seed = 4321;
+  memset(g_bits, 0xff, sizeof(g_bits));
+  i32 n = 0;
+  while (n < ALLOCBITS) {
+    n += 1 + benchRand(&seed) % 512;
+    i32 len = 1 + benchRand(&seed) % 32;
+    if (benchRand(&seed) % 2048 == 0) len = 2048;
+    for (i32 end = n + len; n < end && n < ALLOCBITS; ++n) {
+      g_bits[n / 64] &= ~(1ULL << (n % 64));
+    }
+  }
+}
+
+
+
+// ============================================================================
+// Search g_bits as mapFindRun does, but testing one bit at a time.  Set *len
+// to the length of the run found, and return its start; or -1
+// ============================================================================
+static i32 benchNaiveRun(i32 hint, i32 want, i32* len) {
+  i32 best = -1;
+  *len = 0;
+  for (i32 pass = 0; pass < 2 && *len < want; ++pass) {
+    i32 n   = (pass == 0) ? hint : 0;
+    i32 end = (pass == 0) ? ALLOCBITS : hint;
+    while (n < end && *len < want) {
+      if (g_bits[n / 64] & (1ULL << (n % 64))) {
+        ++n;
+        continue;
+      }
+      i32 start = n;
+      while (n < end && !(g_bits[n / 64] & (1ULL << (n % 64)))) ++n;
+      if (n - start > *len) {
+        best = start;
+        *len = n - start;
+      }
+    }
+  }
+  return best;
+}
+
+
+
+// ============================================================================
+// Make ALLOCFINDS searches of g_bits, for runs of 'want' bits, from random
+// hints: via mapFindRun on 'map' if not NULL; otherwise via benchNaiveRun.
+// Record each result in 'starts' and 'lens'.  Return the seconds taken
+// ============================================================================
+static double benchFinds(Map* map, i32 want, i32* starts, i32* lens) {
+  u32 seed = 999;
+  double t0 = benchNow();
+  for (i32 i = 0; i < ALLOCFINDS; ++i) {
+    i32 hint = benchRand(&seed) % ALLOCBITS;
+    if (map != NULL) {
+      starts[i] = mapFindRun(map, 0, ALLOCBITS, hint, want, &lens[i]);
+    } else {
+      starts[i] = benchNaiveRun(hint, want, &lens[i]);
+    }
+    if (lens[i] > want) lens[i] = want;
+  }
+  return benchNow() - t0;
+}
+
+
+
+// ============================================================================
+// Time searches of a fragmented bitmap of ALLOCBITS bits for free runs of 1,
+// 16, 256 and 1024 bits: bit by bit; then with mapFindRun, skipping words
+// with plain 64-bit operations; then with AVX2, if the CPU has it.  Print the
+// microseconds per search of each, and whether all found the same runs.  If
+// they did, return 0; otherwise 1
+// ============================================================================
+i32 benchFreeRun() {
+  static i32 starts[3][ALLOCFINDS];
+  static i32 lens[3][ALLOCFINDS];
+  Map map;
+  memset(&map, 0, sizeof(map));
+  benchFragment();
+  mapInit(&map, g_bits, ALLOCBITS);
+  i32 bad = 0;
+  i32 len = 0;
+  mapFindRun(&map, 0, ALLOCBITS, 0, ALLOCBITS, &len);   // summarize them all
+
+  printf("\n%-8s %10s %10s %10s \n", "want", "naive", "word", "avx2");
+  static const i32 wants[] = { 1, 16, 256, 1024 };
+  for (i32 w = 0; w < (i32)(sizeof(wants) / sizeof(wants[0])); ++w) {
+    i32 want = wants[w];
+    double naive = benchFinds(NULL, want, starts[0], lens[0]);
+    mapSimd(0);
+    double word  = benchFinds(&map, want, starts[1], lens[1]);
+    i32 simd = mapSimd(1);
+    double avx2  = benchFinds(&map, want, starts[2], lens[2]);
+    for (i32 k = 1; k < 3; ++k) {
+      if (memcmp(starts[k], starts[0], sizeof(starts[0])) != 0) ++bad;
+      if (memcmp(lens[k],   lens[0],   sizeof(lens[0]))   != 0) ++bad;
+    }
+    double us = 1e6 / ALLOCFINDS;
+    if (simd) {
+      printf("%-8d %10.1f %10.1f %10.1f \n", want, naive * us, word * us,
+             avx2 * us);
+    } else {
+      printf("%-8d %10.1f %10.1f %10s \n", want, naive * us, word * us, "-");
+    }
+  }
+
+  printf("alloc: %s \n", (bad == 0) ? "OK" : "FAILED");
+  return (bad == 0) ? 0 : 1;
+}
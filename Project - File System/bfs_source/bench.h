@@ -0,0 +1,34 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+// ============================================================================
+// bench.h - timing benchmarks for the BFS block IO layer and free-space
+// search, and a stress test
+// ============================================================================
+
+#include "alias.h"
+
+#define BENCHREQS 20000   // block reads per measurement
+
+#define STRESSDISK    "BFSDISK.stress"  // benchStress: its scratch image
+#define STRESSBLOCKS  8192              // ... blocks in it
+#define STRESSBSIZE   4096              // ... bytes per block
+#define STRESSINODES  64                // ... and # of Inodes
+#define STRESSBYTES   (8 * 1024 * 1024) // size of the file readers share
+#define STRESSREAD    4096              // bytes per fsRead of it
+#define STRESSPREADS  2048              // fsPread's per positional reader
+#define STRESSTHREADS 8                 // most readers sharing it at once
+#define STRESSWRITERS 4                 // writer threads
+#define STRESSROUNDS  100               // files each writer writes
+#define STRESSNAMES   3                 // ... under this many names
+#define STRESSFILE    65536             // largest file a writer writes
+#define STRESSPIECE   8192              // ... in fsWrite's of up to this
+
+#define ALLOCBITS  (8 * 1024 * 1024)    // benchFreeRun: bits in its bitmap
+#define ALLOCFINDS 200                  // ... searches per run length
+
+i32 benchFreeRun();
+i32 benchQueueDepth(str path);
+i32 benchStress();
+
+#endif
\ No newline at end of file
@@ -3,6 +3,875 @@
 // ============================================================================
 
 #include "bfs.h"
+#include "jrn.h"
+#include "map.h"
+
+FDTE  g_fdt[NUMFDS];                     // File Descriptor Table
+OFTE  g_oft[NUMOFTENTRIES];              // Open File Table
+Super g_super;                           // SuperBlock of the mounted disk
+
+// Locking.  Operations that change metadata are bracketed by jrnBegin and
+// jrnEnd, which also serialize them (see jrn.c), so the Directory and the
+// name cache need no lock of their own.  g_oftLock guards which file each OFT
+// entry holds, and its reference count; and the File Descriptor Table: which
+// file each descriptor is open on, its cursor and readahead window.
+// g_allocLock guards the allocation bitmap and the Inode map.  Each OFT entry
+// also has a reader/writer lock for its file: held shared by fsRead, and
+// exclusive by whatever changes the file's Inode or data - see bfsLockInode.
+// g_delayLock guards the delayed blocks, below.  Locks are taken in the
+// order: journal, Inode, g_oftLock, g_allocLock, g_delayLock, then the
+// cache's own
+
+static pthread_mutex_t g_oftLock   = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t g_allocLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t g_delayLock = PTHREAD_MUTEX_INITIALIZER;
+
+// In-memory copy of the allocation bitmap (blocks dbnBitmap onwards): bit
+// 'dbn' is 1 if block 'dbn' is in use.  Loaded by bfsLoadBitmap at mount, and
+// written back only by bfsSyncBitmap - just the bitmap blocks that changed.
+// g_map keeps a summary of each region of it, so allocation - see map.c - can
+// find a run of free blocks near a hint, or where the last allocation left
+// off, without scanning every word on the way
+
+static u64* g_bitmap      = NULL;       // numBitmapBlocks blocks' worth
+static Map  g_map;                      // g_bitmap, with region summaries
+static i8*  g_bitmapDirty = NULL;       // per bitmap block: 1 => changed
+static i32  g_numDirtyMap = 0;          // # of 1's in g_bitmapDirty
+static i32  g_numFree     = 0;          // # of 0 bits in g_bitmap
+static i32  g_rotor       = 0;          // DBN to start the next search at
+
+// Free blocks held for delayed blocks - see g_delay - one for each slot in
+// use, taken by bfsDelayBlock.  Other allocations leave g_reserved of
+// g_numFree alone, so that bfsAllocDelayed is sure to find room; as it
+// allocates, it spends the reservations of the blocks it lays out
+
+static i32 g_reserved = 0;              // # of free blocks held
+static __thread i32 g_spend = 0;        // # this thread may allocate
+
+// Blocks freed in the running transaction.  The bitmap blocks it commits
+// show them free, but they stay set in g_bitmap - so are not reallocated, and
+// overwritten - until the commit is on disk, and bfsReleaseFreed runs: until
+// then, a crash leaves them with the file they were freed from
+
+static i32* g_freed     = NULL;         // pairs: first DBN, # of blocks
+static i32  g_numFreed  = 0;            // # of pairs in g_freed
+static i32  g_maxFreed  = 0;            // # of pairs g_freed has room for
+static i32  g_freedBlks = 0;            // # of blocks in g_freed
+
+// In-memory copy of the Inode map (blocks dbnInodeMap onwards): bit 'inum' is
+// 1 if Inode 'inum' belongs to a file.  Kept just like the allocation bitmap
+
+static u64* g_inodeMap      = NULL;     // numInodeMapBlocks blocks' worth
+static i8*  g_inodeMapDirty = NULL;     // per Inode map block: 1 => changed
+static i32  g_numDirtyIMap  = 0;        // # of 1's in g_inodeMapDirty
+static i32  g_inodeRotor    = 0;        // inum to start the next search at
+
+// In-memory copy of the Inodes and the Directory (blocks dbnInodes onwards,
+// then dbnDir onwards, which follow them on disk), read in by bfsLoadMeta at
+// mount, with one sequential read.  Every lookup is served from it.  Each
+// change is made to it, then written through the journal - see bfsStoreInode
+// and bfsDirSave - so it never holds anything the disk will not get
+
+static i8* g_inodes = NULL;             // numInodeBlocks blocks' worth
+static i8* g_dir    = NULL;             // numDirBlocks more, in g_inodes
+
+// Name cache: the results of recent Directory lookups, 'fname' => inum, in a
+// direct-mapped table indexed by the name's hash.  A failed lookup is kept
+// too, as EFNF, so looking again for a missing file costs no Directory search
+// either.  bfsCreateFile, bfsDeleteFile and bfsRenameFile update the entries
+// for the names they change, so it is never stale.  bfsLoadBitmap empties it.
+// Names too long for a Dir entry - see bfsDirAdd - are not cached
+
+typedef struct {          // Name cache entry
+  i32  inum;              // inum of file 'fname'.  EFNF => no such file
+  u32  hash;              // bfsHash of 'fname'
+  char fname[FNAMESIZE];  // "" => entry unused
+} NameEntry;
+
+#define NAMECACHESIZE 1024              // entries in g_names
+
+static NameEntry g_names[NAMECACHESIZE];
+
+// Delayed allocation: a block written into a hole is not given a DBN at once.
+// Its data waits in memory, in a slot of g_delay, found by (inum, FBN)
+// through a chained hash table, and reads see it there.  DBNs are chosen only
+// when the file is flushed - fsFsync, fsSync, fsUnmount - when the journal
+// commits a group of operations after the file is closed, or when slots run
+// out.  By then, the file has usually been written in full, so
+// bfsAllocDelayed can lay it out as one run.  A short-lived file, deleted or
+// emptied before then, never gets any DBNs at all
+
+typedef struct {          // Delayed block: file data not yet given a DBN
+  i32 inum;               // file it belongs to.  -1 => slot unused
+  i32 fbn;                // FBN it holds
+  i32 hnext;              // hash chain, or free list: next slot
+} DelayBlock;
+
+#define DELAYBLOCKS   256               // slots in g_delay
+#define DELAYHASHSIZE 256               // buckets in g_delayHash
+#define DELAYRUN      64                // bfsAllocDelayed: blocks per write
+
+static DelayBlock g_delay[DELAYBLOCKS];
+static i8         g_delayData[DELAYBLOCKS][MAXBLOCKSIZE];
+static i32        g_delayHash[DELAYHASHSIZE]; // bucket => first slot
+static i32        g_delayFree = -1;           // first unused slot
+static i32        g_numDelay  = 0;            // # of slots in use
+static i8         g_delayRun[DELAYRUN * MAXBLOCKSIZE]; // bfsAllocDelayed
+
+#define ZEROBLOCKS 64                   // bfsZero: blocks per write
+#define FLUSHLIST  (4 * NUMCACHEBLOCKS) // bfsFlushFile: most DBNs listed
+
+// Each file's blocks are mapped by extents: runs of FBNs held on as many
+// consecutive DBNs.  Up to NUMEXTENTS of them fit in the Inode.  Beyond that,
+// the Inode holds the root of an extent tree: a B+tree keyed by FBN, whose
+// nodes are blocks laid out as an ExtNode and its Extents.  In a leaf, these
+// are the file's extents; above that, index entries, one per child node,
+// keyed by the first FBN mapped below it.  A file written in order needs one
+// extent for each run the allocator found it, so the tree is seldom needed
+
+#define NODEEXTENTS ((MAXBLOCKSIZE - sizeof(ExtNode)) / sizeof(Extent))
+
+
+
+// ============================================================================
+// Return the DBN of the Inodes block that holds Inode 'inum', and set *off to
+// its byte offset within that block
+// ============================================================================
+static i32 bfsInodeDbn(i32 inum, i32* off) {
+  i64 pos = (i64)inum * INODESIZE;
+  *off = (i32)(pos % g_super.blockSize);
+  return g_super.dbnInodes + (i32)(pos / g_super.blockSize);
+}
+
+
+
+// ============================================================================
+// Copy Inode 'inum' out of the in-memory Inodes into 'inode'
+// ============================================================================
+static void bfsLoadInode(i32 inum, Inode* inode) {
+  memcpy(inode, g_inodes + (i64)inum * INODESIZE, sizeof(Inode));
+}
+
+
+
+// ============================================================================
+// Copy 'inode' into Inode 'inum' of the in-memory Inodes, and write the
+// Inodes block that holds it, as part of the running journal transaction
+// ============================================================================
+static void bfsStoreInode(i32 inum, Inode* inode) {
+  memcpy(g_inodes + (i64)inum * INODESIZE, inode, sizeof(Inode));
+  i32 off = 0;
+  i32 dbn = bfsInodeDbn(inum, &off);
+  jrnWrite(dbn, g_inodes + (i64)(dbn - g_super.dbnInodes) * g_super.blockSize);
+}
+
+
+
+// ============================================================================
+// Return the index in the Open File Table of file 'inum', or -1 if it has no
+// entry.  Called with g_oftLock held
+// ============================================================================
+static i32 bfsScanOFT(i32 inum) {
+  for (i32 i = 0; i < NUMOFTENTRIES; ++i) {
+    if (g_oft[i].inum == inum) return i;
+  }
+  return -1;
+}
+
+
+
+// ============================================================================
+// As bfsFindOFTE, but called with g_oftLock held
+// ============================================================================
+static i32 bfsClaimOFTE(i32 inum) {
+  i32 ofte = bfsScanOFT(inum);
+  if (ofte >= 0) return ofte;
+  
+  // Not found, so look for an empty OFTE; else one with no references
+
+  for (int i = 0; i < NUMOFTENTRIES && ofte < 0; ++i) {
+    if (g_oft[i].inum == -1) ofte = i;
+  }
+  for (int i = 0; i < NUMOFTENTRIES && ofte < 0; ++i) {
+    if (g_oft[i].refs == 0) ofte = i;
+  }
+  if (ofte < 0) FATAL(EOFTFULL);      // no-return
+
+  bfsFlushOFTE(ofte);                 // write back previous occupant
+
+  bfsLoadInode(inum, &g_oft[ofte].inode);
+  g_oft[ofte].inum  = inum;
+  g_oft[ofte].refs  = 0;
+  g_oft[ofte].dirty = 0;
+  return ofte;
+}
+
+
+
+// ============================================================================
+// Return the entry for File Descriptor 'fd' in the File Descriptor Table.
+// If 'fd' is not open, abort.  Called with g_oftLock held
+// ============================================================================
+static FDTE* bfsFdEntry(i32 fd) {
+  if (fd < FDBASE || fd >= FDBASE + NUMFDS) FATAL(ENOTOPEN);
+  FDTE* e = &g_fdt[fd - FDBASE];
+  if (e->inum < 0) FATAL(ENOTOPEN);
+  return e;
+}
+
+
+
+// ============================================================================
+// Write zeroes over the 'count' blocks from 'dbn' onwards, straight to disk,
+// ZEROBLOCKS at a time.  Only for fsFormat, while nothing is cached
+// ============================================================================
+static void bfsZero(i32 dbn, i32 count) {
+  static i8 zero[ZEROBLOCKS * MAXBLOCKSIZE];
+  while (count > 0) {
+    i32 num = (count < ZEROBLOCKS) ? count : ZEROBLOCKS;
+    bioWriteRun(dbn, num, zero);
+    dbn   += num;
+    count -= num;
+  }
+}
+
+
+
+// ============================================================================
+// Note that bits 'first' .. 'first' + 'count' - 1 of a bitmap have changed:
+// set the 'dirty' flag of each block they lie in, counting those newly set
+// in *numDirty
+// ============================================================================
+static void bfsMapDirty(i8* dirty, i32* numDirty, i32 first, i32 count) {
+  i32 bitsPerBlock = g_super.blockSize * 8;
+  for (i32 b = first / bitsPerBlock; b <= (first + count - 1) / bitsPerBlock;
+       ++b) {
+    if (!dirty[b]) {
+      dirty[b] = 1;
+      ++*numDirty;
+    }
+  }
+}
+
+
+
+// ============================================================================
+// Free the 'count' blocks from 'dbn' onwards - see g_freed.  The bitmap
+// blocks that cover them are written at the next bfsSyncBitmap
+// ============================================================================
+static void bfsFreeRun(i32 dbn, i32 count) {
+  pthread_mutex_lock(&g_allocLock);
+  if (g_numFreed == g_maxFreed) {
+    g_maxFreed = (g_maxFreed == 0) ? 64 : 2 * g_maxFreed;
+    g_freed = (i32*)realloc(g_freed, 2 * sizeof(i32) * g_maxFreed);
+    if (g_freed == NULL) FATAL(ENOMEM);
+  }
+  g_freed[2 * g_numFreed]     = dbn;
+  g_freed[2 * g_numFreed + 1] = count;
+  ++g_numFreed;
+  g_freedBlks += count;
+  bfsMapDirty(g_bitmapDirty, &g_numDirtyMap, dbn, count);
+  pthread_mutex_unlock(&g_allocLock);
+}
+
+
+
+// ============================================================================
+// Free every block listed in the extent tree under 'node' - whose Extents
+// are 'ent' - and the tree's own nodes below it
+// ============================================================================
+static void bfsFreeTree(ExtNode* node, Extent* ent) {
+  for (i32 i = 0; i < node->numExt; ++i) {
+    if (node->depth == 0) {
+      bfsFreeRun(ent[i].dbn, ent[i].len);
+      continue;
+    }
+    ExtNode* child = (ExtNode*)cacheGet(ent[i].dbn);
+    bfsFreeTree(child, (Extent*)(child + 1));
+    cachePut(ent[i].dbn, 0);
+    bfsFreeRun(ent[i].dbn, 1);
+  }
+}
+
+
+
+// ============================================================================
+// Return the g_delayHash bucket for FBN 'fbn' of file 'inum'
+// ============================================================================
+static u32 bfsDelayHash(i32 inum, i32 fbn) {
+  return ((u32)inum * 2654435761u + (u32)fbn) % DELAYHASHSIZE;
+}
+
+
+
+// ============================================================================
+// Return the g_delay slot holding FBN 'fbn' of file 'inum'.  If none, return
+// -1.  Called with g_delayLock held
+// ============================================================================
+static i32 bfsDelayFind(i32 inum, i32 fbn) {
+  i32 s = g_delayHash[bfsDelayHash(inum, fbn)];
+  while (s >= 0 && (g_delay[s].inum != inum || g_delay[s].fbn != fbn)) {
+    s = g_delay[s].hnext;
+  }
+  return s;
+}
+
+
+
+// ============================================================================
+// Empty g_delay slot 's': unlink it from its hash chain, and put it on the
+// free list.  Called with g_delayLock held
+// ============================================================================
+static void bfsDelayDrop(i32 s) {
+  i32* link = &g_delayHash[bfsDelayHash(g_delay[s].inum, g_delay[s].fbn)];
+  while (*link != s) link = &g_delay[*link].hnext;
+  *link = g_delay[s].hnext;
+
+  g_delay[s].inum  = -1;
+  g_delay[s].hnext = g_delayFree;
+  g_delayFree = s;
+  --g_numDelay;
+}
+
+
+
+// ============================================================================
+// Order two g_delay slots by the FBN they hold, for qsort
+// ============================================================================
+static int bfsDelayCmp(const void* a, const void* b) {
+  return g_delay[*(i32*)a].fbn - g_delay[*(i32*)b].fbn;
+}
+
+
+
+// ============================================================================
+// Return 1 if file 'inum' is open on some File Descriptor; otherwise 0
+// ============================================================================
+static i32 bfsIsOpen(i32 inum) {
+  pthread_mutex_lock(&g_oftLock);
+  i32 ofte = bfsScanOFT(inum);
+  i32 open = (ofte >= 0 && g_oft[ofte].refs > 0);
+  pthread_mutex_unlock(&g_oftLock);
+  return open;
+}
+
+
+
+// ============================================================================
+// Return the file whose delayed block g_delay slot 's' holds; -1 if unused
+// ============================================================================
+static i32 bfsDelayOwner(i32 s) {
+  pthread_mutex_lock(&g_delayLock);
+  i32 inum = g_delay[s].inum;
+  pthread_mutex_unlock(&g_delayLock);
+  return inum;
+}
+
+
+
+// ============================================================================
+// Give DBNs to the delayed blocks of file 'inum', on which the caller holds
+// no Inode lock, taking it exclusive meanwhile: if 'wait', once any reads of
+// the file have finished; otherwise only if nobody holds it, else leave the
+// blocks be.  A file just looked up by fsOpen, but not yet on a File
+// Descriptor, may be read as soon as its lock is free.  Called within a
+// journal operation, so the file's OFT entry stays put.  Return the number
+// of blocks allocated
+// ============================================================================
+static i32 bfsAllocOther(i32 inum, i32 wait) {
+  i32 ofte = bfsFindOFTE(inum);
+  if (wait) {
+    pthread_rwlock_wrlock(&g_oft[ofte].lock);
+  } else if (pthread_rwlock_trywrlock(&g_oft[ofte].lock) != 0) {
+    return 0;
+  }
+  i32 num = bfsAllocDelayed(inum);
+  pthread_rwlock_unlock(&g_oft[ofte].lock);
+  return num;
+}
+
+
+
+// ============================================================================
+// Make room in g_delay: give DBNs to the delayed blocks of file 'inum' -
+// whose Inode lock the caller holds exclusive - and of every file not open,
+// unless its lock is held.  Other files' blocks stay put
+// ============================================================================
+static void bfsDelayRoom(i32 inum) {
+  bfsAllocDelayed(inum);
+  for (i32 s = 0; s < DELAYBLOCKS; ++s) {
+    i32 other = bfsDelayOwner(s);
+    if (other < 0 || other == inum || bfsIsOpen(other)) continue;
+    bfsAllocOther(other, 0);
+  }
+}
+
+
+
+// ============================================================================
+// Reserve a free block for a new delayed block - see g_reserved.  If none is
+// left, but some were freed in the running transaction, commit it, as
+// bfsFindFreeRun does.  If the disk is full, abort: the write fails here,
+// not when the block is flushed
+// ============================================================================
+static void bfsReserve() {
+  pthread_mutex_lock(&g_allocLock);
+  while (g_numFree - g_reserved < 1 && g_freedBlks > 0) {
+    pthread_mutex_unlock(&g_allocLock);
+    jrnCommit();                            // calls bfsReleaseFreed
+    pthread_mutex_lock(&g_allocLock);
+  }
+  if (g_numFree - g_reserved < 1) FATAL(EDISKFULL);
+  ++g_reserved;
+  pthread_mutex_unlock(&g_allocLock);
+}
+
+
+
+// ============================================================================
+// Give back 'num' free blocks reserved by bfsReserve
+// ============================================================================
+static void bfsUnreserve(i32 num) {
+  pthread_mutex_lock(&g_allocLock);
+  g_reserved -= num;
+  pthread_mutex_unlock(&g_allocLock);
+}
+
+
+
+// ============================================================================
+// Free all the blocks of file 'inum', and set its size to 0: delayed blocks
+// are just dropped, never to be written, and their reservations given back.
+// Freeing the rest may change every allocation bitmap block, so commit
+// first, if the running transaction has not room for that
+// ============================================================================
+static void bfsTruncate(i32 inum) {
+  jrnReserve(JRNOPBLOCKS + g_super.numBitmapBlocks);
+
+  i32 dropped = 0;
+  pthread_mutex_lock(&g_delayLock);
+  for (i32 s = 0; s < DELAYBLOCKS && g_numDelay > 0; ++s) {
+    if (g_delay[s].inum != inum) continue;
+    bfsDelayDrop(s);
+    ++dropped;
+  }
+  pthread_mutex_unlock(&g_delayLock);
+  bfsUnreserve(dropped);
+
+  Inode inode;
+  bfsReadInode(inum, &inode);
+  bfsFreeTree((ExtNode*)&inode.depth, inode.ext);
+
+  memset(&inode, 0, sizeof(Inode));
+  bfsWriteInode(inum, &inode);
+}
+
+
+
+// ============================================================================
+// Allocate a free Inode from the in-memory Inode map, starting from where
+// the last allocation left off.  The map reaches disk at the next
+// bfsSyncBitmap.  Return its inum.  If every Inode is in use, abort
+// ============================================================================
+static i32 bfsAllocInode() {
+  pthread_mutex_lock(&g_allocLock);
+  i32 num  = g_super.numInodes;
+  i32 inum = mapNextFree(g_inodeMap, g_inodeRotor, num);
+  if (inum == num) inum = mapNextFree(g_inodeMap, 0, num);
+  if (inum == num) FATAL(EDIRFULL);
+
+  g_inodeMap[inum / 64] |= 1ULL << (inum % 64);
+  bfsMapDirty(g_inodeMapDirty, &g_numDirtyIMap, inum, 1);
+  g_inodeRotor = inum + 1;
+  pthread_mutex_unlock(&g_allocLock);
+  return inum;
+}
+
+
+
+// ============================================================================
+// Return the hash of file name 'fname' (FNV-1a)
+// ============================================================================
+static u32 bfsHash(str fname) {
+  u32 h = 2166136261u;
+  for (str c = fname; *c != 0; ++c) {
+    h ^= (u8)*c;
+    h *= 16777619u;
+  }
+  return h;
+}
+
+
+
+// ============================================================================
+// Look for 'fname' in the name cache.  If there, set *inum to its inum - EFNF
+// if the Directory has no such file - and return 1.  If not, return 0
+// ============================================================================
+static i32 bfsNameGet(str fname, i32* inum) {
+  u32 hash = bfsHash(fname);
+  NameEntry* e = &g_names[hash % NAMECACHESIZE];
+  if (e->fname[0] == 0 || e->hash != hash || strcmp(e->fname, fname) != 0) {
+    return 0;
+  }
+  *inum = e->inum;
+  return 1;
+}
+
+
+
+// ============================================================================
+// Record in the name cache that 'fname' is file 'inum' - or, if 'inum' is
+// EFNF, that there is no such file - replacing whatever name held its entry
+// ============================================================================
+static void bfsNameSet(str fname, i32 inum) {
+  if (fname[0] == 0 || strlen(fname) > FNAMESIZE - 1) return;
+  u32 hash = bfsHash(fname);
+  NameEntry* e = &g_names[hash % NAMECACHESIZE];
+  e->inum = inum;
+  e->hash = hash;
+  strcpy(e->fname, fname);
+}
+
+
+
+// ============================================================================
+// Return the number of slots in the Directory
+// ============================================================================
+static i32 bfsDirSlots() {
+  return g_super.numDirBlocks * (g_super.blockSize / sizeof(DirEntry));
+}
+
+
+
+// ============================================================================
+// Return a pointer to slot 's' of the in-memory Directory.  A caller that
+// changes it then calls bfsDirSave
+// ============================================================================
+static DirEntry* bfsDirSlot(i32 s) {
+  return &((DirEntry*)g_dir)[s];
+}
+
+
+
+// ============================================================================
+// Write the Dir block that holds slot 's' of the in-memory Directory, as part
+// of the running journal transaction
+// ============================================================================
+static void bfsDirSave(i32 s) {
+  i32 b = s / (g_super.blockSize / sizeof(DirEntry));
+  jrnWrite(g_super.dbnDir + b, g_dir + (i64)b * g_super.blockSize);
+}
+
+
+
+// ============================================================================
+// Return 1 if Dir entry 'e' is for file 'fname', else 0.  A name block is
+// only read if the first FNAMESIZE - 1 chars match
+// ============================================================================
+static i32 bfsDirMatch(DirEntry* e, str fname) {
+  if (e->nameDbn == 0) return strcmp(e->fname, fname) == 0;
+  if (strncmp(e->fname, fname, FNAMESIZE - 1) != 0) return 0;
+
+  i8 buf[MAXBLOCKSIZE];
+  cacheRead(e->nameDbn, buf);
+  return strcmp((char*)buf, fname) == 0;
+}
+
+
+
+// ============================================================================
+// Look for 'fname' in the Directory: an open-addressed hash table, which
+// fname's hash places in a home slot.  The slots from there on are searched
+// in turn, until either 'fname', or an empty slot, turns up.  Set *slot to
+// the slot 'fname' is in, and return its inum.  If not found, set *slot to
+// the empty slot that ended the search - where 'fname' would go - or -1 if
+// the Directory is full, and return EFNF
+// ============================================================================
+static i32 bfsDirFind(str fname, i32* slot) {
+  u32 hash = bfsHash(fname);
+  i32 num  = bfsDirSlots();
+  i32 s    = (i32)(hash % (u32)num);
+
+  for (i32 n = 0; n < num; ++n) {
+    DirEntry* e = bfsDirSlot(s);
+    i32 inum = EFNF;
+    i32 done = (e->fname[0] == 0);
+    if (!done && e->hash == hash && bfsDirMatch(e, fname)) {
+      inum = e->inum;
+      done = 1;
+    }
+    if (done) {
+      *slot = s;
+      return inum;
+    }
+    s = (s + 1) % num;
+  }
+
+  *slot = -1;
+  return EFNF;
+}
+
+
+
+// ============================================================================
+// Fill empty Directory slot 's', found by bfsDirFind, with 'fname' => 'inum'.
+// A name too long for the slot gets a name block, written through the
+// journal, to hold it in full; the slot holds as much of it as fits
+// ============================================================================
+static void bfsDirAdd(i32 s, str fname, i32 inum) {
+  i32 nameDbn = 0;
+  if (strlen(fname) > FNAMESIZE - 1) {
+    i8 buf[MAXBLOCKSIZE] = {0};
+    strcpy((char*)buf, fname);
+    i32 got = 0;
+    nameDbn = bfsFindFreeRun(0, 1, &got);
+    jrnWrite(nameDbn, buf);
+  }
+
+  DirEntry* e = bfsDirSlot(s);
+  memset(e, 0, sizeof(DirEntry));
+  e->inum    = inum;
+  e->hash    = bfsHash(fname);
+  e->nameDbn = nameDbn;
+  strncpy(e->fname, fname, FNAMESIZE - 1);
+  bfsDirSave(s);
+}
+
+
+
+// ============================================================================
+// Empty Directory slot 's', and free its name block, if any.  No "deleted"
+// marker is left behind, which would lengthen searches for good.  Instead,
+// each entry in the slots that follow, up to the next empty one, that is not
+// at or after its own home slot - as a search for it would then stop at the
+// hole - moves back into the hole, leaving a new one where it was
+// ============================================================================
+static void bfsDirRemove(i32 s) {
+  i32 num = bfsDirSlots();
+  if (bfsDirSlot(s)->nameDbn != 0) bfsFreeRun(bfsDirSlot(s)->nameDbn, 1);
+  memset(bfsDirSlot(s), 0, sizeof(DirEntry));
+  bfsDirSave(s);
+
+  for (i32 j = (s + 1) % num; j != s; j = (j + 1) % num) {
+    DirEntry* e = bfsDirSlot(j);
+    if (e->fname[0] == 0) break;            // end of the run
+    i32 home  = (i32)(e->hash % (u32)num);
+    i32 stays = (s < j) ? (home > s && home <= j) : (home > s || home <= j);
+    if (stays) continue;
+    *bfsDirSlot(s) = *e;
+    memset(e, 0, sizeof(DirEntry));
+    bfsDirSave(s);
+    bfsDirSave(j);
+    s = j;
+  }
+}
+
+// ============================================================================
+// Return the index of the last of the 'num' Extents in 'ent' - sorted by FBN
+// - that starts at or before FBN 'fbn'.  If none does, return -1.  A binary
+// search
+// ============================================================================
+static i32 bfsExtFind(Extent* ent, i32 num, i32 fbn) {
+  i32 lo = 0;                             // ent[lo - 1] starts <= fbn
+  i32 hi = num;                           // ent[hi] starts > fbn
+  while (lo < hi) {
+    i32 mid = (lo + hi) / 2;
+    if (ent[mid].fbn <= fbn) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return lo - 1;
+}
+
+
+
+// ============================================================================
+// Find the extent of file 'inode' that maps FBN 'fbn', by binary search in
+// each node on the way down the extent tree.  If there is one, copy it into
+// *ext, and return 1.  If not, copy the first extent past 'fbn' into *ext -
+// or, if there is none, set ext->len to 0 - and return 0
+// ============================================================================
+static i32 bfsExtLookup(Inode* inode, i32 fbn, Extent* ext) {
+  ExtNode* node = (ExtNode*)&inode->depth;
+  Extent*  ent  = inode->ext;
+  i32 dbn  = 0;                           // node's DBN.  0 => in the Inode
+  i32 next = -1;                          // first FBN mapped past this node
+
+  for (;;) {
+    i32 i = bfsExtFind(ent, node->numExt, fbn);
+    if (i + 1 < node->numExt) next = ent[i + 1].fbn;
+
+    if (node->depth == 0) {               // leaf
+      i32 hit = (i >= 0 && fbn - ent[i].fbn < ent[i].len);
+      Extent* e = NULL;
+      if (hit) {
+        e = &ent[i];
+      } else if (i + 1 < node->numExt) {
+        e = &ent[i + 1];
+      }
+      if (e != NULL) *ext = *e;
+      if (dbn != 0) cachePut(dbn, 0);
+      if (e == NULL && next >= 0) {       // next extent is in another leaf
+        bfsExtLookup(inode, next, ext);
+        return 0;
+      }
+      if (e == NULL) ext->len = 0;
+      return hit;
+    }
+
+    i32 child = ent[(i < 0) ? 0 : i].dbn;
+    if (dbn != 0) cachePut(dbn, 0);
+    dbn  = child;
+    node = (ExtNode*)cacheGet(dbn);
+    ent  = (Extent*)(node + 1);
+  }
+}
+
+
+
+// ============================================================================
+// Insert 'ext' as entry 'i' of extent tree node 'node', whose Extents 'ent'
+// hold at most 'cap'.  If the node is full, split it instead: move the upper
+// half of the entries into a new node at the same depth - all of them, if
+// 'root'; or just 'ext', if it goes last, so that appends leave full nodes
+// behind them.  The new node is allocated at or after DBN '*hint'.  Set
+// *split to the index entry for it, and return 1.  Otherwise, return 0
+// ============================================================================
+static i32 bfsExtPut(ExtNode* node, Extent* ent, i32 cap, i32 root, i32 i,
+                     Extent* ext, i32* hint, Extent* split) {
+  i32 num = node->numExt;
+  if (num < cap) {
+    memmove(&ent[i + 1], &ent[i], (num - i) * sizeof(Extent));
+    ent[i] = *ext;
+    ++node->numExt;
+    return 0;
+  }
+
+  Extent all[NODEEXTENTS + 1];
+  memcpy(all, ent, i * sizeof(Extent));
+  all[i] = *ext;
+  memcpy(&all[i + 1], &ent[i], (num - i) * sizeof(Extent));
+  ++num;
+
+  i32 keep = num / 2;
+  if (i == num - 1) keep = num - 1;
+  if (root)         keep = 0;
+
+  i8 buf[MAXBLOCKSIZE] = {0};
+  ExtNode* half = (ExtNode*)buf;
+  half->depth  = node->depth;
+  half->numExt = num - keep;
+  memcpy(half + 1, &all[keep], (num - keep) * sizeof(Extent));
+
+  i32 got = 0;
+  i32 dbn = bfsFindFreeRun(*hint, 1, &got);
+  jrnWrite(dbn, buf);
+  *hint = dbn + 1;
+
+  memcpy(ent, all, keep * sizeof(Extent));
+  node->numExt = keep;
+
+  split->fbn = all[keep].fbn;
+  split->dbn = dbn;
+  split->len = 0;
+  return 1;
+}
+
+
+
+// ============================================================================
+// Add extent 'ext', whose FBNs are not yet mapped, to the subtree under
+// extent tree node 'node' - see bfsExtPut for 'cap', 'root', 'hint' and
+// 'split'.  In the leaf, an extent that 'ext' continues, both in the file and
+// on disk, is lengthened rather than a new one added.  Nodes changed on the
+// way down are written through the journal.  If 'node' splits, return 1
+// ============================================================================
+static i32 bfsExtInsert(ExtNode* node, Extent* ent, i32 cap, i32 root,
+                        Extent* ext, i32* hint, Extent* split) {
+  i32 num = node->numExt;
+  i32 i   = bfsExtFind(ent, num, ext->fbn);
+
+  if (node->depth == 0) {                 // leaf
+    Extent* prev = (i >= 0)      ? &ent[i]     : NULL;
+    Extent* next = (i + 1 < num) ? &ent[i + 1] : NULL;
+    if (prev != NULL && prev->fbn + prev->len == ext->fbn &&
+                        prev->dbn + prev->len == ext->dbn) {
+      prev->len += ext->len;
+      if (next != NULL && prev->fbn + prev->len == next->fbn &&
+                          prev->dbn + prev->len == next->dbn) {
+        prev->len += next->len;             // 'ext' filled the gap
+        memmove(next, next + 1, (num - i - 2) * sizeof(Extent));
+        --node->numExt;
+      }
+      return 0;
+    }
+    if (next != NULL && ext->fbn + ext->len == next->fbn &&
+                        ext->dbn + ext->len == next->dbn) {
+      next->fbn  = ext->fbn;
+      next->dbn  = ext->dbn;
+      next->len += ext->len;
+      return 0;
+    }
+    return bfsExtPut(node, ent, cap, root, i + 1, ext, hint, split);
+  }
+
+  i32 c = (i < 0) ? 0 : i;                // child to add it under
+  if (ext->fbn < ent[c].fbn) ent[c].fbn = ext->fbn;
+
+  i32 dbn = ent[c].dbn;
+  ExtNode* child = (ExtNode*)cacheGet(dbn);
+  i32 most = (g_super.blockSize - sizeof(ExtNode)) / sizeof(Extent);
+  Extent sub;
+  i32 grew = bfsExtInsert(child, (Extent*)(child + 1), most, 0, ext, hint,
+                          &sub);
+  jrnPut(dbn);
+  if (!grew) return 0;
+  return bfsExtPut(node, ent, cap, root, c + 1, &sub, hint, split);
+}
+
+
+
+// ============================================================================
+// Add extent 'ext' to the extent tree of 'inode' - see bfsExtInsert.  If the
+// root, in the Inode, overflows, its entries move down into a new node, and
+// the tree grows a level.  New nodes are allocated at or after DBN '*hint'.
+// 'inode' is updated in memory only; the caller writes it back
+// ============================================================================
+static void bfsExtAdd(Inode* inode, Extent* ext, i32* hint) {
+  ExtNode* root = (ExtNode*)&inode->depth;
+  Extent split;
+  if (bfsExtInsert(root, inode->ext, NUMEXTENTS, 1, ext, hint, &split)) {
+    ++root->depth;
+    root->numExt  = 1;
+    inode->ext[0] = split;
+  }
+}
+
+
+
+// ============================================================================
+// Claim the next *numb bytes of the file open on File Descriptor 'fd', from
+// its cursor on, for fsRead: clip *numb at end-of-file, and move the cursor
+// past them.  Threads reading through the same descriptor at once so get
+// consecutive pieces of the file, never the same one.  Return the offset of
+// the first byte.  If the cursor is beyond end-of-file, abort
+// ============================================================================
+i64 bfsAdvanceCursor(i32 fd, i32* numb) {
+  pthread_mutex_lock(&g_oftLock);
+  FDTE* e  = bfsFdEntry(fd);
+  i32 ofte = bfsScanOFT(e->inum);
+  i64 curs = e->curs;
+  i64 size = g_oft[ofte].inode.size;
+  if (curs < 0 || curs > size) FATAL(EBADCURS);
+  if (*numb > size - curs) *numb = (i32)(size - curs);
+  e->curs = curs + *numb;
+  pthread_mutex_unlock(&g_oftLock);
+  return curs;
+}
+
+
 
 // ============================================================================
 // Allocate a free disk block for the file whose Inode number is 'inum' and
@@ -10,355 +879,1010 @@
 // allocated.  On failure, abort
 // ============================================================================
 i32 bfsAllocBlock(i32 inum, i32 fbn) {
+  i32 dbn = 0;
+  bfsAllocRun(inum, fbn, fbn, &dbn);
+  return dbn;                             // allocated DBN
+}
+
+
+
+// ============================================================================
+// Give DBNs to all the delayed blocks of file 'inum' - see g_delay - and
+// write them out.  Each run of consecutive FBNs gets as few runs of DBNs as
+// the disk allows, and is written with one IO per DELAYRUN blocks, out of
+// the free blocks reserved for them.  Called within a journal operation,
+// with the file's Inode lock held exclusive.  Return the number of blocks
+// allocated
+// ============================================================================
+i32 bfsAllocDelayed(i32 inum) {
+  i32 slots[DELAYBLOCKS];
+  i32 num = 0;
+  pthread_mutex_lock(&g_delayLock);
+  for (i32 s = 0; s < DELAYBLOCKS && num < g_numDelay; ++s) {
+    if (g_delay[s].inum == inum) slots[num++] = s;
+  }
+  pthread_mutex_unlock(&g_delayLock);
+  qsort(slots, num, sizeof(i32), bfsDelayCmp);
+  g_spend += num;                         // see bfsFindFreeRun
+
+  i32 bsize = g_super.blockSize;
+  for (i32 i = 0; i < num; ) {
+    i32 j = i + 1;                        // slots[i .. j-1]: consecutive
+    while (j < num && j - i < DELAYRUN &&
+           g_delay[slots[j]].fbn == g_delay[slots[j - 1]].fbn + 1) ++j;
+
+    i32 dbn = 0;
+    i32 got = bfsAllocRun(inum, g_delay[slots[i]].fbn,
+                          g_delay[slots[j - 1]].fbn, &dbn);
+    for (i32 k = 0; k < got; ++k) {
+      memcpy(g_delayRun + k * bsize, g_delayData[slots[i + k]], bsize);
+    }
+    bfsWriteRun(dbn, got, g_delayRun);
+
+    pthread_mutex_lock(&g_delayLock);
+    for (i32 k = 0; k < got; ++k) bfsDelayDrop(slots[i + k]);
+    pthread_mutex_unlock(&g_delayLock);
+    i += got;
+  }
+  bfsUnreserve(g_spend);                  // any not spent
+  g_spend = 0;
+  return num;
+}
+
+
+
+// ============================================================================
+// Allocate a run of contiguous free disk blocks for the file whose Inode
+// number is 'inum', and assign them to FBNs 'fbnFirst' onwards, up to
+// 'fbnLast', none of which may be mapped yet.  The run is sought right after
+// the block that holds FBN 'fbnFirst' - 1, so that appends lay the file out
+// sequentially on disk, and just lengthen the file's last extent.  If a
+// fragmented disk cuts the run short, it covers fewer FBNs than asked for.
+// On success, set *pdbn to the first DBN of the run, and return the number
+// of FBNs mapped.  On failure, abort
+// ============================================================================
+i32 bfsAllocRun(i32 inum, i32 fbnFirst, i32 fbnLast, i32* pdbn) {
 
-  if (inum < 0)       FATAL(EBADINUM);
-  if (inum > MAXINUM) FATAL(EBADINUM);
-  if (fbn  < 0)       FATAL(EBADFBN);
-  if (fbn  > MAXFBN)  FATAL(EBADFBN);
+  if (inum < 0)                  FATAL(EBADINUM);
+  if (inum >= g_super.numInodes) FATAL(EBADINUM);
+  if (fbnFirst < 0)              FATAL(EBADFBN);
+  if (fbnLast >= bfsMaxFbn())    FATAL(EBADFBN);
+  if (fbnLast < fbnFirst)        FATAL(EBADFBN);
+  if (pdbn == NULL)              FATAL(ENULLPTR);
+
+  Inode inode;
+  bfsReadInode(inum, &inode);
+
+  // A large write takes many runs.  Adding an extent may split a node, and
+  // its parent, at each level of the tree
+
+  jrnReserve(JRNOPBLOCKS + 2 * inode.depth);
+
+  // Place the run right after the file's preceding block, if it has one
+
+  i32 hint = 0;
+  if (fbnFirst > 0) {
+    i32 prev = bfsFbnToDbn(inum, fbnFirst - 1);
+    if (prev > 0) hint = prev + 1;
+  }
+
+  // Grab the run, and record it as an extent.  Any tree node that needs
+  // adding goes just after it
+
+  i32 num = 0;
+  i32 dbn = bfsFindFreeRun(hint, fbnLast - fbnFirst + 1, &num);
+
+  Extent ext = { fbnFirst, dbn, num };
+  hint = dbn + num;
+  bfsExtAdd(&inode, &ext, &hint);
+  bfsWriteInode(inum, &inode);
+
+  *pdbn = dbn;
+  return num;
+}
+
+
+
+// ============================================================================
+// Free File Descriptor 'fd', from bfsOpenFd.  The file it was open on stays
+// referenced in the OFT: see bfsDerefOFT.  If 'fd' is not open, abort
+// ============================================================================
+i32 bfsCloseFd(i32 fd) {
+  pthread_mutex_lock(&g_oftLock);
+  bfsFdEntry(fd)->inum = -1;
+  pthread_mutex_unlock(&g_oftLock);
+  return 0;
+}
 
-  // Grab the next free block in the BFS disk
 
-  i32 dbn = bfsFindFreeBlock();
 
-  // Update the corresponding Inode, or IndirectBlock
+// ============================================================================
+// Create file 'fname', and open it.  If it already exists, empty it.
+// Otherwise, allocate it a free Inode, and add it to the Directory.  Leave
+// the size of the file as zero, until the user performs a write, or a seek
+// into the file.  On success, return the file's inum.  If 'fname' is "",
+// return EFNF.  On failure, abort
+// ============================================================================
+i32 bfsCreateFile(str fname) {
 
-  i8 buf8[BYTESPERBLOCK] = {0};           // 1-block buffer
-  bioRead(DBNINODES, buf8);
- 
-  Inode* pinodes = (Inode*)buf8;          // array of Inodes
-  Inode* pinode  = &pinodes[inum];        // target Inode
+  if (fname == NULL) FATAL(ENULLPTR);
 
-  if (fbn < NUMDIRECT) {                  // in direct[] array?
-    pinode->direct[fbn] = dbn;
-    bioWrite(DBNINODES, buf8);
-    return dbn;
-  } else {                                // in indirect block?
-    i16 buf16[I16SPERBLOCK]= {0};
-    i32 dbnIndirect = pinode->indirect;   // DBN of indirect block
+  if (strlen(fname) > FNAMEMAX - 1) FATAL(EBIGFNAME);   // fname too big
+  if (fname[0] == 0) return EFNF;
+
+  i32 slot = 0;
+  i32 inum = bfsDirFind(fname, &slot);
+  if (inum >= 0) {                                      // overwrite it
+    bfsLockInode(inum, 1);                              // ... once unread
+    bfsTruncate(inum);
+    bfsUnlockInode(inum);
+    bfsRefOFT(inum);
+    return inum;
+  }
+  if (slot < 0) FATAL(EDIRFULL);                        // Directory full
 
-    if (dbnIndirect == 0) {               // not yet allocated
-      dbnIndirect = bfsFindFreeBlock();
-      pinode->indirect = dbnIndirect;
-    }
+  if (strlen(fname) > FNAMESIZE - 1) jrnReserve(JRNOPBLOCKS + 1);
+  inum = bfsAllocInode();
+  Inode inode;
+  memset(&inode, 0, sizeof(Inode));
+  bfsWriteInode(inum, &inode);
+  bfsDirAdd(slot, fname, inum);
+  bfsNameSet(fname, inum);
+  bfsRefOFT(inum);
+  return inum;
+}
 
-    bioRead(dbnIndirect, buf16);
-    buf16[fbn - NUMDIRECT] = dbn;
-    bioWrite(dbnIndirect, buf16);
-    bioWrite(DBNINODES, buf8);
-  }
 
-  return dbn;                             // allocated DBN
 
+// ============================================================================
+// Return the data of FBN 'fbn' of file 'inum' - a hole - as a delayed block,
+// held in memory until bfsAllocDelayed gives it a DBN.  If it is not delayed
+// yet, reserve a free block for it - see bfsReserve - and take a slot for
+// it, zeroed; should none be free, first make room - see bfsDelayRoom.
+// Called within a journal operation, with the file's Inode lock held
+// exclusive.  If no slot can be had, return NULL
+// ============================================================================
+void* bfsDelayBlock(i32 inum, i32 fbn) {
+  pthread_mutex_lock(&g_delayLock);
+  i32 s = bfsDelayFind(inum, fbn);
+  pthread_mutex_unlock(&g_delayLock);
+  if (s >= 0) return g_delayData[s];
+
+  bfsReserve();
+  pthread_mutex_lock(&g_delayLock);
+  if (g_delayFree < 0) {
+    pthread_mutex_unlock(&g_delayLock);
+    bfsDelayRoom(inum);
+    pthread_mutex_lock(&g_delayLock);
+  }
+  if (g_delayFree >= 0) {
+    s = g_delayFree;
+    g_delayFree = g_delay[s].hnext;
+    i32 b = bfsDelayHash(inum, fbn);
+    g_delay[s].inum  = inum;
+    g_delay[s].fbn   = fbn;
+    g_delay[s].hnext = g_delayHash[b];
+    g_delayHash[b] = s;
+    ++g_numDelay;
+    memset(g_delayData[s], 0, g_super.blockSize);
+  }
+  pthread_mutex_unlock(&g_delayLock);
+  if (s < 0) bfsUnreserve(1);
+  return (s < 0) ? NULL : g_delayData[s];
 }
 
 
 
 // ============================================================================
-// Create file 'fname'.  Find a free inum; ie, free slot in the Directory.
-// Leave the size of the file as zero, until the user performs a write, or a
-// seek into the file.  On success, return the file's inum.  On failure, abort
+// Delete file 'fname': free its blocks and its Inode, and remove it from the
+// Directory.  On success, return 0.  If there is no such file, return EFNF;
+// if it is open, EFILEOPEN
 // ============================================================================
-i32 bfsCreateFile(str fname) {
+i32 bfsDeleteFile(str fname) {
 
   if (fname == NULL) FATAL(ENULLPTR);
 
-  if (strlen(fname) > FNAMESIZE - 1) FATAL(EBIGFNAME);  // fname too big
-
-  i8 buf[BYTESPERBLOCK] = {0};
+  i32 slot = 0;
+  i32 inum = bfsDirFind(fname, &slot);
+  if (inum < 0) return EFNF;
 
-  bioRead(DBNDIR, buf);
+  i32 ofte = bfsLookupOFTE(inum);
+  if (ofte >= 0 && g_oft[ofte].refs > 0) return EFILEOPEN;
 
-  Dir* dir = (Dir*)buf;
-
-  for (int inum = 0; inum < NUMINODES; ++inum) {        // search Directory
-    if (strlen(dir->fname[inum]) == 0) {                // free slot
-      strcpy(dir->fname[inum], fname);
-      bioWrite(DBNDIR, dir);
-      bfsRefOFT(inum);
-      return inum;
-    }
+  bfsTruncate(inum);
+  if (ofte >= 0) {                        // write back the emptied Inode
+    pthread_mutex_lock(&g_oftLock);
+    bfsFlushOFTE(ofte);
+    g_oft[ofte].inum = -1;
+    pthread_mutex_unlock(&g_oftLock);
   }
 
-  FATAL(EDIRFULL);                                      // Directory full
-  return 0;                                             // pacify compiler
+  pthread_mutex_lock(&g_allocLock);
+  g_inodeMap[inum / 64] &= ~(1ULL << (inum % 64));
+  bfsMapDirty(g_inodeMapDirty, &g_numDirtyIMap, inum, 1);
+  pthread_mutex_unlock(&g_allocLock);
+
+  bfsDirRemove(slot);
+  bfsNameSet(fname, EFNF);
+  return 0;
 }
 
 
 
 // ============================================================================
 // Dereference file with Inode number 'inum' in the Open File Table.  If
-// refcount reaches 0, free up that entry in the OFT
+// refcount reaches 0, write back its Inode, and free up that entry in the OFT
 // ============================================================================
 i32 bfsDerefOFT(i32 inum) {
-  i32 ofte = bfsFindOFTE(inum);
-  --g_oft[ofte].refs;
+  pthread_mutex_lock(&g_oftLock);
+  i32 ofte = bfsClaimOFTE(inum);
+  if (g_oft[ofte].refs > 0) --g_oft[ofte].refs;
   if (g_oft[ofte].refs == 0) {
+    bfsFlushOFTE(ofte);
     g_oft[ofte].inum = -1;
-    g_oft[ofte].curs = 0;
   }
+  pthread_mutex_unlock(&g_oftLock);
   return 0;
 }
 
 
 
 // ============================================================================
-// Extend file 'inum' out to FBN 'fbn'
+// Return the number of allocation bitmap blocks changed since the last commit
 // ============================================================================
-i32 bfsExtend(i32 inum, i32 fbn) {
-  i32 size = bfsGetSize(inum);
-  i32 fbnLast = (size + 1) / BYTESPERBLOCK;
-  for (i32 f = fbnLast; f <= fbn; ++f) {
-    bfsAllocBlock(inum, f);
-  }
-  return 0;
+i32 bfsDirtyBitmap() {
+  pthread_mutex_lock(&g_allocLock);
+  i32 num = g_numDirtyMap;
+  pthread_mutex_unlock(&g_allocLock);
+  return num;
 }
 
 
 
 // ============================================================================
-// Use Inode to find the DBN used to store file block 'fbn'.  Return ENODBN
-// if not yet mapped
+// Use Inode to find the DBN used to store file block 'fbn' - see bfsMapRun.
+// Return ENODBN if not yet mapped
 // ============================================================================
 i32 bfsFbnToDbn(i32 inum, i32 fbn) {
+  i32 run = 0;
+  return bfsMapRun(inum, fbn, &run);
+}
 
-  if (inum < 0)       FATAL(EBADINUM);
-  if (inum > MAXINUM) FATAL(EBADINUM);
-  if (fbn  < 0)       FATAL(EBADFBN);
-  if (fbn  > MAXFBN)  FATAL(EBADFBN);
-
-  Inode inode;
-  
-  bfsReadInode(inum, &inode);
 
-  if (fbn < NUMDIRECT) {            // in direct[] array?
-    i32 dbn = inode.direct[fbn];
-    return (dbn == 0) ? ENODBN : dbn;
-  }
 
-  // fbn is not in direct, so check indirect block.  If it doesn't exist,
-  // then allocate an empty indirect block.  But return ENODBN for the
-  // caller to handle grabing a new data block.
+// ============================================================================
+// Return the inum of the file open on File Descriptor 'fd' (user-visible).  If
+// 'fd' is not open, abort
+// ============================================================================
+i32 bfsFdToInum(i32 fd) { 
+  pthread_mutex_lock(&g_oftLock);
+  i32 inum = bfsFdEntry(fd)->inum;
+  pthread_mutex_unlock(&g_oftLock);
+  return inum;
+}
 
-  if (inode.indirect == 0) {      // no indirect block yet allocated
-    i32 dbn = bfsFindFreeBlock();
-    inode.indirect = dbn;
-    bfsWriteInode(inum, &inode);
-    return ENODBN;
-  }
 
-  // Check the indirect block
 
-  i16 buf[NUMINDIRECT] = {0};
-  bioRead(inode.indirect, buf);
 
-  i32 dbn = buf[fbn - NUMDIRECT];
-  return (dbn == 0) ? ENODBN : dbn;
+// ============================================================================
+// Find 'inum' in the Open File Table (OFT).  If not found, create an entry,
+// holding a copy of the file's Inode, in a free slot - or failing that, in a
+// slot whose file is no longer open.  Creating one may write back the Inode
+// of the file that held the slot, so is only done within a journal operation.
+// Return the index within the OFT.  On failure, EOFTFULL
+// ============================================================================
+i32 bfsFindOFTE(i32 inum) {
+  pthread_mutex_lock(&g_oftLock);
+  i32 ofte = bfsClaimOFTE(inum);
+  pthread_mutex_unlock(&g_oftLock);
+  return ofte;
 }
 
 
 
 // ============================================================================
-// Convert FileDescriptor (user-visible) to Inum (internal)
+// Write back the cached dirty data blocks of file 'inum' - or, if the file
+// has more than FLUSHLIST blocks, every dirty block.  In BIOMMAP mode file
+// data is not cached, so there is nothing to do here - see bioSync
 // ============================================================================
-i32 bfsFdToInum(i32 fd) { 
-  i32 inum = fd - INUMTOFD; 
-  if (inum < 0) FATAL(EBADINUM);
-  return inum;
+i32 bfsFlushFile(i32 inum) {
+  if (bioMode() == BIOMMAP) return 0;
+
+  // The cache holds at most NUMCACHEBLOCKS blocks: for a big file, writing
+  // back all of them costs less than walking the file's block map
+
+  i32 bsize = g_super.blockSize;
+  i64 nfbn  = (bfsGetSize(inum) + bsize - 1) / bsize;
+  if (nfbn > FLUSHLIST) return cacheFlush();
+
+  i32 dbns[FLUSHLIST];
+  i32 num = 0;
+  for (i32 fbn = 0; fbn < nfbn; ) {
+    i32 run = 0;
+    i32 dbn = bfsMapRun(inum, fbn, &run);
+    if (run > nfbn - fbn) run = (i32)(nfbn - fbn);
+    for (i32 i = 0; dbn > 0 && i < run; ++i) dbns[num++] = dbn + i;
+    fbn += run;
+  }
+  return cacheFlushList(dbns, num);
 }
 
 
 
+// ============================================================================
+// If the in-memory Inode held in OFT entry 'ofte' has changed, write it back
+// to its Inodes block
+// ============================================================================
+i32 bfsFlushOFTE(i32 ofte) {
+  if (g_oft[ofte].inum < 0 || !g_oft[ofte].dirty) return 0;
+
+  bfsStoreInode(g_oft[ofte].inum, &g_oft[ofte].inode);
+  g_oft[ofte].dirty = 0;
+  return 0;
+}
+
+
 
 // ============================================================================
-// Find 'inum' in the Open File Table (OFT).  If not found, create an entry.
-// Return the index within the OFT.  On failure, EOFTFULL
+// If FBN 'fbn' of file 'inum' is a delayed block - written, but not yet given
+// a DBN - return its data, held in memory.  If not, return NULL, and set *run
+// to the number of FBNs from 'fbn' up to the file's next delayed block, or
+// bfsMaxFbn() - 'fbn' if it has none.  The caller holds the file's Inode
+// lock, so the block cannot go while it is being used
 // ============================================================================
-i32 bfsFindOFTE(i32 inum) {
-  for (int i = 0; i < NUMOFTENTRIES; ++i) {
-    if (g_oft[i].inum == inum) return i;
-  }
-  
-  // Not found, so look for an empty OFTE
-
-  for (int i = 0; i < NUMOFTENTRIES; ++i) {
-    if (g_oft[i].inum == -1) {
-      g_oft[i].inum = inum;
-      g_oft[i].curs = 0;
-      g_oft[i].refs = 1;
-      return i;
-    }
+void* bfsGetDelayed(i32 inum, i32 fbn, i32* run) {
+  *run = bfsMaxFbn() - fbn;
+  pthread_mutex_lock(&g_delayLock);
+  i32 s = (g_numDelay > 0) ? bfsDelayFind(inum, fbn) : -1;
+  for (i32 i = 0; s < 0 && i < DELAYBLOCKS && g_numDelay > 0; ++i) {
+    i32 gap = g_delay[i].fbn - fbn;
+    if (g_delay[i].inum == inum && gap > 0 && gap < *run) *run = gap;
   }
-  FATAL(EOFTFULL);      // no-return
-  return 0;             // pacify compiler
+  pthread_mutex_unlock(&g_delayLock);
+  return (s < 0) ? NULL : g_delayData[s];
 }
 
 
 
 // ============================================================================
-// Allocate the next free block from the Freelist.  Adjust Freelist
-// accordingly.  On success, return DBN.  FATAL otherwise
+// Return a pointer to the contents of data block 'dbn', so that fsRead and
+// fsWrite can copy straight between it and the user's buffer.  In BIOMMAP
+// mode this points into the mapped BFS disk; otherwise, into the block cache.
+// The block stays pinned until the matching bfsPutData
 // ============================================================================
-i32 bfsFindFreeBlock() {
-  i8 buf8[BYTESPERBLOCK] = {0};
-  bioRead(DBNSUPER, buf8);
-  Super* super = (Super*)buf8;
+void* bfsGetData(i32 dbn) {
+  if (bioMode() == BIOMMAP) return bioGetBlock(dbn);
+  return cacheGet(dbn);
+}
+
 
-  i32 dbn = super->firstFree;
-  if (dbn == 0) FATAL(EDISKFULL);
 
-  i16 buf16[I16SPERBLOCK] = {0};      // for next free block
-  bioRead(dbn, buf16);
+// ============================================================================
+// Allocate the next free block from the in-memory allocation bitmap, starting
+// from where the last allocation left off.  The bitmap reaches disk at the
+// next bfsSyncBitmap.  On success, return DBN.  FATAL otherwise
+// ============================================================================
+i32 bfsFindFreeBlock() {
+  i32 got = 0;
+  return bfsFindFreeRun(0, 1, &got);
+}
 
-  super->firstFree = buf16[0];        // new head of Freelist
 
-  bioWrite(DBNSUPER, buf8);           // update SuperBlock
 
-  return dbn;
+// ============================================================================
+// Allocate a run of up to 'want' contiguous free blocks from the in-memory
+// allocation bitmap.  Search starts at DBN 'hint' (0 => where the last
+// allocation left off) and wraps round the disk once.  Take the first run of
+// 'want' blocks; failing that, the longest run seen.  On success, set *got to
+// the run length, and return its first DBN.  If no block is free, but some
+// were freed in the running transaction - see g_freed - commit it, so that
+// they can be had, and search again.  Such a commit holds the operation
+// running so far, which at worst, in a crash, leaks the blocks it allocated.
+// Blocks reserved for delayed blocks count as in use, but for those this
+// thread may spend - see g_reserved.  If the disk is full, abort
+// ============================================================================
+i32 bfsFindFreeRun(i32 hint, i32 want, i32* got) {
+  if (got == NULL) FATAL(ENULLPTR);
+  if (want < 1)    FATAL(EBIGNUMB);
+
+  i32 first = g_super.dbnData;
+  i32 last  = g_super.numBlocks;              // just past the last DBN
+  i32 bestLen = 0;
+  i32 best    = -1;
+  i32 avail   = 0;                            // # this search may take
+  pthread_mutex_lock(&g_allocLock);
+  for (;;) {
+    if (hint < first || hint >= last) hint = g_rotor;
+    if (hint < first || hint >= last) hint = first;
+    avail = g_numFree - g_reserved + g_spend;
+    if (avail > 0) {
+      best = mapFindRun(&g_map, first, last, hint, want, &bestLen);
+    }
+    if (best >= 0 || g_freedBlks == 0) break;
+    pthread_mutex_unlock(&g_allocLock);
+    jrnCommit();                            // calls bfsReleaseFreed
+    pthread_mutex_lock(&g_allocLock);
+  }
+  if (best < 0) FATAL(EDISKFULL);
+  if (bestLen > want)  bestLen = want;
+  if (bestLen > avail) bestLen = avail;
+
+  i32 spent = (bestLen < g_spend) ? bestLen : g_spend;
+  g_reserved -= spent;
+  g_spend    -= spent;
+
+  mapSet(&g_map, best, bestLen);
+  bfsMapDirty(g_bitmapDirty, &g_numDirtyMap, best, bestLen);
+  g_numFree -= bestLen;
+  g_rotor    = best + bestLen;
+  pthread_mutex_unlock(&g_allocLock);
+
+  *got = bestLen;
+  return best;
 }
 
 
 // ============================================================================
-// Initialize the Freelist
+// Initialize the allocation bitmap: the metadata blocks, and the padding bits
+// beyond the end of the disk, are in use; every other block is free.  Only
+// the bitmap blocks with a bit set are written: the rest, all free, are left
+// as holes in the sparse image, which read as zeroes.  Data blocks are not
+// touched - a block is always written before it is read
 // ============================================================================
 i32 bfsInitFreeList() {
-  i16 buf[I16SPERBLOCK] = {0};
-  i32 ret = 0;
+  i32 bsize = g_super.blockSize;
+  i64 bits  = (i64)bsize * 8;                   // DBNs per bitmap block
+  i8  buf[MAXBLOCKSIZE];
+  u64* bitmap = (u64*)buf;
+
+  for (i32 b = 0; b < g_super.numBitmapBlocks; ++b) {
+    i64 base = b * bits;                        // DBN of this block's bit 0
+    if (base >= g_super.dbnData && base + bits <= g_super.numBlocks) {
+      continue;                                 // all free: leave a hole
+    }
+    memset(buf, 0, bsize);
+    for (i32 bit = 0; bit < bits; ++bit) {
+      i64 dbn = base + bit;
+      if (dbn < g_super.dbnData || dbn >= g_super.numBlocks) {
+        bitmap[bit / 64] |= 1ULL << (bit % 64);
+      }
+    }
+    cacheWrite(g_super.dbnBitmap + b, buf);
+  }
+  return 0;
+}
+
+
+
+// ============================================================================
+// Write the initial Dir blocks, of all zeroes
+// ============================================================================
+i32 bfsInitDir(FILE* fp) {
+  if (fp == NULL) FATAL(ENULLPTR);
+  bfsZero(g_super.dbnDir, g_super.numDirBlocks);
+  return 0;
+}
+
+
 
-  for (int dbn = NUMMETA; dbn < BLOCKSPERDISK - 1; ++dbn) {
-    buf[0] = dbn + 1;
-    bioWrite(dbn, (i8*)buf);
+// ============================================================================
+// Work out the layout of a new BFS disk of 'numBlocks' blocks, each of
+// 'blockSize' bytes, with room for 'numInodes' files, into g_super; and set
+// the open disk to that geometry.  In DBN order: the SuperBlock, the Inodes,
+// the Dir, the allocation bitmap, the Inode map and the journal, each as many
+// blocks as it needs, then the data blocks.  The Dir has enough slots that
+// at most DIRFILL percent are ever in use.  The journal grows with the disk,
+// and must hold a transaction big enough for the bitmap, the SuperBlock, an
+// Inode map block, and the Inodes of every open file.  On success, return 0.
+// If the geometry will not work, abort
+// ============================================================================
+i32 bfsInitGeometry(i32 numBlocks, i32 numInodes, i32 blockSize) {
+  if (blockSize < BYTESPERBLOCK || blockSize > MAXBLOCKSIZE) FATAL(EBADGEOM);
+  if ((blockSize & (blockSize - 1)) != 0) FATAL(EBADGEOM);
+  if (numInodes < 1 || numBlocks < 1)     FATAL(EBADGEOM);
+
+  i64 bsize = blockSize;
+  i64 perDirBlock = bsize / sizeof(DirEntry);
+  i64 dirSlots    = ((i64)numInodes * 100 + DIRFILL - 1) / DIRFILL;
+  Super* sb = &g_super;
+  memset(sb, 0, sizeof(Super));
+  sb->magic           = BFSMAGIC;
+  sb->blockSize       = blockSize;
+  sb->numBlocks       = numBlocks;
+  sb->numInodes       = numInodes;
+  sb->dbnInodes       = DBNSUPER + 1;
+  sb->numInodeBlocks  = ((i64)numInodes * INODESIZE + bsize - 1) / bsize;
+  sb->dbnDir          = sb->dbnInodes + sb->numInodeBlocks;
+  sb->numDirBlocks    = (dirSlots + perDirBlock - 1) / perDirBlock;
+  sb->dbnBitmap       = sb->dbnDir + sb->numDirBlocks;
+  sb->numBitmapBlocks = ((i64)numBlocks + bsize * 8 - 1) / (bsize * 8);
+  sb->dbnInodeMap     = sb->dbnBitmap + sb->numBitmapBlocks;
+  sb->numInodeMapBlocks = ((i64)numInodes + bsize * 8 - 1) / (bsize * 8);
+  sb->dbnJournal      = sb->dbnInodeMap + sb->numInodeMapBlocks;
+
+  i32 inodeBlocks = (sb->numInodeBlocks < NUMOFTENTRIES) ? sb->numInodeBlocks
+                                                         : NUMOFTENTRIES;
+  i32 txWant = JRNOPBLOCKS + sb->numBitmapBlocks + 1 + inodeBlocks + 1;
+  if (txWant > JRNMAXBLOCKS) FATAL(EBADGEOM);   // bitmap too big
+
+  i32 numJournal = numBlocks / 64;
+  if (numJournal < JRNBLOCKS)            numJournal = JRNBLOCKS;
+  if (numJournal < 2 * (1 + txWant) + 1) numJournal = 2 * (1 + txWant) + 1;
+  if (numJournal > 2 * (1 + JRNMAXBLOCKS) + 1) {
+    numJournal = 2 * (1 + JRNMAXBLOCKS) + 1;    // no use for more
   }
+  sb->numJournal = numJournal;
+  sb->dbnData    = sb->dbnJournal + numJournal;
 
-  buf[0] = 0;
-  bioWrite(BLOCKSPERDISK - 1, (i8*)buf);      // end of Freelist
+  if ((i64)sb->dbnData >= numBlocks) FATAL(EBADGEOM);  // no data blocks
+  sb->numFree = numBlocks - sb->dbnData;
 
-  return ret;
+  return bioSetGeometry(blockSize, numBlocks);
 }
 
 
 
 // ============================================================================
-// Write the initial Dir block, of all zeroes, into DBN 2
+// Write the initial Inode map blocks, of all zeroes: every Inode is free
 // ============================================================================
-i32 bfsInitDir(FILE* fp) {
+i32 bfsInitInodeMap(FILE* fp) {
   if (fp == NULL) FATAL(ENULLPTR);
-  i8 buf[BYTESPERBLOCK] = {0};
-  return bioWrite(DBNDIR, buf);
+  bfsZero(g_super.dbnInodeMap, g_super.numInodeMapBlocks);
+  return 0;
 }
 
 
 
 // ============================================================================
-// Write the initial Inodes block, of all zeroes, into DBN 1
+// Write the initial Inodes blocks, of all zeroes
 // ============================================================================
 i32 bfsInitInodes(FILE* fp) {
   if (fp == NULL) FATAL(ENULLPTR);
-  i8 buf[BYTESPERBLOCK] = {0};
-  return bioWrite(DBNINODES, buf);
+  bfsZero(g_super.dbnInodes, g_super.numInodeBlocks);
+  return 0;
 }
 
 
 
 // ============================================================================
-// Initialize the Open File Table to all zeroes
+// Initialize the Open File Table, and the File Descriptor Table, to all
+// zeroes, and empty g_delay.  The first call also creates each OFT entry's
+// lock.  Only called while no other thread uses the disk
 // ============================================================================
 i32 bfsInitOFT() {
+  static i32 locksMade = 0;
+  for (i32 i = 0; i < NUMOFTENTRIES && !locksMade; ++i) {
+    pthread_rwlock_init(&g_oft[i].lock, NULL);
+  }
+  locksMade = 1;
+
   for (i32 i = 0; i < NUMOFTENTRIES; ++i) {
-    g_oft[i].inum = -1;
-    g_oft[i].curs = 0;
-    g_oft[i].refs = 0;
+    g_oft[i].inum  = -1;
+    g_oft[i].refs  = 0;
+    g_oft[i].dirty = 0;
+  }
+  for (i32 i = 0; i < NUMFDS; ++i) g_fdt[i].inum = -1;
+
+  for (i32 s = 0; s < DELAYBLOCKS; ++s) {
+    g_delay[s].inum  = -1;
+    g_delay[s].hnext = (s + 1 < DELAYBLOCKS) ? s + 1 : -1;
   }
+  for (i32 b = 0; b < DELAYHASHSIZE; ++b) g_delayHash[b] = -1;
+  g_delayFree = 0;
+  g_numDelay  = 0;
   return 0;
 }
 
 
 // ============================================================================
-// Write the initial Super block into DBN 0
+// Write the initial Super block, laid out by bfsInitGeometry, into DBN 0
 // ============================================================================
 i32 bfsInitSuper(FILE* fp) {
 
   if (fp == NULL) FATAL(ENULLPTR);
 
-  Super sb;
-  sb.numBlocks = BLOCKSPERDISK;           // eg: 100
-  sb.numInodes = NUMINODES;               // eg: 8
-  sb.firstFree = NUMMETA;                 // eg: 3
+  i8 buf[MAXBLOCKSIZE] = {0};
+  memcpy(buf, &g_super, sizeof(Super));
+
+  return cacheWrite(DBNSUPER, buf);
+}
+
+
+
+
+
+// ============================================================================
+// Lock file 'inum': shared ('excl' = 0) to read it, so readers run side by
+// side; or exclusive ('excl' = 1) to change its Inode or data.  The lock is
+// in the file's OFT entry, which stays put while the file is open - or, for
+// a file that is not, while the caller is within a journal operation.  On
+// success, return 0
+// ============================================================================
+i32 bfsLockInode(i32 inum, i32 excl) {
+  i32 ofte = bfsFindOFTE(inum);
+  if (excl) return pthread_rwlock_wrlock(&g_oft[ofte].lock);
+  return pthread_rwlock_rdlock(&g_oft[ofte].lock);
+}
+
+
+
+// ============================================================================
+// Return the index in the Open File Table of file 'inum'.  If it has no entry,
+// return -1
+// ============================================================================
+i32 bfsLookupOFTE(i32 inum) {
+  pthread_mutex_lock(&g_oftLock);
+  i32 ofte = bfsScanOFT(inum);
+  pthread_mutex_unlock(&g_oftLock);
+  return ofte;
+}
+
+
+
+// ============================================================================
+// Read the allocation bitmap, the free block count, and the Inode map, into
+// memory, and empty the name cache.  Called by fsMount, after bfsLoadSuper
+// and journal replay.  On success, return 0.  On failure, abort
+// ============================================================================
+i32 bfsLoadBitmap() {
+  Super* super = (Super*)cacheGet(DBNSUPER);
+  g_super.numFree = super->numFree;
+  cachePut(DBNSUPER, 0);
+
+  free(g_bitmap);
+  free(g_bitmapDirty);
+  i32 num = g_super.numBitmapBlocks;
+  g_bitmap      = (u64*)malloc((i64)num * g_super.blockSize);
+  g_bitmapDirty = (i8*)calloc(num, 1);
+  if (g_bitmap == NULL || g_bitmapDirty == NULL) FATAL(ENOMEM);
+
+  cacheReadRun(g_super.dbnBitmap, num, g_bitmap);
+  mapInit(&g_map, g_bitmap, g_super.numBlocks);
+  g_numFree     = g_super.numFree;
+  g_numDirtyMap = 0;
+  g_rotor       = g_super.dbnData;
+  g_numFreed    = 0;
+  g_freedBlks   = 0;
+  g_reserved    = 0;
+
+  free(g_inodeMap);
+  free(g_inodeMapDirty);
+  num = g_super.numInodeMapBlocks;
+  g_inodeMap      = (u64*)malloc((i64)num * g_super.blockSize);
+  g_inodeMapDirty = (i8*)calloc(num, 1);
+  if (g_inodeMap == NULL || g_inodeMapDirty == NULL) FATAL(ENOMEM);
+
+  cacheReadRun(g_super.dbnInodeMap, num, g_inodeMap);
+  g_numDirtyIMap = 0;
+  g_inodeRotor   = 0;
+
+  memset(g_names, 0, sizeof(g_names));    // names from any earlier mount
+  return 0;
+}
+
 
-  i8 buf[BYTESPERBLOCK] = {0};
-  memcpy(buf, &sb, sizeof(Super));
 
-  return bioWrite(DBNSUPER, buf);
+// ============================================================================
+// Read the Inodes and the Directory into memory, with one sequential read -
+// see g_inodes - and check that each Directory entry names a valid Inode.
+// Called by fsMount, after journal replay.  On success, return 0.  On
+// failure, abort
+// ============================================================================
+i32 bfsLoadMeta() {
+  i64 bsize = g_super.blockSize;
+  i32 num   = g_super.numInodeBlocks + g_super.numDirBlocks;
+  free(g_inodes);
+  g_inodes = (i8*)malloc(num * bsize);
+  if (g_inodes == NULL) FATAL(ENOMEM);
+  g_dir = g_inodes + g_super.numInodeBlocks * bsize;
+
+  cacheReadRun(g_super.dbnInodes, num, g_inodes);
+
+  for (i32 s = 0; s < bfsDirSlots(); ++s) {
+    DirEntry* e = bfsDirSlot(s);
+    if (e->fname[0] == 0) continue;
+    if (e->inum < 0 || e->inum >= g_super.numInodes) FATAL(EBADINUM);
+  }
+  return 0;
 }
 
 
 
 // ============================================================================
-// Convert between inum (internal) and FileDescriptor (user-visible)
+// Read the SuperBlock of the open BFS disk into g_super, check it, and set the
+// disk to the geometry it records.  Called by fsMount, before anything else
+// is read: the disk is still assumed to have BYTESPERBLOCK-byte blocks, which
+// is enough to hold a Super.  The layout it records must be the one
+// bfsInitGeometry gives its geometry, and the disk must be big enough to hold
+// it.  On success, return 0.  On failure, abort
 // ============================================================================
-i32 bfsInumToFd(i32 inum) { return inum + INUMTOFD; }
+i32 bfsLoadSuper() {
+  i8 buf[MAXBLOCKSIZE] = {0};
+  bioRead(DBNSUPER, buf);
+  Super* super = (Super*)buf;
+  if (super->magic != BFSMAGIC) FATAL(EBADMAGIC);
+
+  i32 bsize = super->blockSize;
+  if (bsize < BYTESPERBLOCK || bsize > MAXBLOCKSIZE) FATAL(EBADGEOM);
+  if ((bsize & (bsize - 1)) != 0)                    FATAL(EBADGEOM);
+  if (super->numInodes < 1 || super->numBlocks < 1)  FATAL(EBADGEOM);
+  if ((i64)bioNumBlocks() * BYTESPERBLOCK < (i64)super->numBlocks * bsize) {
+    FATAL(EBADGEOM);                          // image cut short
+  }
+
+  bfsInitGeometry(super->numBlocks, super->numInodes, bsize);
+  g_super.numFree = super->numFree;
+  if (memcmp(&g_super, super, sizeof(Super)) != 0) FATAL(EBADGEOM);
+  i32 maxFree = super->numBlocks - super->dbnData;
+  if (super->numFree < 0 || super->numFree > maxFree) FATAL(EBADGEOM);
+  return 0;
+}
 
 
 // ============================================================================
-// Lookup 'fname' in the Directory.  If found, return its inum.  If not,
-// return EFNF
+// Lookup 'fname' - in the name cache, or failing that, the Directory - and
+// open it.  If found, return its inum.  If not, return EFNF
 // ============================================================================
 i32 bfsLookupFile(str fname) {
 
   if (fname == NULL) FATAL(ENULLPTR);
 
-  i8 buf[BYTESPERBLOCK] = {0};
+  i32 inum = EFNF;
+  if (bfsNameGet(fname, &inum) == 0) {
+    i32 slot = 0;
+    inum = bfsDirFind(fname, &slot);
+    bfsNameSet(fname, inum);
+  }
+  if (inum < 0) return EFNF;
+
+  bfsRefOFT(inum);
+  return inum;
+}
 
-  bioRead(DBNDIR, buf);
 
-  Dir* dir = (Dir*)buf;
 
-  for (int inum = 0; inum < NUMINODES; ++inum) {
-    if (strcmp(fname, dir->fname[inum]) == 0) {
-      bfsRefOFT(inum);
-      return inum;
+// ============================================================================
+// Map FBN 'fbn' of file 'inum' to the DBN that holds it, via the file's
+// extents.  Set *run to the number of FBNs, from 'fbn' on, held on the DBNs
+// that follow it - the rest of its extent - so that callers can move them
+// with one IO.  If 'fbn' is not mapped, return ENODBN, and set *run to the
+// number of FBNs up to the next one that is
+// ============================================================================
+i32 bfsMapRun(i32 inum, i32 fbn, i32* run) {
+
+  if (inum < 0)                  FATAL(EBADINUM);
+  if (inum >= g_super.numInodes) FATAL(EBADINUM);
+  if (fbn  < 0)                  FATAL(EBADFBN);
+  if (fbn  >= bfsMaxFbn())       FATAL(EBADFBN);
+  if (run  == NULL)              FATAL(ENULLPTR);
+
+  Inode inode;
+  bfsReadInode(inum, &inode);
+
+  Extent ext;
+  if (bfsExtLookup(&inode, fbn, &ext)) {
+    *run = ext.fbn + ext.len - fbn;
+    return ext.dbn + (fbn - ext.fbn);
+  }
+  *run = (ext.len > 0) ? ext.fbn - fbn : bfsMaxFbn() - fbn;
+  return ENODBN;
+}
+
+
+
+// ============================================================================
+// Return the number of FBNs a file can have.  Extents set no limit of their
+// own, but an FBN, plus the length of a run from it, must fit in an i32
+// ============================================================================
+i32 bfsMaxFbn() {
+  return 1 << 30;
+}
+
+
+
+// ============================================================================
+// Give file 'inum' - referenced in the OFT by bfsRefOFT - a File Descriptor
+// of its own, with its cursor at 0.  Each open of a file gets a different
+// one, so that its readers and writers move through it independently.
+// Return the descriptor.  If every one is in use, abort
+// ============================================================================
+i32 bfsOpenFd(i32 inum) {
+  pthread_mutex_lock(&g_oftLock);
+  i32 i = 0;
+  while (i < NUMFDS && g_fdt[i].inum >= 0) ++i;
+  if (i == NUMFDS) FATAL(EFDFULL);
+
+  g_fdt[i].inum    = inum;
+  g_fdt[i].curs    = 0;
+  g_fdt[i].raNext  = 0;               // a read from offset 0 is sequential
+  g_fdt[i].raStart = 0;
+  g_fdt[i].raSize  = 0;
+  pthread_mutex_unlock(&g_oftLock);
+  return FDBASE + i;
+}
+
+
+
+// ============================================================================
+// Return how many metadata blocks, at most, the next jrnCommit will add to
+// the running transaction when it syncs the in-memory metadata: the changed
+// allocation bitmap blocks, with the SuperBlock; the changed Inode map
+// blocks; and the Inodes blocks of the changed Inodes held in the Open File
+// Table
+// ============================================================================
+i32 bfsPendingMeta() {
+  pthread_mutex_lock(&g_allocLock);
+  i32 num = (g_numDirtyMap > 0) ? g_numDirtyMap + 1 : 0;
+  num += g_numDirtyIMap;
+  pthread_mutex_unlock(&g_allocLock);
+
+  i32 dbns[NUMOFTENTRIES];
+  i32 ndbn = 0;
+  pthread_mutex_lock(&g_oftLock);
+  for (i32 i = 0; i < NUMOFTENTRIES; ++i) {
+    if (g_oft[i].inum < 0 || !g_oft[i].dirty) continue;
+    i32 off = 0;
+    i32 dbn = bfsInodeDbn(g_oft[i].inum, &off);
+    i32 j = 0;
+    while (j < ndbn && dbns[j] != dbn) ++j;
+    if (j == ndbn) dbns[ndbn++] = dbn;
+  }
+  pthread_mutex_unlock(&g_oftLock);
+  return num + ndbn;
+}
+
+
+
+// ============================================================================
+// Start reading blocks 'fbn' .. 'fbn' + 'count' - 1 of file 'inum' in the
+// background, and return at once.  Each extent in that range is one request:
+// in BIOMMAP mode, advice to the kernel to page it in; otherwise, a readahead
+// into the cache.  Blocks not yet allocated are skipped
+// ============================================================================
+i32 bfsPrefetch(i32 inum, i32 fbn, i32 count) {
+  i32 fbnEnd = (count > bfsMaxFbn() - fbn) ? bfsMaxFbn() : fbn + count;
+
+  while (fbn < fbnEnd) {
+    i32 run = 0;
+    i32 dbn = bfsMapRun(inum, fbn, &run);
+    if (run > fbnEnd - fbn) run = fbnEnd - fbn;
+    if (dbn > 0 && bioMode() == BIOMMAP) {
+      bioPrefetch(dbn, run);
+    } else if (dbn > 0) {
+      cachePrefetch(dbn, run);
     }
+    fbn += run;
   }
+  return 0;
+}
 
-  return EFNF;
 
+
+// ============================================================================
+// Release data block 'dbn', obtained with bfsGetData.  'dirty' = 1 if the
+// caller modified it
+// ============================================================================
+i32 bfsPutData(i32 dbn, i32 dirty) {
+  if (bioMode() == BIOMMAP) return bioPutBlock(dbn, dirty);
+  return cachePut(dbn, dirty);
 }
 
 
 
 // ============================================================================
-// Read FBN 'fbn' for the file whose inum is 'inum' into 'buf'
+// Read FBN 'fbn' for the file whose inum is 'inum' into 'buf'.  An FBN not
+// mapped is a delayed block, or else a hole, and reads as zeroes
 // ============================================================================
 i32 bfsRead(i32 inum, i32 fbn, i8* buf) {
 
-  if (inum < 0)       FATAL(EBADINUM);
-  if (inum > MAXINUM) FATAL(EBADINUM);
-  if (fbn  < 0)       FATAL(EBADFBN);
-  if (fbn  > MAXFBN)  FATAL(EBADFBN);
+  if (inum < 0)                  FATAL(EBADINUM);
+  if (inum >= g_super.numInodes) FATAL(EBADINUM);
+  if (fbn  < 0)                  FATAL(EBADFBN);
+  if (fbn  >= bfsMaxFbn())       FATAL(EBADFBN);
 
   i32 dbn = bfsFbnToDbn(inum, fbn);
-  bioRead(dbn, buf);
+  if (dbn == ENODBN) {
+    i32 run = 0;
+    void* blk = bfsGetDelayed(inum, fbn, &run);
+    if (blk != NULL) {
+      memcpy(buf, blk, g_super.blockSize);
+    } else {                              // a hole: reads as zeroes
+      memset(buf, 0, g_super.blockSize);
+    }
+    return 0;
+  }
+  cacheRead(dbn, buf);
   return 0;
 }
 
 
 // ============================================================================
-// Read the Inodes block.  Extract and return the Inode whose number is 'inum'.
-// On success, return 0.  On failure, abort
+// Return the Inode whose number is 'inum'.  If the file has an entry in the
+// Open File Table, that holds the current Inode, so no block IO is needed.
+// Otherwise, extract it from its Inodes block.  On success, return 0.  On
+// failure, abort
 // ============================================================================
 i32 bfsReadInode(i32 inum, Inode* inode) {
 
-  if (inum < 0)       FATAL(EBADINUM);
-  if (inum > MAXINUM) FATAL(EBADINUM);
-  if (inode == NULL)  FATAL(ENULLPTR);
+  if (inum < 0)                  FATAL(EBADINUM);
+  if (inum >= g_super.numInodes) FATAL(EBADINUM);
+  if (inode == NULL)             FATAL(ENULLPTR);
+
+  i32 ofte = bfsLookupOFTE(inum);
+  if (ofte >= 0) {
+    memcpy(inode, &g_oft[ofte].inode, sizeof(Inode));
+    return 0;
+  }
 
-  i8 buf[BYTESPERBLOCK] = {0};
+  bfsLoadInode(inum, inode);
+  return 0;
+}
 
-  bioRead(DBNINODES, buf);
 
-  Inode* inodes = (Inode*)buf;
 
-  memcpy(inode, &inodes[inum], sizeof(Inode));
-  return 0;
+// ============================================================================
+// Sequential readahead for File Descriptor 'fd', called by fsRead before it
+// reads the 'numb' bytes at offset 'pos'.  Each descriptor is a stream of its
+// own.  A read that starts where its last one ended is sequential.  The
+// first sequential read opens a window of blocks beyond it - RAINITBLOCKS,
+// or twice the read if larger - to be prefetched.  When a reader reaches
+// into the window, the next window, twice as big (up to RAMAXBLOCKS), is
+// prefetched, so the disk stays ahead of the reader.  Any other read closes
+// the window.  Windows stop at end-of-file
+// ============================================================================
+i32 bfsReadahead(i32 fd, i64 pos, i32 numb) {
+  pthread_mutex_lock(&g_oftLock);
+  FDTE* e  = bfsFdEntry(fd);
+  i32 inum = e->inum;
+  i64 fsize = g_oft[bfsScanOFT(inum)].inode.size;
+
+  i32 seq  = (pos == e->raNext);
+  e->raNext = pos + numb;
+  if (!seq || numb <= 0) {
+    e->raSize = 0;
+    pthread_mutex_unlock(&g_oftLock);
+    return 0;
+  }
+
+  i32 bsize    = g_super.blockSize;
+  i32 fbnFirst = (i32)(pos / bsize);
+  i32 fbnLast  = (i32)((pos + numb - 1) / bsize);
+  i64 fbnEnd   = (fsize + bsize - 1) / bsize;
+  if (fbnEnd > bfsMaxFbn()) fbnEnd = bfsMaxFbn();
+
+  i32 start;
+  i32 size;
+  if (e->raSize == 0 || fbnFirst >= e->raStart + e->raSize) {
+    start = fbnLast + 1;                      // new stream, or overtook it
+    size  = 2 * (fbnLast - fbnFirst + 1);
+    if (size < RAINITBLOCKS) size = RAINITBLOCKS;
+  } else if (fbnLast >= e->raStart) {
+    start = e->raStart + e->raSize;           // reached the window: slide
+    size  = 2 * e->raSize;
+  } else {
+    pthread_mutex_unlock(&g_oftLock);
+    return 0;                                 // window still ahead of us
+  }
+  if (size > RAMAXBLOCKS) size = RAMAXBLOCKS;
+
+  e->raStart = start;
+  e->raSize  = size;
+  pthread_mutex_unlock(&g_oftLock);
+  if (start + size > fbnEnd) size = fbnEnd - start;
+  if (size <= 0) return 0;
+  return bfsPrefetch(inum, start, size);
+}
+
+
+
+// ============================================================================
+// Read 'count' whole data blocks, from DBN 'dbn' onwards, straight into 'buf'.
+// In BIOMMAP mode that is one memcpy out of the mapping; otherwise one pread,
+// via the cache, per stretch of blocks it does not hold
+// ============================================================================
+i32 bfsReadRun(i32 dbn, i32 count, void* buf) {
+  if (bioMode() == BIOMMAP) return bioReadRun(dbn, count, buf);
+  return cacheReadRun(dbn, count, buf);
 }
 
 
@@ -367,8 +1891,71 @@ i32 bfsReadInode(i32 inum, Inode* inode) {
 // Reference file with Inode number 'inum' in the Open File Table
 // ============================================================================
 i32 bfsRefOFT(i32 inum) {
-  i32 ofte = bfsFindOFTE(inum);
+  pthread_mutex_lock(&g_oftLock);
+  i32 ofte = bfsClaimOFTE(inum);
   ++g_oft[ofte].refs;
+  pthread_mutex_unlock(&g_oftLock);
+  return 0;
+}
+
+
+
+// ============================================================================
+// Let the blocks freed in the transaction just committed be allocated again.
+// Their cached copies are dropped: they must not be written back over
+// whatever the blocks hold next.  Called by jrnCommit, once the commit is on
+// disk
+// ============================================================================
+i32 bfsReleaseFreed() {
+  pthread_mutex_lock(&g_allocLock);
+  for (i32 i = 0; i < g_numFreed; ++i) {
+    i32 first = g_freed[2 * i];
+    i32 count = g_freed[2 * i + 1];
+    mapClear(&g_map, first, count);
+    cacheDiscard(first, count);
+  }
+  g_numFree  += g_freedBlks;
+  g_numFreed  = 0;
+  g_freedBlks = 0;
+  pthread_mutex_unlock(&g_allocLock);
+  return 0;
+}
+
+
+
+// ============================================================================
+// Rename file 'oldName' to 'newName'.  If a file called 'newName' exists, it
+// is deleted first.  The file keeps its Inode; only its Directory entry
+// moves.  On success, return 0.  If there is no file 'oldName', return EFNF;
+// if 'newName' is open, EFILEOPEN
+// ============================================================================
+i32 bfsRenameFile(str oldName, str newName) {
+
+  if (oldName == NULL || newName == NULL) FATAL(ENULLPTR);
+  if (strlen(newName) > FNAMEMAX - 1)     FATAL(EBIGFNAME);
+  if (newName[0] == 0) return EFNF;
+
+  jrnReserve(2 * JRNOPBLOCKS + 1);        // a delete, a move, a name block
+
+  i32 slot = 0;
+  i32 inum = bfsDirFind(oldName, &slot);
+  if (inum < 0) return EFNF;
+
+  i32 other = bfsDirFind(newName, &slot);
+  if (other == inum) return 0;            // same name
+  if (other >= 0) {
+    i32 ret = bfsDeleteFile(newName);
+    if (ret < 0) return ret;
+  }
+
+  // Removing an entry can move others, so find each slot just before use
+
+  bfsDirFind(oldName, &slot);
+  bfsDirRemove(slot);
+  bfsDirFind(newName, &slot);
+  bfsDirAdd(slot, newName, inum);
+  bfsNameSet(oldName, EFNF);
+  bfsNameSet(newName, inum);
   return 0;
 }
 
@@ -377,13 +1964,92 @@ i32 bfsRefOFT(i32 inum) {
 // ============================================================================
 // Set cursor position for the file open on File Descriptor 'fd' to 'newCurs'
 // ============================================================================
-i32 bfsSetCursor(i32 inum, i32 newCurs) {
+i32 bfsSetCursor(i32 fd, i64 newCurs) {
+  pthread_mutex_lock(&g_oftLock);
+  bfsFdEntry(fd)->curs = newCurs;
+  pthread_mutex_unlock(&g_oftLock);
+  return 0;
+}
 
-  if (inum < 0) FATAL(EBADINUM);
-  if (inum > MAXINUM) FATAL(EBADINUM);
 
-  i32 ofte = bfsFindOFTE(inum);
-  g_oft[ofte].curs = newCurs;
+
+// ============================================================================
+// Write the changed blocks of the in-memory allocation bitmap, and the free
+// block count in the SuperBlock, back through the journal - if anything was
+// allocated, or freed, since the last sync.  Blocks freed since the last
+// commit are written as free, though still set in g_bitmap - see g_freed.
+// Then do the same for the changed blocks of the Inode map
+// ============================================================================
+i32 bfsSyncBitmap() {
+  i32 bsize = g_super.blockSize;
+  i64 bitsPerBlock = (i64)bsize * 8;
+  i32 changed = 0;                          // 1 => bitmap blocks written
+
+  pthread_mutex_lock(&g_allocLock);
+  for (i32 b = 0; b < g_super.numBitmapBlocks && g_numDirtyMap > 0; ++b) {
+    if (!g_bitmapDirty[b]) continue;
+    u64 buf[MAXBLOCKSIZE / sizeof(u64)];
+    memcpy(buf, (i8*)g_bitmap + (i64)b * bsize, bsize);
+    for (i32 i = 0; i < g_numFreed; ++i) {  // clear the freed bits in it
+      i64 lo = g_freed[2 * i];
+      i64 hi = lo + g_freed[2 * i + 1];
+      if (lo < b * bitsPerBlock)       lo = b * bitsPerBlock;
+      if (hi > (b + 1) * bitsPerBlock) hi = (b + 1) * bitsPerBlock;
+      for (i64 dbn = lo; dbn < hi; ++dbn) {
+        i64 bit = dbn - b * bitsPerBlock;
+        buf[bit / 64] &= ~(1ULL << (bit % 64));
+      }
+    }
+    jrnWrite(g_super.dbnBitmap + b, buf);
+    g_bitmapDirty[b] = 0;
+    --g_numDirtyMap;
+    changed = 1;
+  }
+
+  if (changed) {
+    g_super.numFree = g_numFree + g_freedBlks;
+    Super* super = (Super*)cacheGet(DBNSUPER);
+    super->numFree = g_super.numFree;
+    jrnPut(DBNSUPER);
+  }
+
+  for (i32 b = 0; b < g_super.numInodeMapBlocks && g_numDirtyIMap > 0; ++b) {
+    if (!g_inodeMapDirty[b]) continue;
+    jrnWrite(g_super.dbnInodeMap + b, (i8*)g_inodeMap + (i64)b * bsize);
+    g_inodeMapDirty[b] = 0;
+    --g_numDirtyIMap;
+  }
+  pthread_mutex_unlock(&g_allocLock);
+  return 0;
+}
+
+
+
+// ============================================================================
+// Give DBNs to the delayed blocks of every file that is not open, unless its
+// Inode lock is held - see bfsAllocOther.  If 'all', those of every file,
+// open or not, once any reads of it have finished.  Called within a journal
+// operation, holding no Inode lock.  Return the number of blocks allocated
+// ============================================================================
+i32 bfsSyncDelayed(i32 all) {
+  i32 total = 0;
+  for (i32 s = 0; s < DELAYBLOCKS; ++s) {
+    i32 inum = bfsDelayOwner(s);
+    if (inum < 0 || (!all && bfsIsOpen(inum))) continue;
+    total += bfsAllocOther(inum, all);
+  }
+  return total;
+}
+
+
+
+// ============================================================================
+// Write back every changed Inode held in the Open File Table
+// ============================================================================
+i32 bfsSyncInodes() {
+  pthread_mutex_lock(&g_oftLock);
+  for (i32 i = 0; i < NUMOFTENTRIES; ++i) bfsFlushOFTE(i);
+  pthread_mutex_unlock(&g_oftLock);
   return 0;
 }
 
@@ -392,10 +2058,11 @@ i32 bfsSetCursor(i32 inum, i32 newCurs) {
 // ============================================================================
 // Return the cursor position for the file open on File Descriptor 'fd'
 // ============================================================================
-i32 bfsTell(i32 fd) {
-  i32 inum = bfsFdToInum(fd);
-  i32 ofte = bfsFindOFTE(inum);
-  return g_oft[ofte].curs;
+i64 bfsTell(i32 fd) {
+  pthread_mutex_lock(&g_oftLock);
+  i64 curs = bfsFdEntry(fd)->curs;
+  pthread_mutex_unlock(&g_oftLock);
+  return curs;
 }
 
 
@@ -403,10 +2070,10 @@ i32 bfsTell(i32 fd) {
 // ============================================================================
 // Return the size of the file whose Inode number is 'inum'
 // ============================================================================
-i32 bfsGetSize(i32 inum) {
+i64 bfsGetSize(i32 inum) {
 
-  if (inum < 0)       FATAL(EBADINUM);
-  if (inum > MAXINUM) FATAL(EBADINUM);
+  if (inum < 0)                  FATAL(EBADINUM);
+  if (inum >= g_super.numInodes) FATAL(EBADINUM);
 
   Inode inode;
   bfsReadInode(inum, &inode);
@@ -419,10 +2086,10 @@ i32 bfsGetSize(i32 inum) {
 // ============================================================================
 // Set size of file 'inum' to 'size
 // ============================================================================
-i32 bfsSetSize(i32 inum, i32 size) {
+i32 bfsSetSize(i32 inum, i64 size) {
 
-  if (inum < 0)       FATAL(EBADINUM);
-  if (inum > MAXINUM) FATAL(EBADINUM);
+  if (inum < 0)                  FATAL(EBADINUM);
+  if (inum >= g_super.numInodes) FATAL(EBADINUM);
 
   Inode inode;
   bfsReadInode(inum, &inode);
@@ -435,20 +2102,48 @@ i32 bfsSetSize(i32 inum, i32 size) {
 
 
 // ============================================================================
-// Update the Inodes block on disk with the info in 'inode'
+// Release the lock on file 'inum' taken by bfsLockInode
+// ============================================================================
+i32 bfsUnlockInode(i32 inum) {
+  i32 ofte = bfsLookupOFTE(inum);
+  if (ofte < 0) FATAL(EBADINUM);
+  return pthread_rwlock_unlock(&g_oft[ofte].lock);
+}
+
+
+
+// ============================================================================
+// Update the Inode of file 'inum' with the info in 'inode'.  If the file has
+// an entry in the Open File Table, only that copy is updated; it reaches the
+// Inodes block when the file is closed, or at bfsSyncInodes.  Otherwise, the
+// Inodes block is updated at once, as part of the running journal transaction
 // ============================================================================
 i32 bfsWriteInode(i32 inum, Inode* inode) {
 
-  if (inum < 0)       FATAL(EBADINUM);
-  if (inum > MAXINUM) FATAL(EBADINUM);
-  if (inode == NULL)  FATAL(ENULLPTR);
+  if (inum < 0)                  FATAL(EBADINUM);
+  if (inum >= g_super.numInodes) FATAL(EBADINUM);
+  if (inode == NULL)             FATAL(ENULLPTR);
 
-  i8 buf[BYTESPERBLOCK];
-  bioRead(DBNINODES, buf);
-  Inode* inodes = (Inode*)buf;
-  memcpy(&inodes[inum], inode, sizeof(Inode));
-  bioWrite(DBNINODES, buf);
+  i32 ofte = bfsLookupOFTE(inum);
+  if (ofte >= 0) {
+    memcpy(&g_oft[ofte].inode, inode, sizeof(Inode));
+    g_oft[ofte].dirty = 1;
+    return 0;
+  }
 
+  bfsStoreInode(inum, inode);
   return 0;
 }
 
+
+
+// ============================================================================
+// Overwrite 'count' whole data blocks, from DBN 'dbn' onwards, with 'buf'.
+// Nothing is read first.  In BIOMMAP mode that is one memcpy into the mapping;
+// otherwise one pwrite, via the cache
+// ============================================================================
+i32 bfsWriteRun(i32 dbn, i32 count, void* buf) {
+  if (bioMode() == BIOMMAP) return bioWriteRun(dbn, count, buf);
+  return cacheWriteRun(dbn, count, buf);
+}
+
@@ -5,88 +5,171 @@
 // bfs.h - API to Bothell File System
 // ===================================================================
 
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include "alias.h"
 #include "bio.h"
+#include "cache.h"
 #include "errors.h"
 
-#define BYTESPERBLOCK 512
-#define I16SPERBLOCK  256
-#define BLOCKSPERDISK 100
-#define BYTESPERDISK  (BLOCKSPERDISK * BYTESPERBLOCK)
-#define NUMINODES     8
-#define MAXINUM       NUMINODES - 1
-#define NUMMETA       3
-#define MINDBN        3
+#define BYTESPERBLOCK 512           // default, and smallest, block size
+#define MAXBLOCKSIZE  4096          // largest block size
+#define BLOCKSPERDISK 100           // default # of blocks in a new BFS disk
+#define NUMINODES     8             // default # of inodes in a new BFS disk
 #define BFSDISK       "BFSDISK"
-#define NUMDIRECT     5
-#define NUMINDIRECT   BYTESPERBLOCK / sizeof(i16)
-#define MAXFBN        NUMDIRECT + NUMINDIRECT
-#define FNAMESIZE     16
+#define NUMEXTENTS    4             // extents held in the Inode itself
+#define FNAMESIZE     52            // longest name a Dir entry holds, + '\0'
+#define FNAMEMAX      BYTESPERBLOCK // longest name a name block holds, + '\0'
+#define DIRFILL       75            // most % of Dir slots ever in use
+#define INODESIZE     64            // bytes per Inode on disk
 
 #define DBNSUPER      0
-#define DBNINODES     1
-#define DBNDIR        2
+#define JRNBLOCKS     24            // smallest journal, in blocks
 
-#define INUMTOFD      5
+#define BFSMAGIC      0x38534642    // "BFS8": hashed Dir, long names
 
-#define NUMOFTENTRIES 20
+#define FDBASE        5             // lowest File Descriptor
+#define NUMFDS        64            // # of File Descriptors
 
+#define NUMOFTENTRIES 20
 
-typedef struct {          // SuperBlock
-  i16 numBlocks;          // total # of blocks in BFSDISK = 1,000
-  i16 numInodes;          // total # of inodes = 8
-  i16 firstFree;          // DBN of first free block
+#define DELAYWRITE    64            // shorter writes into holes are delayed
+
+#define RAINITBLOCKS  4             // first readahead window, in blocks
+
+
+typedef struct {          // SuperBlock: the disk's geometry and layout
+  i32 magic;              // BFSMAGIC
+  i32 blockSize;          // bytes per block: a power of 2
+  i32 numBlocks;          // total # of blocks in BFSDISK
+  i32 numInodes;          // total # of inodes
+  i32 numFree;            // # of free blocks, per the allocation bitmap
+  i32 dbnInodes;          // DBN of the first Inodes block
+  i32 numInodeBlocks;     // # of Inodes blocks
+  i32 dbnDir;             // DBN of the first Dir block
+  i32 numDirBlocks;       // # of Dir blocks
+  i32 dbnBitmap;          // DBN of the first allocation bitmap block
+  i32 numBitmapBlocks;    // # of allocation bitmap blocks
+  i32 dbnInodeMap;        // DBN of the first Inode map block
+  i32 numInodeMapBlocks;  // # of Inode map blocks
+  i32 dbnJournal;         // DBN of the first journal block
+  i32 numJournal;         // # of blocks in the journal
+  i32 dbnData;            // DBN of the first data block
 } Super;
 
 
 
-typedef struct {          // Inode
-  i32 size;               // # of bytes in file
-  i16 direct[NUMDIRECT];  // DBNs for first 5 FBNs
-  i16 indirect;           // DBN of the indirect table
+typedef struct {          // Extent: 'len' FBNs, on as many contiguous DBNs
+  i32 fbn;                // first FBN mapped
+  i32 dbn;                // DBN of FBN 'fbn'.  Index entry: DBN of the node
+  i32 len;                // # of FBNs mapped.  Index entry: 0
+} Extent;
+
+
+
+typedef struct {          // Extent tree node: header of the block, followed
+  i32 depth;              // # of levels below this one.  0 => a leaf
+  i32 numExt;             // # of Extents that follow, sorted by FBN
+} ExtNode;
+
+
+
+typedef struct {          // Inode: INODESIZE bytes
+  i64 size;               // # of bytes in file
+  i32 depth;              // root of the extent tree: laid out as an ExtNode
+  i32 numExt;             // ... whose Extents are held in 'ext'
+  Extent ext[NUMEXTENTS]; // extents; if depth > 0, index entries
 } Inode;
 
 
 
-typedef struct {          // Dir
-  char fname[NUMINODES][FNAMESIZE];
-} Dir;
+typedef struct {          // Dir entry: one slot of the hashed Directory
+  i32  inum;              // inum of the file called 'fname'
+  u32  hash;              // bfsHash of the whole name
+  i32  nameDbn;           // name block: DBN of the block that holds a name
+                          // too long for 'fname', in full.  0 => none
+  char fname[FNAMESIZE];  // "" => slot is empty.  Else the name - or, if it
+} DirEntry;               // has a name block, its first FNAMESIZE - 1 chars
 
 
-typedef struct {          // Open File Table Entry
-  i32 inum;               // inum of file. O => slot not used
-  i32 refs;               // # processes fsOpen'd this file
-  i32 curs;               // cursor into file
+typedef struct {          // Open File Table Entry: one per open file
+  i32 inum;               // inum of file. -1 => slot not used
+  i32 refs;               // # of File Descriptors open on this file
+  i32 dirty;              // 1 => 'inode' not yet written to Inodes block
+  Inode inode;            // in-memory copy of the file's Inode
+  pthread_rwlock_t lock;  // see bfsLockInode
 } OFTE;
 
-OFTE g_oft[NUMOFTENTRIES];
 
+typedef struct {          // File Descriptor Table Entry: one per fsOpen
+  i32 inum;               // inum of the file open on it. -1 => slot not used
+  i64 curs;               // cursor into file
+  i64 raNext;             // readahead: offset just past the last fsRead
+  i32 raStart;            // readahead: first FBN of the current window
+  i32 raSize;             // readahead: window size, in blocks. 0 => none
+} FDTE;
+
+extern FDTE  g_fdt[NUMFDS];
+extern OFTE  g_oft[NUMOFTENTRIES];
+extern Super g_super;       // SuperBlock of the mounted BFS disk
+
+i64 bfsAdvanceCursor(i32 fd, i32* numb);
 i32 bfsAllocBlock(i32 inum, i32 fbn);
+i32 bfsAllocDelayed(i32 inum);
+i32 bfsAllocRun(i32 inum, i32 fbnFirst, i32 fbnLast, i32* pdbn);
+i32 bfsCloseFd(i32 fd);
 i32 bfsCreateFile(str fname);
+void* bfsDelayBlock(i32 inum, i32 fbn);
+i32 bfsDeleteFile(str fname);
 i32 bfsDerefOFT(i32 inum);
-i32 bfsExtend(i32 inum, i32 fbn);
+i32 bfsDirtyBitmap();
 i32 bfsFbnToDbn(i32 inum,   i32 fbn);
 i32 bfsFdToInum(i32 fd);
 i32 bfsFindFreeBlock();
+i32 bfsFindFreeRun(i32 hint, i32 want, i32* got);
 i32 bfsFindOFTE(i32 inum);
-i32 bfsGetSize(i32 inum);
+i32 bfsFlushFile(i32 inum);
+i32 bfsFlushOFTE(i32 ofte);
+void* bfsGetData(i32 dbn);
+void* bfsGetDelayed(i32 inum, i32 fbn, i32* run);
+i64 bfsGetSize(i32 inum);
 i32 bfsInitDir(FILE* fp); // clarify with prof
 i32 bfsInitFreeList();
+i32 bfsInitGeometry(i32 numBlocks, i32 numInodes, i32 blockSize);
+i32 bfsInitInodeMap(FILE* fp);
 i32 bfsInitInodes(FILE* fp); // clarify with prof
 i32 bfsInitOFT();
 i32 bfsInitSuper(FILE* fp);
-i32 bfsInumToFd(i32 inum);
+i32 bfsLoadBitmap();
+i32 bfsLoadMeta();
+i32 bfsLoadSuper();
+i32 bfsLockInode(i32 inum, i32 excl);
 i32 bfsLookupFile(str fname);
+i32 bfsLookupOFTE(i32 inum);
+i32 bfsMapRun(i32 inum, i32 fbn, i32* run);
+i32 bfsMaxFbn();
+i32 bfsOpenFd(i32 inum);
+i32 bfsPendingMeta();
+i32 bfsPrefetch(i32 inum, i32 fbn, i32 count);
+i32 bfsPutData(i32 dbn, i32 dirty);
 i32 bfsRead(i32 inum, i32 fbn, i8* buf);
 i32 bfsReadInode(i32 inum, Inode* inode);
+i32 bfsReadahead(i32 fd, i64 pos, i32 numb);
+i32 bfsReadRun(i32 dbn, i32 count, void* buf);
 i32 bfsRefOFT(i32 inum);
-i32 bfsSetCursor(i32 inum, i32 newCurs);
-i32 bfsSetSize(i32 inum, i32 size);
-i32 bfsTell(i32 fd);
+i32 bfsReleaseFreed();
+i32 bfsRenameFile(str oldName, str newName);
+i32 bfsSetCursor(i32 fd, i64 newCurs);
+i32 bfsSetSize(i32 inum, i64 size);
+i32 bfsSyncBitmap();
+i32 bfsSyncDelayed(i32 wait);
+i32 bfsSyncInodes();
+i64 bfsTell(i32 fd);
+i32 bfsUnlockInode(i32 inum);
 i32 bfsWriteInode(i32 inum, Inode* inode);
+i32 bfsWriteRun(i32 dbn, i32 count, void* buf);
 
 #endif
\ No newline at end of file
@@ -1,50 +1,692 @@
 // ============================================================================
 // bio.c - low level Block IO functions
+//
+// The BFS disk is opened once, by bioOpen (called from fsMount), and stays
+// open until bioClose (called from fsUnmount).  There are two modes:
+//
+//  BIOPREAD : each block transfer is a single pread or pwrite at the block's
+//             byte offset - no per-block open, seek or close
+//  BIOMMAP  : the whole disk is mmap'd.  bioRead and bioWrite become memcpy's,
+//             and bioGetBlock hands out a pointer straight into the mapping,
+//             so callers can copy to or from a block without a bounce buffer
+//  BIOURING : as BIOPREAD, but a batch of requests (bioSubmit, bioBatch) is
+//             handed to the kernel through an io_uring, so that many are in
+//             flight at once, at the cost of one system call.  If the kernel
+//             offers no io_uring, bioOpen falls back to BIOPREAD
+//
+// bioSubmit queues a request, tagged by the caller, and bioReap collects the
+// tags of finished ones.  Outside BIOURING mode, bioSubmit does the transfer
+// there and then, so callers need not care which mode is in use
 // ============================================================================
 
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#undef ENOMEM                               // errors.h has its own
+
 #include "bfs.h"
 #include "bio.h"
 
+static i32 g_dfd   = -1;                    // OS fd of the mounted BFS disk
+static i32 g_mode  = BIOPREAD;              // BIOPREAD or BIOMMAP
+static i8* g_map   = NULL;                  // BIOMMAP: the mapped BFS disk
+static i64 g_bytes = 0;                     // BIOMMAP: size of the mapping
+static i32 g_bsize = BYTESPERBLOCK;         // bytes per block
+static i32 g_nblks = 0;                     // # of blocks in the BFS disk
+
+typedef struct {          // io_uring, shared with the kernel
+  i32   fd;               // -1 => none
+  u32*  sqHead;           // submission queue: consumed by the kernel
+  u32*  sqTail;           // submission queue: produced by us
+  u32   sqMask;
+  u32*  sqArray;          // submission queue: indices into 'sqes'
+  struct io_uring_sqe* sqes;
+  u32*  cqHead;           // completion queue: consumed by us
+  u32*  cqTail;           // completion queue: produced by the kernel
+  u32   cqMask;
+  struct io_uring_cqe* cqes;
+  void* sqMap;            // mappings, for bioRingClose
+  i64   sqBytes;
+  void* cqMap;
+  i64   cqBytes;
+  i64   sqeBytes;
+  i32   pending;          // SQEs queued but not yet passed to the kernel
+} BioRing;
+
+typedef struct {          // Request slot: one per request in flight
+  i32    busy;            // 1 => slot in use, until reaped
+  i32    done;            // 1 => finished, but not yet reaped
+  BioReq req;
+  u64    tag;             // caller's tag, returned by bioReap
+  u64    batch;           // bioBatch that owns it; 0 => bioSubmit's caller
+  struct iovec iov;       // BIOURING: the buffer, for IORING_OP_READV/WRITEV
+} BioSlot;
+
+static BioRing  g_ring = { .fd = -1 };
+static BioSlot  g_slot[BIOQDEPTH];
+static i32      g_inflight = 0;             // # busy slots
+static u64      g_batches  = 0;             // # of bioBatch's so far
+static i32      g_waiting  = 0;             // 1 => a thread waits in the ring
+static pthread_mutex_t g_qlock = PTHREAD_MUTEX_INITIALIZER; // guards the queue
+static pthread_cond_t  g_reaped = PTHREAD_COND_INITIALIZER; // slots finished
+
+static i64 g_dirtyLo = -1;                  // BIOMMAP: bytes stored into the
+static i64 g_dirtyHi = -1;                  // ... mapping since bioSync
+static pthread_mutex_t g_dlock = PTHREAD_MUTEX_INITIALIZER; // guards them
+
+
+
+// ============================================================================
+// Check that 'dbn' lies within the BFS disk, and that the disk is open
+// ============================================================================
+static void bioCheck(i32 dbn) {
+  if (dbn < 0)              FATAL(EBADDBN);
+  if (dbn >= g_nblks)       FATAL(EBADDBN);
+  if (g_dfd < 0)            FATAL(ENODISK);
+}
+
+
+
+// ============================================================================
+// Note that the 'bytes' bytes at offset 'boff' of the mapping have been
+// stored into, so that the next bioSync writes them out
+// ============================================================================
+static void bioDirty(i64 boff, i64 bytes) {
+  pthread_mutex_lock(&g_dlock);
+  if (g_dirtyLo < 0 || boff < g_dirtyLo) g_dirtyLo = boff;
+  if (boff + bytes > g_dirtyHi)           g_dirtyHi = boff + bytes;
+  pthread_mutex_unlock(&g_dlock);
+}
+
+
+
+// ============================================================================
+// Transfer 'count' consecutive blocks, from 'dbn' onwards, between the disk
+// and 'buf', according to 'op', with a single IO: one pread or pwrite (or
+// memcpy) covering the whole run.  'done' bytes of it have already been done
+// ============================================================================
+static void bioXfer(i32 op, i32 dbn, i32 count, void* buf, i64 done) {
+  i64 boff  = (i64)dbn * g_bsize + done;
+  i64 bytes = (i64)count * g_bsize - done;
+  i8* p     = (i8*)buf + done;
+
+  if (g_mode == BIOMMAP) {
+    if (op == BIOOPREAD) memcpy(p, g_map + boff, bytes);
+    else                 memcpy(g_map + boff, p, bytes);
+    if (op == BIOOPWRITE) bioDirty(boff, bytes);
+    return;
+  }
+
+  while (bytes > 0) {                       // pread/pwrite may stop short
+    ssize_t numb = (op == BIOOPREAD) ? pread (g_dfd, p, bytes, boff)
+                                     : pwrite(g_dfd, p, bytes, boff);
+    if (numb <= 0) FATAL(op == BIOOPREAD ? EBADREAD : EBADWRITE);
+    p     += numb;
+    boff  += numb;
+    bytes -= numb;
+  }
+}
+
+
+
+// ============================================================================
+// Set up an io_uring of BIOQDEPTH entries, and map its queues.  On success,
+// return 0.  If the kernel does not support io_uring, or refuses it, return -1
+// ============================================================================
+static i32 bioRingOpen() {
+  struct io_uring_params p;
+  memset(&p, 0, sizeof(p));
+  i32 fd = (i32)syscall(__NR_io_uring_setup, BIOQDEPTH, &p);
+  if (fd < 0) return -1;
+
+  BioRing* r  = &g_ring;
+  r->sqBytes  = p.sq_off.array + p.sq_entries * sizeof(u32);
+  r->cqBytes  = p.cq_off.cqes  + p.cq_entries * sizeof(struct io_uring_cqe);
+  r->sqeBytes = p.sq_entries * sizeof(struct io_uring_sqe);
+  i32 single  = (p.features & IORING_FEAT_SINGLE_MMAP) != 0;
+  if (single && r->cqBytes > r->sqBytes) r->sqBytes = r->cqBytes;
+
+  i32 prot = PROT_READ | PROT_WRITE;
+  i32 flag = MAP_SHARED | MAP_POPULATE;
+  r->sqMap = mmap(NULL, r->sqBytes, prot, flag, fd, IORING_OFF_SQ_RING);
+  r->cqMap = single ? r->sqMap
+                    : mmap(NULL, r->cqBytes, prot, flag, fd, IORING_OFF_CQ_RING);
+  void* sqes = mmap(NULL, r->sqeBytes, prot, flag, fd, IORING_OFF_SQES);
+  if (r->sqMap == MAP_FAILED || r->cqMap == MAP_FAILED || sqes == MAP_FAILED) {
+    if (sqes     != MAP_FAILED) munmap(sqes, r->sqeBytes);
+    if (r->cqMap != MAP_FAILED && !single) munmap(r->cqMap, r->cqBytes);
+    if (r->sqMap != MAP_FAILED) munmap(r->sqMap, r->sqBytes);
+    close(fd);
+    return -1;
+  }
+
+  i8* sq = (i8*)r->sqMap;
+  i8* cq = (i8*)r->cqMap;
+  r->sqHead  = (u32*)(sq + p.sq_off.head);
+  r->sqTail  = (u32*)(sq + p.sq_off.tail);
+  r->sqMask  = *(u32*)(sq + p.sq_off.ring_mask);
+  r->sqArray = (u32*)(sq + p.sq_off.array);
+  r->sqes    = (struct io_uring_sqe*)sqes;
+  r->cqHead  = (u32*)(cq + p.cq_off.head);
+  r->cqTail  = (u32*)(cq + p.cq_off.tail);
+  r->cqMask  = *(u32*)(cq + p.cq_off.ring_mask);
+  r->cqes    = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+  r->pending = 0;
+  r->fd      = fd;
+  return 0;
+}
+
+
+
+// ============================================================================
+// Tear down the io_uring set up by bioRingOpen, if any
+// ============================================================================
+static void bioRingClose() {
+  BioRing* r = &g_ring;
+  if (r->fd < 0) return;
+  munmap(r->sqes, r->sqeBytes);
+  if (r->cqMap != r->sqMap) munmap(r->cqMap, r->cqBytes);
+  munmap(r->sqMap, r->sqBytes);
+  close(r->fd);
+  r->fd = -1;
+}
+
+
+
+// ============================================================================
+// bioSubmit, with g_qlock held.  The request belongs to bioBatch # 'batch', or
+// if 0, to bioSubmit's caller
+// ============================================================================
+static void bioSubmitLocked(BioReq* req, u64 tag, u64 batch) {
+  if (req == NULL)   FATAL(ENULLPTR);
+  if (req->count < 1) FATAL(EBIGNUMB);
+  bioCheck(req->dbn);
+  bioCheck(req->dbn + req->count - 1);
+  if (g_inflight == BIOQDEPTH) FATAL(EQFULL);
+
+  i32 s = 0;
+  while (g_slot[s].busy) ++s;
+  BioSlot* slot = &g_slot[s];
+  slot->busy  = 1;
+  slot->done  = 0;
+  slot->req   = *req;
+  slot->tag   = tag;
+  slot->batch = batch;
+  ++g_inflight;
+
+  if (g_ring.fd < 0) {                      // no ring: do it now
+    bioXfer(req->op, req->dbn, req->count, req->buf, 0);
+    slot->done = 1;
+    return;
+  }
+
+  slot->iov.iov_base = req->buf;
+  slot->iov.iov_len  = (size_t)req->count * g_bsize;
+
+  BioRing* r = &g_ring;
+  u32 tail = *r->sqTail;                    // only we move the tail
+  u32 idx  = tail & r->sqMask;
+  struct io_uring_sqe* sqe = &r->sqes[idx];
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode    = (req->op == BIOOPREAD) ? IORING_OP_READV : IORING_OP_WRITEV;
+  sqe->fd        = g_dfd;
+  sqe->off       = (u64)req->dbn * g_bsize;
+  sqe->addr      = (u64)(uintptr_t)&slot->iov;
+  sqe->len       = 1;
+  sqe->user_data = (u64)s;
+  r->sqArray[idx] = idx;
+  __atomic_store_n(r->sqTail, tail + 1, __ATOMIC_RELEASE);
+  ++r->pending;
+}
+
+
+
+// ============================================================================
+// Return the error to abort with when io_uring_enter itself fails: EBADWRITE
+// if any request in flight is a write, else EBADREAD.  Called with g_qlock
+// held
+// ============================================================================
+static i32 bioRingError() {
+  for (i32 s = 0; s < BIOQDEPTH; ++s) {
+    BioSlot* slot = &g_slot[s];
+    if (slot->busy && !slot->done && slot->req.op == BIOOPWRITE) {
+      return EBADWRITE;
+    }
+  }
+  return EBADREAD;
+}
+
+
+
+// ============================================================================
+// Pass the requests queued by bioSubmitLocked to the kernel, then mark every
+// slot whose request the kernel has finished as done - whichever thread it
+// belongs to: each collects its own, with bioCollect.  A request that failed,
+// or stopped short, is finished here with pread/pwrite.  While a thread waits
+// in the kernel (see bioWait), the completions are left for it to reap, lest
+// it sleep on one already taken.  Called with g_qlock held
+// ============================================================================
+static void bioHarvest() {
+  BioRing* r = &g_ring;
+  if (r->fd < 0) return;
+  while (r->pending > 0) {
+    i32 ret = (i32)syscall(__NR_io_uring_enter, r->fd, r->pending, 0, 0,
+                           NULL, 0);
+    if (ret < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+      FATAL(bioRingError());
+    }
+    if (ret <= 0) break;
+    r->pending -= (ret < r->pending) ? ret : r->pending;
+  }
+  if (g_waiting) return;
+
+  i32 reaped = 0;
+  u32 head = *r->cqHead;                    // only we move the head
+  while (head != __atomic_load_n(r->cqTail, __ATOMIC_ACQUIRE)) {
+    struct io_uring_cqe* cqe = &r->cqes[head & r->cqMask];
+    BioSlot* slot = &g_slot[cqe->user_data];
+    i64 bytes = (i64)slot->req.count * g_bsize;
+    i64 res   = cqe->res;
+    if (res != bytes) {                     // failed, or stopped short
+      bioXfer(slot->req.op, slot->req.dbn, slot->req.count, slot->req.buf,
+              (res > 0) ? res : 0);         // finish it with pread/pwrite
+    }
+    slot->done = 1;
+    reaped = 1;
+    ++head;
+  }
+  __atomic_store_n(r->cqHead, head, __ATOMIC_RELEASE);
+  if (reaped) pthread_cond_broadcast(&g_reaped);
+}
+
+
+
+// ============================================================================
+// Free the finished slots of bioBatch # 'batch' (0 => bioSubmit's caller),
+// storing the tags of up to 'max' of them in 'tags'.  Return the number freed.
+// Called with g_qlock held
+// ============================================================================
+static i32 bioCollect(u64 batch, u64* tags, i32 max) {
+  i32 n = 0;
+  for (i32 s = 0; s < BIOQDEPTH && n < max; ++s) {
+    BioSlot* slot = &g_slot[s];
+    if (!slot->busy || !slot->done || slot->batch != batch) continue;
+    tags[n++]  = slot->tag;
+    slot->busy = 0;
+    --g_inflight;
+  }
+  if (n > 0) pthread_cond_broadcast(&g_reaped);   // slots to submit into
+  return n;
+}
+
+
+
+// ============================================================================
+// Wait for more requests to finish, or slots to free.  Only one thread at a
+// time waits in the kernel, with g_qlock dropped; the rest wait for it to
+// harvest.  Called with g_qlock held
+// ============================================================================
+static void bioWait() {
+  i32 kernel = 0;                           // any request with the kernel?
+  for (i32 s = 0; s < BIOQDEPTH; ++s) {
+    if (g_slot[s].busy && !g_slot[s].done) kernel = 1;
+  }
+  BioRing* r = &g_ring;
+  if (g_waiting || !kernel || r->fd < 0) {
+    pthread_cond_wait(&g_reaped, &g_qlock);
+    return;
+  }
+  g_waiting = 1;
+  pthread_mutex_unlock(&g_qlock);
+  i32 ret = (i32)syscall(__NR_io_uring_enter, r->fd, 0, 1,
+                         IORING_ENTER_GETEVENTS, NULL, 0);
+  i32 err = (ret < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY);
+  pthread_mutex_lock(&g_qlock);
+  g_waiting = 0;
+  if (err) FATAL(bioRingError());
+  bioHarvest();
+  pthread_cond_broadcast(&g_reaped);        // someone else may wait next
+}
+
+
+
+// ============================================================================
+// bioReap, with g_qlock held
+// ============================================================================
+static i32 bioReapLocked(i32 min, u64* tags, i32 max) {
+  i32 n = 0;
+  while (1) {
+    bioHarvest();
+    n += bioCollect(0, tags + n, max - n);
+    i32 mine = n;                           // finished, or may yet finish
+    for (i32 s = 0; s < BIOQDEPTH; ++s) {
+      if (g_slot[s].busy && g_slot[s].batch == 0) ++mine;
+    }
+    if (n >= max || n >= min || n >= mine) return n;
+    bioWait();
+  }
+}
+
+
+
+// ============================================================================
+// Carry out the 'num' requests in 'reqs', with as many as BIOQDEPTH in flight
+// at once, and return when all have finished.  Each request's transfer must
+// not overlap another's.  With an io_uring, the requests are tagged as this
+// batch's, so that only their completions count here; g_qlock is held just to
+// submit and reap, so other threads' batches are in flight alongside.  Without
+// one, each is carried out in turn, by the calling thread.  On success, return
+// 0
+// ============================================================================
+i32 bioBatch(BioReq* reqs, i32 num) {
+  if (num < 1) return 0;
+  if (reqs == NULL) FATAL(ENULLPTR);
+  u64 tags[BIOQDEPTH];
+
+  if (g_ring.fd < 0) {                      // no ring: no queue needed
+    for (i32 i = 0; i < num; ++i) {
+      if (reqs[i].count < 1) FATAL(EBIGNUMB);
+      bioCheck(reqs[i].dbn);
+      bioCheck(reqs[i].dbn + reqs[i].count - 1);
+      bioXfer(reqs[i].op, reqs[i].dbn, reqs[i].count, reqs[i].buf, 0);
+    }
+    return 0;
+  }
+
+  pthread_mutex_lock(&g_qlock);
+  u64 batch = ++g_batches;
+  i32 next  = 0;                            // next request to submit
+  i32 left  = num;                          // requests not yet finished
+  while (1) {
+    while (next < num && g_inflight < BIOQDEPTH) {
+      bioSubmitLocked(&reqs[next], (u64)next, batch);
+      ++next;
+    }
+    bioHarvest();
+    left -= bioCollect(batch, tags, BIOQDEPTH);
+    if (left == 0) break;
+    bioWait();
+  }
+  pthread_mutex_unlock(&g_qlock);
+  return 0;
+}
+
+
+
+// ============================================================================
+// Return the size of a block, in bytes, per bioSetGeometry
+// ============================================================================
+i32 bioBlockSize() { return g_bsize; }
+
+
+
+// ============================================================================
+// Close the BFS disk opened by bioOpen.  On success, return 0
+// ============================================================================
+i32 bioClose() {
+  if (g_dfd < 0) return 0;                  // not open
+  bioRingClose();
+  if (g_map != NULL) {
+    munmap(g_map, g_bytes);
+    g_map = NULL;
+  }
+  close(g_dfd);
+  g_dfd   = -1;
+  g_mode  = BIOPREAD;
+  g_dirtyLo = g_dirtyHi = -1;
+  g_bsize = BYTESPERBLOCK;
+  g_nblks = 0;
+  return 0;
+}
+
+
+
+// ============================================================================
+// Return a pointer to block 'dbn' within the mapped BFS disk.  Only valid in
+// BIOMMAP mode: in BIOPREAD mode, return NULL.  Pair with bioPutBlock
+// ============================================================================
+void* bioGetBlock(i32 dbn) {
+  bioCheck(dbn);
+  if (g_mode != BIOMMAP) return NULL;
+  return g_map + (i64)dbn * g_bsize;
+}
+
+
+
+// ============================================================================
+// Return the mode the BFS disk was opened in: BIOPREAD, BIOMMAP or BIOURING.
+// If BIOURING was asked for, but no io_uring could be set up, BIOPREAD
+// ============================================================================
+i32 bioMode() { return g_mode; }
+
+
+
+// ============================================================================
+// Return the number of blocks in the BFS disk, per bioSetGeometry
+// ============================================================================
+i32 bioNumBlocks() { return g_nblks; }
+
+
+
+// ============================================================================
+// Open the BFS disk held in file 'path', for reading and writing, in 'mode'
+// BIOPREAD, BIOMMAP or BIOURING.  It stays open until bioClose.  If already
+// open, do nothing.  If BIOURING is asked for, but no io_uring can be set up,
+// use BIOPREAD - see bioMode.  On success, return 0.  On failure, abort
+// ============================================================================
+i32 bioOpen(str path, i32 mode) {
+  if (path == NULL) FATAL(ENULLPTR);
+  if (g_dfd >= 0) return 0;                 // already open
+
+  g_dfd = open(path, O_RDWR);
+  if (g_dfd < 0) FATAL(ENODISK);
+
+  struct stat st;
+  if (fstat(g_dfd, &st) != 0) FATAL(ENODISK);
+  i32 nblks = (i32)(st.st_size / BYTESPERBLOCK);
+
+  if (mode == BIOURING && bioRingOpen() != 0) mode = BIOPREAD;
+  g_mode = mode;
+  return bioSetGeometry(BYTESPERBLOCK, (nblks > 0) ? nblks : BLOCKSPERDISK);
+}
+
+
+
+// ============================================================================
+// Advise that the 'count' blocks from 'dbn' onwards will be read soon.  In
+// BIOMMAP mode, ask the kernel to start paging them in; BIOPREAD mode reads
+// ahead through the cache instead (cachePrefetch), so do nothing
+// ============================================================================
+i32 bioPrefetch(i32 dbn, i32 count) {
+  bioCheck(dbn);
+  if (g_mode != BIOMMAP || count < 1) return 0;
+  if (dbn + count > g_nblks) count = g_nblks - dbn;
+
+  i64 page = sysconf(_SC_PAGESIZE);
+  i64 boff = (i64)dbn * g_bsize;
+  i64 lo   = boff & ~(page - 1);              // madvise wants page-aligned
+  madvise(g_map + lo, boff + (i64)count * g_bsize - lo, MADV_WILLNEED);
+  return 0;
+}
+
+
+
+// ============================================================================
+// Release block 'dbn', obtained with bioGetBlock.  'dirty' = 1 if the caller
+// modified it.  Stores into a MAP_SHARED mapping need no copying back, but a
+// dirty block is noted, so that the next bioSync writes it out
 // ============================================================================
-// Read 512 bytes from block number 'dbn' in the BFS disk into buffer 'buf'
+i32 bioPutBlock(i32 dbn, i32 dirty) {
+  bioCheck(dbn);
+  if (dirty && g_mode == BIOMMAP) bioDirty((i64)dbn * g_bsize, g_bsize);
+  return 0;
+}
+
+
+
+// ============================================================================
+// Wait until at least 'min' requests queued by bioSubmit have finished, and
+// store the tags of up to 'max' finished requests in 'tags'.  Requests not
+// yet passed to the kernel are passed now.  A request that fails, or stops
+// short, is finished with pread/pwrite.  Return the number of tags stored
+// ============================================================================
+i32 bioReap(i32 min, u64* tags, i32 max) {
+  if (tags == NULL) FATAL(ENULLPTR);
+  pthread_mutex_lock(&g_qlock);
+  i32 n = bioReapLocked(min, tags, max);
+  pthread_mutex_unlock(&g_qlock);
+  return n;
+}
+
+
+
+// ============================================================================
+// Read block number 'dbn' of the BFS disk into buffer 'buf'
 // ============================================================================
 i32 bioRead(i32 dbn, void* buf) {
+  bioCheck(dbn);
 
-  if (dbn < 0)             FATAL(EBADDBN);
-  if (dbn > BLOCKSPERDISK) FATAL(EBADDBN);
+  if (g_mode == BIOMMAP) {
+    memcpy(buf, g_map + (i64)dbn * g_bsize, g_bsize);
+    return 0;
+  }
 
-  FILE* fp = fopen(BFSDISK, "rb+");
-  if (fp == NULL) FATAL(ENODISK);
+  off_t boff = (off_t)dbn * g_bsize;
+  ssize_t numb = pread(g_dfd, buf, g_bsize, boff);
+  if (numb != g_bsize) FATAL(EBADREAD);
+
+  return 0;
+}
+
+
+// ============================================================================
+// Read 'count' consecutive blocks, from 'dbn' onwards, into 'buf' with a
+// single IO: one pread (or memcpy from the mapping) covering the whole run
+// ============================================================================
+i32 bioReadRun(i32 dbn, i32 count, void* buf) {
+  if (count < 1) FATAL(EBIGNUMB);
+  bioCheck(dbn);
+  bioCheck(dbn + count - 1);
+  bioXfer(BIOOPREAD, dbn, count, buf, 0);
+  return 0;
+}
 
-  i32 boff = dbn * BYTESPERBLOCK;
-  i32 ret  = fseek(fp, boff, SEEK_SET);
-  if (ret != 0) { fclose(fp); FATAL(ret); }
 
-  i32 numb = fread(buf, 1, BYTESPERBLOCK, fp);
-  if (numb != BYTESPERBLOCK) { fclose(fp); FATAL(EBADREAD); }
 
-  fclose(fp);
+// ============================================================================
+// Queue request 'req', tagged 'tag', and return at once.  Its buffer must stay
+// put until bioReap returns the tag.  In BIOURING mode the request goes to the
+// kernel at the next bioReap; otherwise it is carried out here.  At most
+// BIOQDEPTH requests may be in flight: if bioBatch's fill the queue, wait for
+// a slot; if bioSubmit's do, abort
+// ============================================================================
+i32 bioSubmit(BioReq* req, u64 tag) {
+  pthread_mutex_lock(&g_qlock);
+  while (g_inflight == BIOQDEPTH) {
+    i32 batched = 0;
+    for (i32 s = 0; s < BIOQDEPTH; ++s) {
+      if (g_slot[s].busy && g_slot[s].batch != 0) batched = 1;
+    }
+    if (!batched) break;                    // bioSubmitLocked aborts
+    bioHarvest();
+    bioWait();
+  }
+  bioSubmitLocked(req, tag, 0);
+  pthread_mutex_unlock(&g_qlock);
   return 0;
 }
 
 
 // ============================================================================
-// Write 512 bytes from 'buf' into block number 'dbn' of the BFS disk
+// Set the geometry of the open BFS disk: 'numBlocks' blocks, of 'blockSize'
+// bytes each.  bioOpen assumes BYTESPERBLOCK-byte blocks, filling the file,
+// until the SuperBlock says otherwise.  In BIOMMAP mode the disk is mapped
+// afresh, and grown to the full size first if need be.  On success, return 0.
+// On failure, abort
+// ============================================================================
+i32 bioSetGeometry(i32 blockSize, i32 numBlocks) {
+  if (g_dfd < 0) FATAL(ENODISK);
+  if (blockSize < BYTESPERBLOCK || blockSize > MAXBLOCKSIZE) FATAL(EBADGEOM);
+  if ((blockSize & (blockSize - 1)) != 0 || numBlocks < 1)   FATAL(EBADGEOM);
+  g_bsize = blockSize;
+  g_nblks = numBlocks;
+  if (g_mode != BIOMMAP) return 0;
+
+  if (g_map != NULL) munmap(g_map, g_bytes);
+  g_map   = NULL;
+  g_bytes = (i64)numBlocks * blockSize;
+  struct stat st;
+  if (fstat(g_dfd, &st) != 0 || st.st_size < g_bytes) {
+    if (ftruncate(g_dfd, g_bytes) != 0) FATAL(EDISKCREATE);
+  }
+  void* map = mmap(NULL, g_bytes, PROT_READ | PROT_WRITE, MAP_SHARED,
+                   g_dfd, 0);
+  if (map == MAP_FAILED) FATAL(ENOMEM);
+  g_map = map;
+  return 0;
+}
+
+
+
+// ============================================================================
+// Wait until every block written so far has reached stable storage.  In
+// BIOMMAP mode, the part of the mapping stored into since the last bioSync -
+// see bioDirty - is written out first
+// ============================================================================
+i32 bioSync() {
+  if (g_dfd < 0) FATAL(ENODISK);
+  pthread_mutex_lock(&g_dlock);
+  i64 lo = g_dirtyLo;
+  i64 hi = g_dirtyHi;
+  g_dirtyLo = g_dirtyHi = -1;
+  pthread_mutex_unlock(&g_dlock);
+  if (hi > g_bytes) hi = g_bytes;
+  if (g_map != NULL && lo >= 0 && lo < hi) {
+    lo &= ~(sysconf(_SC_PAGESIZE) - 1);     // msync wants page-aligned
+    if (msync(g_map + lo, hi - lo, MS_SYNC) != 0) FATAL(EBADWRITE);
+  }
+  if (fdatasync(g_dfd) != 0) FATAL(EBADWRITE);
+  return 0;
+}
+
+
+
+// ============================================================================
+// Write 'buf' into block number 'dbn' of the BFS disk
 // ============================================================================
 i32 bioWrite(i32 dbn, void* buf) {
+  bioCheck(dbn);
+
+  if (g_mode == BIOMMAP) {
+    memcpy(g_map + (i64)dbn * g_bsize, buf, g_bsize);
+    bioDirty((i64)dbn * g_bsize, g_bsize);
+    return 0;
+  }
 
-  FILE* fp = fopen(BFSDISK, "rb+");
-  if (fp == NULL) FATAL(ENODISK);
-  // printf("dbn: %d\n", dbn);
-  i32 boff = dbn * BYTESPERBLOCK;
-  i32 ret  = fseek(fp, boff, SEEK_SET);
-  if (ret != 0) { fclose(fp); FATAL(ret); }
-  // printf("boff: %d\n", boff);
-  i32 numb = fwrite(buf, 1, BYTESPERBLOCK, fp);
-  // printf("after write\n");
-  if (numb != BYTESPERBLOCK) { fclose(fp); FATAL(EBADWRITE); }
-
-  fclose(fp);
-  //printf("after close in biowrite\n");
+  off_t boff = (off_t)dbn * g_bsize;
+  ssize_t numb = pwrite(g_dfd, buf, g_bsize, boff);
+  if (numb != g_bsize) FATAL(EBADWRITE);
+
+  return 0;
+}
+
+
+
+// ============================================================================
+// Write 'count' consecutive blocks, from 'dbn' onwards, from 'buf' with a
+// single IO: one pwrite (or memcpy into the mapping) covering the whole run
+// ============================================================================
+i32 bioWriteRun(i32 dbn, i32 count, void* buf) {
+  if (count < 1) FATAL(EBIGNUMB);
+  bioCheck(dbn);
+  bioCheck(dbn + count - 1);
+  bioXfer(BIOOPWRITE, dbn, count, buf, 0);
   return 0;
 }
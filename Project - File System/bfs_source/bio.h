@@ -10,7 +10,37 @@
 
 #include "alias.h"
 
-i32 bioRead (i32 dbn, void* buf);
-i32 bioWrite(i32 dbn, void* buf);
+#define BIOPREAD      0   // copy blocks in and out with pread/pwrite
+#define BIOMMAP       1   // map the BFS disk; hand out pointers into it
+#define BIOURING      2   // as BIOPREAD, but batches go through an io_uring
+
+#define BIOOPREAD     0   // BioReq: read blocks from the BFS disk
+#define BIOOPWRITE    1   // BioReq: write blocks to the BFS disk
+#define BIOQDEPTH     64  // most requests in flight at once
+
+typedef struct {          // Block IO request, for bioSubmit and bioBatch
+  i32   op;               // BIOOPREAD or BIOOPWRITE
+  i32   dbn;              // first DBN
+  i32   count;            // # of consecutive blocks
+  void* buf;              // memory to transfer to or from
+} BioReq;
+
+i32   bioBatch   (BioReq* reqs, i32 num);
+i32   bioBlockSize();
+i32   bioClose   ();
+void* bioGetBlock(i32 dbn);
+i32   bioMode    ();
+i32   bioNumBlocks();
+i32   bioOpen    (str path, i32 mode);
+i32   bioPrefetch(i32 dbn, i32 count);
+i32   bioPutBlock(i32 dbn, i32 dirty);
+i32   bioReap    (i32 min, u64* tags, i32 max);
+i32   bioRead    (i32 dbn, void* buf);
+i32   bioReadRun (i32 dbn, i32 count, void* buf);
+i32   bioSetGeometry(i32 blockSize, i32 numBlocks);
+i32   bioSubmit  (BioReq* req, u64 tag);
+i32   bioSync    ();
+i32   bioWrite   (i32 dbn, void* buf);
+i32   bioWriteRun(i32 dbn, i32 count, void* buf);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,866 @@
+// ============================================================================
+// cache.c - Block buffer cache
+//
+// A fixed pool of NUMCACHEBLOCKS block buffers, each big enough for the
+// largest block size.  Each holds a copy of one disk block, found by DBN
+// through a small chained hash table.  Buffers are
+// kept on a doubly-linked list in LRU order: the head is the most recently
+// used; eviction takes the least recently used unpinned buffer from the tail,
+// writing it back first if dirty.
+//
+// cacheGet returns a pointer to the cached copy of a block, pinned so that it
+// cannot be evicted, and cachePut releases it.  Callers modify a block in
+// place between the two calls, and pass 'dirty' = 1 to cachePut
+//
+// Readahead: cachePrefetch queues blocks to be read into the cache by a
+// background thread, started on first use.
+//
+// No disk IO is done with g_lock held.  A miss - in cacheGet, or readahead -
+// claims a buffer for the block, pinned and marked 'loading', then reads the
+// disk with g_lock dropped, so anyone else wanting that block waits for the
+// read to finish, rather than reading it twice, or seeing a stale copy.
+// Eviction takes only clean buffers, so it writes nothing; should every
+// buffer that could go be dirty, they are written back first, as the flusher
+// would - see cacheLookup.  All cache state is guarded by g_lock
+//
+// Held blocks: journaled metadata, modified but not yet committed to the
+// journal (see jrn.c), is released with cachePut(dbn, CACHEHELD).  Such a
+// block is not written back - not by eviction, nor by cacheFlush - until the
+// journal has committed it, and calls cacheRelease
+//
+// Discarded blocks: cacheDiscard drops the cached copies of freed blocks.  A
+// copy pinned at the time is marked 'discard' instead: it is never written
+// back, nor made dirty again, and is dropped at its last unpin.  Meanwhile,
+// anyone looking the block up waits, as for one loading, and then reads what
+// the disk holds
+//
+// Write-back: a second background thread, the flusher, started when a block
+// is first dirtied, writes back blocks that have been dirty for longer than
+// g_flushAge, or every dirty block once more than g_dirtyPct percent of the
+// cache is dirty.  Blocks are written in DBN order, each run of consecutive
+// DBNs as one request - see cacheWriteBack.  So writes are absorbed in memory,
+// and reach disk in sorted batches, rather than a block at a time
+// ============================================================================
+
+#include <pthread.h>
+#include <time.h>
+
+#include "bfs.h"
+#include "cache.h"
+
+typedef struct {          // Cache Block
+  i32 dbn;                // DBN held in this buffer.  -1 => buffer unused
+  i32 pins;               // # of cacheGet's not yet cachePut
+  i32 dirty;              // 1 => modified since read from disk
+  i32 loading;            // 1 => still being read from disk: wait
+  i32 held;               // 1 => not to be written back until cacheRelease
+  i32 discard;            // 1 => freed: drop at last unpin, never write back
+  u64 dirtyAt;            // time it was last made dirty, in msecs
+  i32 prev;               // LRU list: next more recently used buffer
+  i32 next;               // LRU list: next less recently used buffer
+  i32 hnext;              // hash chain: next buffer in same bucket
+} CacheBlock;
+
+typedef struct {          // Readahead request
+  i32 dbn;                // first DBN
+  i32 count;              // # of blocks
+} CacheJob;
+
+static CacheBlock g_cb[NUMCACHEBLOCKS];
+static i8         g_data[NUMCACHEBLOCKS][MAXBLOCKSIZE]
+                    __attribute__((aligned(16)));
+static i32        g_bsize = BYTESPERBLOCK; // block size, set by cacheInit
+static i32        g_hash[CACHEHASHSIZE];   // bucket => first buffer
+static i32        g_mru = -1;              // head of LRU list
+static i32        g_lru = -1;              // tail of LRU list
+static CacheStats g_stats;
+
+static pthread_mutex_t g_lock   = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  g_loaded = PTHREAD_COND_INITIALIZER;  // loading done
+
+static CacheJob        g_jobs[CACHEJOBS];  // readahead queue (ring)
+static i32             g_jobHead = 0;      // next job to run
+static i32             g_jobNum  = 0;      // # jobs queued
+static pthread_cond_t  g_work    = PTHREAD_COND_INITIALIZER; // job queued
+static pthread_t       g_raThread;
+static i32             g_raRunning = 0;    // 1 => readahead thread started
+static i32             g_raStop    = 0;    // 1 => exit; no new one till init
+static i8              g_raBuf[RAMAXBLOCKS * MAXBLOCKSIZE];
+
+static pthread_mutex_t g_wbLock = PTHREAD_MUTEX_INITIALIZER; // one writeback
+static i8              g_wbBuf[NUMCACHEBLOCKS * MAXBLOCKSIZE]; // its snapshot
+static i32             g_numDirty  = 0;    // # dirty buffers
+static i32             g_flushAge  = CACHEFLUSHAGE;   // msecs
+static i32             g_dirtyPct  = CACHEDIRTYPCT;   // percent
+static pthread_cond_t  g_flWake    = PTHREAD_COND_INITIALIZER; // flush now
+static pthread_t       g_flThread;
+static i32             g_flRunning = 0;    // 1 => flusher thread started
+static i32             g_flStop    = 0;    // 1 => exit; no new one till init
+
+static i32 cacheHash(i32 dbn) { return dbn % CACHEHASHSIZE; }
+
+
+
+// ============================================================================
+// Unlink buffer 'b' from the LRU list
+// ============================================================================
+static void cacheUnlink(i32 b) {
+  if (g_cb[b].prev >= 0) g_cb[g_cb[b].prev].next = g_cb[b].next;
+  else                   g_mru = g_cb[b].next;
+  if (g_cb[b].next >= 0) g_cb[g_cb[b].next].prev = g_cb[b].prev;
+  else                   g_lru = g_cb[b].prev;
+}
+
+
+
+// ============================================================================
+// Move buffer 'b' to the head (most recently used end) of the LRU list
+// ============================================================================
+static void cacheTouch(i32 b) {
+  if (g_mru == b) return;
+  cacheUnlink(b);
+  g_cb[b].prev = -1;
+  g_cb[b].next = g_mru;
+  if (g_mru >= 0) g_cb[g_mru].prev = b;
+  g_mru = b;
+  if (g_lru < 0) g_lru = b;
+}
+
+
+
+// ============================================================================
+// Return the buffer holding 'dbn' - even if still loading, or discarded - or
+// -1 if not cached
+// ============================================================================
+static i32 cacheFindAny(i32 dbn) {
+  i32 b = g_hash[cacheHash(dbn)];
+  while (b >= 0 && g_cb[b].dbn != dbn) b = g_cb[b].hnext;
+  return b;
+}
+
+
+
+// ============================================================================
+// Find the buffer holding 'dbn'.  If not cached, return -1.  If it is still
+// loading, or discarded but pinned, wait until it is loaded, or dropped, then
+// look again: once loaded, the buffer is unpinned, and may be evicted before
+// this thread runs
+// ============================================================================
+static i32 cacheFind(i32 dbn) {
+  for (;;) {
+    i32 b = cacheFindAny(dbn);
+    if (b < 0 || (!g_cb[b].loading && !g_cb[b].discard)) return b;
+    pthread_cond_wait(&g_loaded, &g_lock);
+  }
+}
+
+
+
+// ============================================================================
+// Remove buffer 'b' from its hash chain
+// ============================================================================
+static void cacheUnhash(i32 b) {
+  i32* link = &g_hash[cacheHash(g_cb[b].dbn)];
+  while (*link != b) link = &g_cb[*link].hnext;
+  *link = g_cb[b].hnext;
+}
+
+
+
+// ============================================================================
+// Drop buffer 'b' from the cache, unwritten, and wake anyone waiting for it to
+// go - see cacheFind
+// ============================================================================
+static void cacheDrop(i32 b) {
+  if (g_cb[b].dirty) {
+    g_cb[b].dirty = 0;
+    --g_numDirty;
+  }
+  cacheUnhash(b);
+  g_cb[b].dbn     = -1;
+  g_cb[b].held    = 0;
+  g_cb[b].discard = 0;
+  pthread_cond_broadcast(&g_loaded);
+}
+
+
+
+// ============================================================================
+// Unpin buffer 'b'.  If it was discarded while pinned, and this was its last
+// pin, drop it
+// ============================================================================
+static void cacheUnpin(i32 b) {
+  --g_cb[b].pins;
+  if (g_cb[b].discard && g_cb[b].pins == 0) cacheDrop(b);
+}
+
+
+
+// ============================================================================
+// Return the time now, in msecs, from some arbitrary starting point
+// ============================================================================
+static u64 cacheNow() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (u64)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+
+
+// ============================================================================
+// Mark buffer 'b' clean
+// ============================================================================
+static void cacheMarkClean(i32 b) {
+  if (!g_cb[b].dirty) return;
+  g_cb[b].dirty = 0;
+  --g_numDirty;
+}
+
+
+
+static void* cacheFlMain(void* arg);
+
+// ============================================================================
+// Mark buffer 'b' dirty.  Start the flusher thread, if not yet running; and
+// wake it, if too much of the cache is now dirty
+// ============================================================================
+static void cacheMarkDirty(i32 b) {
+  if (g_cb[b].dirty) return;
+  g_cb[b].dirty   = 1;
+  g_cb[b].dirtyAt = cacheNow();
+  ++g_numDirty;
+
+  if (!g_flRunning && !g_flStop) {
+    if (pthread_create(&g_flThread, NULL, cacheFlMain, NULL) == 0) {
+      g_flRunning = 1;
+    }
+  }
+  if (g_numDirty * 100 > g_dirtyPct * NUMCACHEBLOCKS) {
+    pthread_cond_signal(&g_flWake);
+  }
+}
+
+
+
+// ============================================================================
+// Write back dirty buffers, but not held ones: those made dirty no later than
+// time 'before'; and, if 'dbns' is not NULL, only those holding one of the
+// 'num' DBNs it lists.  Called without g_lock.
+//
+// The buffers are copied, in DBN order, into g_wbBuf, marked clean, and
+// pinned, so they cannot be evicted - and read back from disk - before the
+// write lands.  Then g_lock is dropped, and each run of consecutive DBNs is
+// written as one request, all in one bioBatch.  A buffer dirtied again
+// meanwhile simply stays dirty.  One writeback at a time: g_wbLock.  Return
+// the number of blocks written
+// ============================================================================
+static i32 cacheWriteBack(u64 before, i32* dbns, i32 num) {
+  i32    sel[NUMCACHEBLOCKS];               // buffers chosen, by DBN
+  i32    nsel = 0;
+  BioReq reqs[NUMCACHEBLOCKS];
+  i32    nreq = 0;
+
+  pthread_mutex_lock(&g_wbLock);
+  pthread_mutex_lock(&g_lock);
+
+  for (i32 b = 0; b < NUMCACHEBLOCKS; ++b) {
+    if (g_cb[b].dbn < 0 || !g_cb[b].dirty || g_cb[b].held) continue;
+    if (g_cb[b].discard) continue;
+    if (g_cb[b].dirtyAt > before) continue;
+    if (dbns != NULL) {
+      i32 i = 0;
+      while (i < num && dbns[i] != g_cb[b].dbn) ++i;
+      if (i == num) continue;
+    }
+    i32 j = nsel++;                         // insertion sort, by DBN
+    while (j > 0 && g_cb[sel[j - 1]].dbn > g_cb[b].dbn) {
+      sel[j] = sel[j - 1];
+      --j;
+    }
+    sel[j] = b;
+  }
+
+  for (i32 i = 0; i < nsel; ++i) {
+    i32 b = sel[i];
+    i8* snap = g_wbBuf + i * g_bsize;       // runs are contiguous in it
+    memcpy(snap, g_data[b], g_bsize);
+    cacheMarkClean(b);
+    ++g_cb[b].pins;
+    if (nreq > 0 && g_cb[sel[i - 1]].dbn + 1 == g_cb[b].dbn) {
+      ++reqs[nreq - 1].count;               // extends the previous run
+    } else {
+      BioReq req = { BIOOPWRITE, g_cb[b].dbn, 1, snap };
+      reqs[nreq++] = req;
+    }
+  }
+  pthread_mutex_unlock(&g_lock);
+
+  bioBatch(reqs, nreq);
+
+  pthread_mutex_lock(&g_lock);
+  for (i32 i = 0; i < nsel; ++i) cacheUnpin(sel[i]);
+  g_stats.writebacks += nsel;
+  pthread_mutex_unlock(&g_lock);
+  pthread_mutex_unlock(&g_wbLock);
+  return nsel;
+}
+
+
+
+// ============================================================================
+// Flusher thread: every half g_flushAge, or when woken because too much of
+// the cache is dirty, write back the blocks that are due, until told to stop
+// ============================================================================
+static void* cacheFlMain(void* arg) {
+  pthread_mutex_lock(&g_lock);
+  while (!g_flStop) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    i64 nsec = ts.tv_nsec + (i64)g_flushAge * 500000;    // half the age
+    ts.tv_sec  += nsec / 1000000000;
+    ts.tv_nsec  = nsec % 1000000000;
+    pthread_cond_timedwait(&g_flWake, &g_lock, &ts);
+    if (g_flStop) break;
+
+    u64 before = cacheNow() - g_flushAge;
+    if (g_numDirty * 100 > g_dirtyPct * NUMCACHEBLOCKS) before = ~0ULL;
+    if (g_numDirty == 0) continue;
+
+    pthread_mutex_unlock(&g_lock);
+    i32 n = cacheWriteBack(before, NULL, 0);
+    pthread_mutex_lock(&g_lock);
+    g_stats.flushes += n;
+  }
+  pthread_mutex_unlock(&g_lock);
+  return NULL;
+}
+
+
+
+// ============================================================================
+// Claim a buffer for block 'dbn', which is not yet cached: the least recently
+// used buffer neither pinned, held nor dirty - dirty ones are left for the
+// flusher, so that eviction never writes.  The buffer's contents are left for
+// the caller to fill.  If there is no such buffer, return -1
+// ============================================================================
+static i32 cacheAlloc(i32 dbn) {
+  i32 b = g_lru;
+  while (b >= 0 && (g_cb[b].pins > 0 || g_cb[b].held || g_cb[b].dirty)) {
+    b = g_cb[b].prev;
+  }
+  if (b < 0) return -1;                     // none clean and unpinned
+
+  if (g_cb[b].dbn >= 0) {                   // evict current occupant
+    cacheUnhash(b);
+    ++g_stats.evictions;
+  }
+
+  g_cb[b].dbn     = dbn;
+  g_cb[b].loading = 0;
+  g_cb[b].held    = 0;
+  i32 h = cacheHash(dbn);
+  g_cb[b].hnext = g_hash[h];
+  g_hash[h]     = b;
+  cacheTouch(b);
+  return b;
+}
+
+
+
+// ============================================================================
+// Return the buffer for block 'dbn': the one that holds it, if cached; else
+// one claimed for it by cacheAlloc, with *miss set to 1, for the caller to
+// fill.  If cacheAlloc finds every buffer that could go dirty, write back
+// all dirty buffers, with g_lock dropped meanwhile, and look again.  If every
+// buffer is pinned or held, abort.  Called with g_lock held
+// ============================================================================
+static i32 cacheLookup(i32 dbn, i32* miss) {
+  i32 stuck = 0;                            // 1 => nothing to write back
+  for (;;) {
+    i32 b = cacheFind(dbn);
+    *miss = (b < 0);
+    if (b >= 0) {
+      ++g_stats.hits;
+      cacheTouch(b);
+      return b;
+    }
+    b = cacheAlloc(dbn);
+    if (b >= 0) {
+      ++g_stats.misses;
+      return b;
+    }
+    if (stuck) FATAL(ENOMEM);               // every buffer pinned or held
+    pthread_mutex_unlock(&g_lock);
+    stuck = (cacheWriteBack(~0ULL, NULL, 0) == 0);
+    pthread_mutex_lock(&g_lock);
+  }
+}
+
+
+
+// ============================================================================
+// Readahead: read the 'count' blocks from 'dbn' onwards into the cache, with
+// one bioReadRun.  Blocks already cached are left alone - a cached copy may
+// be newer than the disk.  Called by the readahead thread, without g_lock
+// ============================================================================
+static void cacheFetch(i32 dbn, i32 count) {
+  i32 slot[RAMAXBLOCKS];                    // buffer claimed; -1 => none
+  i32 lo = -1;                              // first block claimed
+  i32 hi = -1;                              // last block claimed
+
+  if (count > RAMAXBLOCKS) count = RAMAXBLOCKS;
+
+  pthread_mutex_lock(&g_lock);
+  for (i32 i = 0; i < count; ++i) {
+    slot[i] = -1;
+    if (cacheFindAny(dbn + i) >= 0) continue;   // cached, loading, or going
+    i32 b = cacheAlloc(dbn + i);
+    if (b < 0) break;                       // cache full of pinned blocks
+    g_cb[b].loading = 1;
+    ++g_cb[b].pins;
+    slot[i] = b;
+    if (lo < 0) lo = i;
+    hi = i;
+  }
+  pthread_mutex_unlock(&g_lock);
+
+  if (lo < 0) return;                       // all cached already
+  bioReadRun(dbn + lo, hi - lo + 1, g_raBuf);
+
+  pthread_mutex_lock(&g_lock);
+  for (i32 i = lo; i <= hi; ++i) {
+    i32 b = slot[i];
+    if (b < 0) continue;
+    memcpy(g_data[b], g_raBuf + (i - lo) * g_bsize, g_bsize);
+    g_cb[b].loading = 0;
+    cacheUnpin(b);
+    ++g_stats.prefetches;
+  }
+  pthread_cond_broadcast(&g_loaded);
+  pthread_mutex_unlock(&g_lock);
+}
+
+
+
+// ============================================================================
+// Readahead thread: run queued requests until told to stop
+// ============================================================================
+static void* cacheRaMain(void* arg) {
+  pthread_mutex_lock(&g_lock);
+  for (;;) {
+    while (!g_raStop && g_jobNum == 0) pthread_cond_wait(&g_work, &g_lock);
+    if (g_raStop) break;
+
+    CacheJob job = g_jobs[g_jobHead];
+    g_jobHead = (g_jobHead + 1) % CACHEJOBS;
+    --g_jobNum;
+
+    pthread_mutex_unlock(&g_lock);
+    cacheFetch(job.dbn, job.count);
+    pthread_mutex_lock(&g_lock);
+  }
+  pthread_mutex_unlock(&g_lock);
+  return NULL;
+}
+
+
+
+// ============================================================================
+// Queue readahead request 'job', starting the readahead thread if need be.
+// Readahead is only advice: if the queue is full, the request is dropped
+// ============================================================================
+static i32 cacheQueue(CacheJob* job) {
+  pthread_mutex_lock(&g_lock);
+  if (g_raStop) {                           // stopped till the next cacheInit
+    pthread_mutex_unlock(&g_lock);
+    return 0;
+  }
+  if (!g_raRunning) {
+    if (pthread_create(&g_raThread, NULL, cacheRaMain, NULL) != 0) {
+      pthread_mutex_unlock(&g_lock);
+      return 0;                             // no thread => no readahead
+    }
+    g_raRunning = 1;
+  }
+  if (g_jobNum < CACHEJOBS) {
+    g_jobs[(g_jobHead + g_jobNum) % CACHEJOBS] = *job;
+    ++g_jobNum;
+    pthread_cond_signal(&g_work);
+  }
+  pthread_mutex_unlock(&g_lock);
+  return 0;
+}
+
+
+
+// ============================================================================
+// Copy each of the 'count' blocks from 'dbn' onwards, held in 'src', into the
+// cache's copy of it, if any, and mark that copy clean: the run is being
+// written to disk.  Called with g_lock held
+// ============================================================================
+static void cacheMatch(i32 dbn, i32 count, i8* src) {
+  for (i32 d = dbn; d < dbn + count; ++d) {
+    i32 b = cacheFindAny(d);
+    if (b < 0 || g_cb[b].loading || g_cb[b].discard) continue;
+    memcpy(g_data[b], src + (d - dbn) * g_bsize, g_bsize);
+    cacheMarkClean(b);
+  }
+}
+
+
+
+// ============================================================================
+// Drop the cached copies of the 'count' blocks from 'dbn' onwards, without
+// writing them back, even if dirty: the blocks have been freed, and the old
+// copies must not land on top of what is written there next.  Any writeback
+// in progress is waited for.  A pinned copy is marked clean and 'discard',
+// and dropped at its last unpin - see cacheUnpin
+// ============================================================================
+i32 cacheDiscard(i32 dbn, i32 count) {
+  pthread_mutex_lock(&g_wbLock);
+  pthread_mutex_lock(&g_lock);
+  for (i32 b = 0; b < NUMCACHEBLOCKS; ++b) {
+    i32 d = g_cb[b].dbn;
+    if (d < 0 || d < dbn || d - dbn >= count) continue;
+    if (g_cb[b].pins > 0) {
+      cacheMarkClean(b);
+      g_cb[b].discard = 1;
+      continue;
+    }
+    cacheDrop(b);
+  }
+  pthread_mutex_unlock(&g_lock);
+  pthread_mutex_unlock(&g_wbLock);
+  return 0;
+}
+
+
+
+// ============================================================================
+// Write every dirty buffer, except those held, back to the BFS disk, in DBN
+// order, and all in one bioBatch, so that in BIOURING mode the writes are in
+// flight together.  Buffers stay cached
+// ============================================================================
+i32 cacheFlush() {
+  cacheWriteBack(~0ULL, NULL, 0);
+  return 0;
+}
+
+
+
+// ============================================================================
+// As cacheFlush, but write back only those of the 'num' blocks listed in
+// 'dbns' that are cached and dirty
+// ============================================================================
+i32 cacheFlushList(i32* dbns, i32 num) {
+  if (dbns == NULL) FATAL(ENULLPTR);
+  cacheWriteBack(~0ULL, dbns, num);
+  return 0;
+}
+
+
+
+// ============================================================================
+// Return a pointer to the cached copy of block 'dbn', reading it from disk
+// if not already cached - with g_lock dropped, and the buffer marked
+// 'loading' meanwhile.  The buffer is pinned until the matching cachePut
+// ============================================================================
+void* cacheGet(i32 dbn) {
+  if (dbn < 0)               FATAL(EBADDBN);
+  if (dbn >= bioNumBlocks()) FATAL(EBADDBN);
+
+  pthread_mutex_lock(&g_lock);
+  i32 miss = 0;
+  i32 b = cacheLookup(dbn, &miss);
+  ++g_cb[b].pins;
+  if (miss) {
+    g_cb[b].loading = 1;
+    pthread_mutex_unlock(&g_lock);
+    bioRead(dbn, g_data[b]);
+    pthread_mutex_lock(&g_lock);
+    g_cb[b].loading = 0;
+    pthread_cond_broadcast(&g_loaded);
+  }
+  pthread_mutex_unlock(&g_lock);
+  return g_data[b];
+}
+
+
+
+// ============================================================================
+// Empty the cache, and zero its statistics.  Any dirty buffers are discarded,
+// so call cacheFlush first if they matter.  Blocks are cached at the size the
+// BFS disk has now - see bioSetGeometry
+// ============================================================================
+i32 cacheInit() {
+  cacheStop();
+
+  pthread_mutex_lock(&g_lock);
+  g_bsize = bioBlockSize();
+  for (i32 h = 0; h < CACHEHASHSIZE; ++h) g_hash[h] = -1;
+
+  for (i32 b = 0; b < NUMCACHEBLOCKS; ++b) {    // all buffers on LRU list
+    g_cb[b].dbn     = -1;
+    g_cb[b].pins    = 0;
+    g_cb[b].dirty   = 0;
+    g_cb[b].dirtyAt = 0;
+    g_cb[b].loading = 0;
+    g_cb[b].held    = 0;
+    g_cb[b].discard = 0;
+    g_cb[b].hnext   = -1;
+    g_cb[b].prev    = b - 1;
+    g_cb[b].next    = (b == NUMCACHEBLOCKS - 1) ? -1 : b + 1;
+  }
+  g_mru = 0;
+  g_lru = NUMCACHEBLOCKS - 1;
+  g_numDirty = 0;
+  g_raStop   = 0;                           // threads may start again
+  g_flStop   = 0;
+
+  memset(&g_stats, 0, sizeof(CacheStats));
+  pthread_mutex_unlock(&g_lock);
+  return 0;
+}
+
+
+
+// ============================================================================
+// Queue a readahead of the 'count' blocks from 'dbn' onwards into the cache.
+// They are read in the background, with one IO; return at once
+// ============================================================================
+i32 cachePrefetch(i32 dbn, i32 count) {
+  if (dbn < g_super.dbnData || count < 1) return 0;
+  CacheJob job = { dbn, count };
+  return cacheQueue(&job);
+}
+
+
+
+// ============================================================================
+// Release the buffer for block 'dbn', pinned by cacheGet.  If the caller
+// modified it, pass 'dirty' = 1, so it is written back later; or CACHEHELD,
+// so it is written back only after a cacheRelease
+// ============================================================================
+i32 cachePut(i32 dbn, i32 dirty) {
+  pthread_mutex_lock(&g_lock);
+  i32 b = cacheFindAny(dbn);
+  if (b < 0 || g_cb[b].pins == 0) FATAL(EBADDBN);   // not pinned
+  if (dirty && !g_cb[b].discard) cacheMarkDirty(b);
+  if (dirty == CACHEHELD && !g_cb[b].discard) g_cb[b].held = 1;
+  cacheUnpin(b);
+  pthread_mutex_unlock(&g_lock);
+  return 0;
+}
+
+
+
+// ============================================================================
+// Let block 'dbn', held since a cachePut(dbn, CACHEHELD), be written back
+// again, like any other dirty block.  If it is not cached, do nothing
+// ============================================================================
+i32 cacheRelease(i32 dbn) {
+  pthread_mutex_lock(&g_lock);
+  i32 b = cacheFindAny(dbn);
+  if (b >= 0) g_cb[b].held = 0;
+  pthread_mutex_unlock(&g_lock);
+  return 0;
+}
+
+
+
+// ============================================================================
+// Copy block 'dbn' into 'buf', via the cache
+// ============================================================================
+i32 cacheRead(i32 dbn, void* buf) {
+  void* p = cacheGet(dbn);
+  memcpy(buf, p, g_bsize);
+  cachePut(dbn, 0);
+  return 0;
+}
+
+
+
+// ============================================================================
+// Read 'count' consecutive blocks, from 'dbn' onwards, into 'buf'.  Blocks the
+// cache holds are copied from it, since they may be newer than the disk.  Each
+// stretch of uncached blocks between them is read from disk with one request,
+// straight into 'buf' - not into the cache, so that a long sequential read
+// does not evict everything else.  The requests go in one bioBatch, so that
+// in BIOURING mode they are in flight together.  They are issued with g_lock
+// released, so that concurrent readers overlap their IO.  That is safe: a
+// block cached meanwhile is clean, unless the file it belongs to was written
+// - which fsWrite does not do while it is being read
+// ============================================================================
+i32 cacheReadRun(i32 dbn, i32 count, void* buf) {
+  i8*    dst   = (i8*)buf;
+  i32    first = dbn;                       // first block not yet read
+  BioReq reqs[BIOQDEPTH];
+  i32    num   = 0;
+
+  pthread_mutex_lock(&g_lock);
+  for (i32 d = dbn; d <= dbn + count; ++d) {
+    i32 b = -1;
+    if (d < dbn + count) {
+      b = cacheFind(d);
+      if (b < 0) { ++g_stats.misses; continue; }
+      ++g_stats.hits;
+    }
+    if (d > first) {                        // uncached stretch ends here
+      BioReq req = { BIOOPREAD, first, d - first,
+                     dst + (first - dbn) * g_bsize };
+      reqs[num++] = req;
+      if (num == BIOQDEPTH) {
+        pthread_mutex_unlock(&g_lock);
+        bioBatch(reqs, num);
+        num = 0;
+        pthread_mutex_lock(&g_lock);
+      }
+    }
+    if (b >= 0) {
+      memcpy(dst + (d - dbn) * g_bsize, g_data[b], g_bsize);
+    }
+    first = d + 1;
+  }
+  pthread_mutex_unlock(&g_lock);
+  bioBatch(reqs, num);
+  return 0;
+}
+
+
+
+// ============================================================================
+// Copy the cache statistics into 'stats'
+// ============================================================================
+i32 cacheStats(CacheStats* stats) {
+  if (stats == NULL) FATAL(ENULLPTR);
+  pthread_mutex_lock(&g_lock);
+  memcpy(stats, &g_stats, sizeof(CacheStats));
+  pthread_mutex_unlock(&g_lock);
+  return 0;
+}
+
+
+
+// ============================================================================
+// Stop the readahead and flusher threads, if running, and drop any readahead
+// requests still queued.  Dirty blocks stay dirty.  Neither thread starts
+// again till the next cacheInit, so that none outlives the BFS disk, which
+// fsUnmount closes soon after - once it has written back what remains
+// ============================================================================
+i32 cacheStop() {
+  pthread_mutex_lock(&g_lock);
+  i32 ra = g_raRunning;
+  i32 fl = g_flRunning;
+  g_raStop = 1;
+  g_flStop = 1;
+  pthread_cond_signal(&g_work);
+  pthread_cond_signal(&g_flWake);
+  pthread_mutex_unlock(&g_lock);
+
+  if (ra) pthread_join(g_raThread, NULL);
+  if (fl) pthread_join(g_flThread, NULL);
+
+  pthread_mutex_lock(&g_lock);
+  g_raRunning = 0;
+  g_flRunning = 0;
+  g_jobHead   = 0;
+  g_jobNum    = 0;
+  pthread_mutex_unlock(&g_lock);
+  return 0;
+}
+
+
+
+// ============================================================================
+// Set the flusher's thresholds: a block dirty for 'ageMs' msecs is written
+// back; and once more than 'dirtyPct' percent of the cache is dirty, every
+// dirty block is.  A value < 1 leaves that threshold as it is
+// ============================================================================
+i32 cacheTune(i32 ageMs, i32 dirtyPct) {
+  pthread_mutex_lock(&g_lock);
+  if (ageMs    > 0) g_flushAge = ageMs;
+  if (dirtyPct > 0) g_dirtyPct = (dirtyPct > 100) ? 100 : dirtyPct;
+  pthread_cond_signal(&g_flWake);
+  pthread_mutex_unlock(&g_lock);
+  return 0;
+}
+
+
+
+// ============================================================================
+// Overwrite block 'dbn' with the contents of 'buf'.  The whole block is
+// replaced, so a block not yet cached is not read from disk first.  The
+// write reaches disk on eviction or cacheFlush
+// ============================================================================
+i32 cacheWrite(i32 dbn, void* buf) {
+  if (dbn < 0)               FATAL(EBADDBN);
+  if (dbn >= bioNumBlocks()) FATAL(EBADDBN);
+
+  pthread_mutex_lock(&g_lock);
+  i32 miss = 0;
+  i32 b = cacheLookup(dbn, &miss);
+  memcpy(g_data[b], buf, g_bsize);
+  cacheMarkDirty(b);
+  pthread_mutex_unlock(&g_lock);
+  return 0;
+}
+
+
+
+// ============================================================================
+// Overwrite 'count' consecutive blocks, from 'dbn' onwards, with the contents
+// of 'buf'.  The blocks are wholly replaced, so none is read first.  A short
+// run, of up to CACHEABSORB blocks, is absorbed into the cache as dirty
+// blocks, for the flusher to write back.  A longer one goes to disk at once,
+// so that it does not flood the cache: in requests of up to CACHEWRITEIO
+// blocks, all in one bioBatch, so that in BIOURING mode they are in flight
+// together.  Any of its blocks the cache holds are updated to match, and so
+// become clean - before the IO, so that eviction cannot write an older copy
+// over it; and after, in case readahead cached what the disk held meanwhile.
+// g_lock is not held across the IO
+// ============================================================================
+i32 cacheWriteRun(i32 dbn, i32 count, void* buf) {
+  i8* src = (i8*)buf;
+
+  if (count <= CACHEABSORB) {
+    i32 done = 0;                           // blocks absorbed
+    pthread_mutex_lock(&g_lock);
+    while (done < count) {
+      i32 b = cacheFind(dbn + done);
+      if (b < 0) b = cacheAlloc(dbn + done);
+      if (b < 0) break;                     // every buffer pinned: write thru
+      memcpy(g_data[b], src + done * g_bsize, g_bsize);
+      cacheMarkDirty(b);
+      cacheTouch(b);
+      ++done;
+    }
+    pthread_mutex_unlock(&g_lock);
+    if (done == count) return 0;
+    dbn   += done;
+    count -= done;
+    src   += done * g_bsize;
+  }
+
+  BioReq reqs[BIOQDEPTH];
+  i32    num = 0;
+  for (i32 done = 0; done < count && num < BIOQDEPTH; ) {
+    i32 n = (count - done < CACHEWRITEIO) ? count - done : CACHEWRITEIO;
+    if (num == BIOQDEPTH - 1) n = count - done;   // last takes the rest
+    BioReq req = { BIOOPWRITE, dbn + done, n, src + done * g_bsize };
+    reqs[num++] = req;
+    done += n;
+  }
+
+  pthread_mutex_lock(&g_wbLock);            // no writeback of older copies
+  pthread_mutex_lock(&g_lock);              // ... may land after this write
+  cacheMatch(dbn, count, src);
+  pthread_mutex_unlock(&g_lock);
+
+  bioBatch(reqs, num);
+
+  pthread_mutex_lock(&g_lock);
+  cacheMatch(dbn, count, src);
+  pthread_mutex_unlock(&g_lock);
+  pthread_mutex_unlock(&g_wbLock);
+  return 0;
+}
@@ -0,0 +1,49 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+// ===================================================================
+// cache.h - Block buffer cache.  Sits between BFS (bfs.c, fs.c) and
+// Block IO (bio.c).  Keeps recently used disk blocks in memory, and
+// writes modified blocks back to the BFS disk lazily: on eviction,
+// or on cacheFlush.  Reads ahead, in the background, blocks that a
+// sequential reader will want next
+// ===================================================================
+
+#include "alias.h"
+
+#define NUMCACHEBLOCKS 256        // capacity of the cache, in blocks
+#define CACHEHASHSIZE  256        // buckets in the DBN hash table
+#define CACHEJOBS      8          // readahead requests that can be queued
+#define RAMAXBLOCKS    16         // largest readahead window, in blocks
+#define CACHEHELD      2          // cachePut 'dirty': hold until cacheRelease
+#define CACHEABSORB    16         // longest write run absorbed into the cache
+#define CACHEWRITEIO   64         // cacheWriteRun: most blocks per request
+#define CACHEFLUSHAGE  1000       // flusher: write back blocks this old, msecs
+#define CACHEDIRTYPCT  50         // flusher: ... or all, if more % dirty
+
+typedef struct {          // Cache statistics
+  u64 hits;               // lookups satisfied from the cache
+  u64 misses;             // lookups not found in the cache
+  u64 evictions;          // blocks dropped to make room for another
+  u64 writebacks;         // dirty blocks written back to the BFS disk
+  u64 prefetches;         // blocks read into the cache by readahead
+  u64 flushes;            // dirty blocks written back by the flusher
+} CacheStats;
+
+i32   cacheDiscard(i32 dbn, i32 count);
+i32   cacheFlush();
+i32   cacheFlushList(i32* dbns, i32 num);
+void* cacheGet  (i32 dbn);
+i32   cacheInit ();
+i32   cachePrefetch(i32 dbn, i32 count);
+i32   cachePut  (i32 dbn, i32 dirty);
+i32   cacheRead (i32 dbn, void* buf);
+i32   cacheReadRun(i32 dbn, i32 count, void* buf);
+i32   cacheRelease(i32 dbn);
+i32   cacheStats(CacheStats* stats);
+i32   cacheStop ();
+i32   cacheTune (i32 ageMs, i32 dirtyPct);
+i32   cacheWrite(i32 dbn, void* buf);
+i32   cacheWriteRun(i32 dbn, i32 count, void* buf);
+
+#endif
\ No newline at end of file
@@ -0,0 +1,932 @@
+// ============================================================================
+// check.c - correctness checks of BFS, each on a freshly formatted scratch
+// image, CHECKDISK, removed when done: BFSDISK, which p5test reads, is left
+// alone.  "main check" runs them all; "main check <name>" just the one named.
+// Each prints a line ending "OK" or "FAILED", and "main check" returns 1 if
+// any failed
+//
+// checkReplay crashes BFS, in effect, just after a commit: it copies the disk
+// aside while committed blocks are still in the cache, not yet written home,
+// then mounts the copy, so that jrnReplay must recover them.  It does so after
+// one transaction; after two, the last of them torn (its checksum no longer
+// matching, so that replay must ignore it); and after enough to have emptied
+// the journal, via jrnCheckpoint, at least once
+//
+// checkRefill fills most of the disk with one file, commits, then truncates
+// and rewrites it.  The rewrite needs the blocks the truncate freed, which
+// cannot be had till the transaction that freed them commits
+//
+// checkNames creates files whose names are of lengths from 1 to FNAMEMAX - 1,
+// some sharing all of a Dir entry's worth of name, and checks that each holds
+// what was written to it, across a remount; renames a long name to a short
+// one and back; then deletes them all, and checks that every block is free.
+//
+// checkMany creates CHECKMANY files, every CHECKLONGEVERY'th with a name long
+// enough to need a name block, looks each up, then deletes them all, and
+// checks that every block is free
+//
+// checkNameCache looks up each name just before and just after every change
+// to it - create, delete, rename either way, and rename over another file -
+// so that a stale name cache entry, for a hit or a miss, would be caught
+//
+// checkSparse writes CHECKSPARSEN bytes at offset CHECKSPARSEAT of an empty
+// file, part way into a block.  fsSize must then count the hole before them;
+// the hole, and the rest of their block, must read as zeroes; and the write
+// must allocate just the one block - before and after a remount
+//
+// checkDelay creates CHECKDELAYFILES small files, writes, closes and deletes
+// each, all within one group of operations.  Their blocks are delayed, so
+// none may change the allocation bitmap; and the free blocks reserved for
+// them must be given back, so that a file of every free block still fits
+//
+// checkFds opens one file on two File Descriptors, and reads and seeks through
+// each: every cursor must move on its own.  Closing one must leave the other
+// working.  Reading through the closed one must abort with ENOTOPEN; and
+// opening the file once more than there are descriptors, with EFDFULL.  Such
+// aborts run in a child process - see checkFatal
+//
+// checkPread reads with fsPread, within the file and across its end, and
+// writes with fsPwrite, CHECKPWRITEAT past its end.  Neither may move the
+// cursor, which fsRead then goes on from; the write must extend the file to
+// just past it, with zeroes before it - before and after a remount
+//
+// checkBigFormat formats a disk of CHECKBIGBLOCKS blocks, which must take
+// under CHECKBIGMS milliseconds, and leave the image sparse: under
+// CHECKBIGBYTES on disk.  Mounted, every data block must be free.  The first
+// block written must go to the first data block; and a run sought in the
+// middle of the disk, whose bitmap block was never written, but left a hole,
+// must be found right there - the hole reads as all free
+//
+// checkCorrupt formats and fills disks of several geometries, each of which
+// must mount, and read back.  Then, on one of them, it damages a SuperBlock
+// field at a time - numInodes, dbnDir, numFree - and then the Dir entry of a
+// file, giving it an inum past the last Inode.  fsMount must abort on each,
+// with EBADGEOM - or, for the Dir entry, EBADINUM - in a child process, see
+// checkFatal; and mount again once the damage is undone
+// ============================================================================
+
+#include <stddef.h>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "bfs.h"
+#include "cache.h"
+#include "check.h"
+#include "errors.h"
+#include "fs.h"
+#include "jrn.h"
+
+typedef struct {          // One check, run by checkRun
+  str name;
+  i32 (*fn)();            // return # of faults found
+} Check;
+
+static i8 g_data[CHECKBYTES];             // bytes written, or read back
+
+
+
+// ============================================================================
+// Return byte 'i' of the contents given to file 'fname'
+// ============================================================================
+static i8 checkByte(str fname, i32 i) {
+  u32 h = 2166136261u;
+  for (str p = fname; *p; ++p) h = (h ^ (u8)*p) * 16777619u;
+  return (i8)(h + i * 31 + i / 251);
+}
+
+
+
+// ============================================================================
+// Create file 'fname', holding 'numb' bytes, each as given by checkByte
+// ============================================================================
+static void checkWriteFile(str fname, i32 numb) {
+  i32 fd = fsCreate(fname);
+  for (i32 pos = 0; pos < numb; pos += CHECKBYTES) {
+    i32 len = (numb - pos < CHECKBYTES) ? numb - pos : CHECKBYTES;
+    for (i32 i = 0; i < len; ++i) g_data[i] = checkByte(fname, pos + i);
+    fsWrite(fd, len, g_data);
+  }
+  fsClose(fd);
+}
+
+
+
+// ============================================================================
+// Return the # of faults in file 'fname', which should hold 'numb' bytes, as
+// checkWriteFile wrote them.  'numb' < 0 means the file should not exist
+// ============================================================================
+static i32 checkFile(str fname, i32 numb) {
+  i32 fd = fsOpen(fname);
+  if (numb < 0) return (fd == EFNF) ? 0 : 1;
+  if (fd < 0) return 1;
+
+  i32 bad = (fsSize(fd) == numb) ? 0 : 1;
+  for (i32 pos = 0; pos <= numb && bad == 0; pos += CHECKBYTES) {
+    i32 len = (numb - pos < CHECKBYTES) ? numb - pos : CHECKBYTES;
+    if (fsRead(fd, CHECKBYTES, g_data) != len) ++bad;
+    for (i32 i = 0; i < len && bad == 0; ++i) {
+      if (g_data[i] != checkByte(fname, pos + i)) ++bad;
+    }
+  }
+  fsClose(fd);
+  return bad;
+}
+
+
+
+// ============================================================================
+// Commit all changes so far, as fsSync does, but without writing any block
+// home: until the cache is flushed, the journal alone holds them
+// ============================================================================
+static void checkCommit() {
+  jrnBegin();
+  bfsSyncDelayed(1);
+  jrnEnd();
+  jrnCommit();
+}
+
+
+
+// ============================================================================
+// Copy file 'from' to file 'to'.  Return 0 on success
+// ============================================================================
+static i32 checkCopy(str from, str to) {
+  FILE* in  = fopen(from, "rb");
+  FILE* out = fopen(to, "wb");
+  i32 bad = (in == NULL || out == NULL) ? 1 : 0;
+  size_t n;
+  while (bad == 0 && (n = fread(g_data, 1, CHECKBYTES, in)) > 0) {
+    if (fwrite(g_data, 1, n, out) != n) bad = 1;
+  }
+  if (in)  fclose(in);
+  if (out) fclose(out);
+  return bad;
+}
+
+
+
+// ============================================================================
+// Tear the last transaction in the journal of disk image 'path': flip a byte
+// in the first block it logs, so that its checksum no longer matches.
+// Return 0 on success
+// ============================================================================
+static i32 checkTearLast(str path) {
+  FILE* fp = fopen(path, "r+b");
+  if (fp == NULL) return 1;
+
+  i32 bsize = g_super.blockSize;
+  i8 buf[MAXBLOCKSIZE];
+  JrnSuper* js = (JrnSuper*)buf;
+  JrnDesc*  jd = (JrnDesc*)buf;
+
+  fseek(fp, (long)g_super.dbnJournal * bsize, SEEK_SET);
+  fread(buf, 1, bsize, fp);
+  u32 seq  = js->seq;
+  i32 dbn  = g_super.dbnJournal + 1;
+  i32 last = -1;
+  i32 end  = g_super.dbnJournal + g_super.numJournal;
+  while (dbn < end) {                       // walk the transactions
+    fseek(fp, (long)dbn * bsize, SEEK_SET);
+    if (fread(buf, 1, bsize, fp) != (size_t)bsize) break;
+    if (jd->magic != JRNMAGIC || jd->seq != seq) break;
+    last = dbn;
+    dbn += 1 + jd->count;
+    ++seq;
+  }
+
+  i32 bad = (last < 0) ? 1 : 0;
+  if (bad == 0) {
+    i8 b;
+    fseek(fp, (long)(last + 1) * bsize, SEEK_SET);
+    fread(&b, 1, 1, fp);
+    b ^= 0x5A;
+    fseek(fp, (long)(last + 1) * bsize, SEEK_SET);
+    fwrite(&b, 1, 1, fp);
+  }
+  fclose(fp);
+  return bad;
+}
+
+
+
+// ============================================================================
+// Mount disk image 'path', in place of CHECKDISK, and return the # of blocks
+// jrnReplay recovered from its journal
+// ============================================================================
+static i32 checkMountCopy(str path) {
+  checkCopy(path, CHECKDISK);
+  fsMount();
+  JrnStats js;
+  jrnStats(&js);
+  return js.replayed;
+}
+
+
+
+// ============================================================================
+// See the top of this file.  Return the # of faults found
+// ============================================================================
+static i32 checkReplay() {
+  fsFormat(CHECKBLOCKS, CHECKINODES, CHECKBSIZE);
+  fsMount();
+  cacheTune(CHECKNOFLUSH, 100);             // nothing written home but by us
+
+  checkWriteFile("a", CHECKFILE);
+  checkCommit();
+  i32 bad = checkCopy(CHECKDISK, CHECKCRASH);
+
+  checkWriteFile("b", CHECKFILE / 2);
+  checkCommit();
+  bad += checkCopy(CHECKDISK, CHECKTORN);
+  bad += checkTearLast(CHECKTORN);
+
+  JrnStats js;                              // rewrite "w", a commit each
+  jrnStats(&js);                            // time, till CHECKWRAPPED past
+  i32 checkpoints = js.checkpoints;         // a checkpoint
+  i32 after = -1;
+  i32 wlen  = 0;
+  while (after < CHECKWRAPPED) {
+    wlen = CHECKBSIZE + after + 2;
+    checkWriteFile("w", wlen);
+    checkCommit();
+    jrnStats(&js);
+    if (after >= 0 || js.checkpoints != checkpoints) ++after;
+  }
+  bad += checkCopy(CHECKDISK, CHECKWRAP);
+  fsUnmount();
+
+  // After one transaction: "a" is recovered.  A second mount finds nothing
+  // more to replay
+
+  if (checkMountCopy(CHECKCRASH) == 0) ++bad;
+  bad += checkFile("a", CHECKFILE);
+  bad += checkFile("b", -1);
+  fsUnmount();
+  fsMount();
+  JrnStats again;
+  jrnStats(&again);
+  if (again.replayed != 0) ++bad;
+  bad += checkFile("a", CHECKFILE);
+  fsUnmount();
+
+  // After two, the last torn: just "a" is recovered
+
+  if (checkMountCopy(CHECKTORN) == 0) ++bad;
+  bad += checkFile("a", CHECKFILE);
+  bad += checkFile("b", -1);
+  fsUnmount();
+
+  // After the journal was emptied: every file is there
+
+  if (checkMountCopy(CHECKWRAP) == 0) ++bad;
+  bad += checkFile("a", CHECKFILE);
+  bad += checkFile("b", CHECKFILE / 2);
+  bad += checkFile("w", wlen);
+  fsUnmount();
+
+  cacheTune(CACHEFLUSHAGE, CACHEDIRTYPCT);
+  remove(CHECKCRASH);
+  remove(CHECKTORN);
+  remove(CHECKWRAP);
+  return bad;
+}
+
+
+
+// ============================================================================
+// See the top of this file.  Return the # of faults found
+// ============================================================================
+static i32 checkRefill() {
+  fsFormat(CHECKBLOCKS / 2, CHECKINODES, CHECKBSIZE);
+  fsMount();
+  i32 numFree = g_super.numFree;
+  i32 numb    = CHECKREFILL * CHECKBSIZE;
+
+  checkWriteFile("a", numb);
+  fsSync();
+  checkWriteFile("a", numb);                // fsCreate truncates it first
+  i32 bad = checkFile("a", numb);
+  fsUnmount();
+
+  fsMount();
+  bad += checkFile("a", numb);
+  fsDelete("a");
+  fsUnmount();
+  fsMount();
+  if (g_super.numFree != numFree) ++bad;
+  fsUnmount();
+  return bad;
+}
+
+
+
+// ============================================================================
+// Set 'name' to name # 'k' of checkNames.  Names CHECKNAMES / 2 onwards are
+// those of the first half, with the last char changed
+// ============================================================================
+static void checkName(char* name, i32 k) {
+  static const i32 lens[] = { 1, FNAMESIZE - 2, FNAMESIZE - 1, FNAMESIZE,
+                              FNAMESIZE + 1, 2 * FNAMESIZE, FNAMEMAX - 1 };
+  i32 half = CHECKNAMES / 2;
+  i32 len  = lens[k % half];
+  for (i32 i = 0; i < len; ++i) name[i] = 'a' + (i * 7 + k % half) % 26;
+  name[len] = 0;
+  if (k >= half) name[len - 1] = 'Z';
+}
+
+
+
+// ============================================================================
+// See the top of this file.  Return the # of faults found
+// ============================================================================
+static i32 checkNames() {
+  fsFormat(CHECKBLOCKS, CHECKINODES, CHECKBSIZE);
+  fsMount();
+  i32 numFree = g_super.numFree;
+  i32 bad = 0;
+
+  char name[FNAMEMAX];
+  for (i32 k = 0; k < CHECKNAMES; ++k) {
+    checkName(name, k);
+    checkWriteFile(name, 100 + k);
+  }
+  for (i32 pass = 0; pass < 2; ++pass) {    // before and after a remount
+    for (i32 k = 0; k < CHECKNAMES; ++k) {
+      checkName(name, k);
+      bad += checkFile(name, 100 + k);
+    }
+    fsUnmount();
+    fsMount();
+  }
+
+  checkName(name, CHECKNAMES - 1);          // long => short, and back
+  if (fsRename(name, "s") != 0) ++bad;
+  bad += checkFile(name, -1);
+  i32 fd = fsOpen("s");
+  if (fd < 0 || fsSize(fd) != 100 + CHECKNAMES - 1) ++bad;
+  if (fd >= 0) fsClose(fd);
+  if (fsRename("s", name) != 0) ++bad;
+  bad += checkFile("s", -1);
+  bad += checkFile(name, 100 + CHECKNAMES - 1);
+
+  for (i32 k = 0; k < CHECKNAMES; ++k) {
+    checkName(name, k);
+    if (fsDelete(name) != 0) ++bad;
+  }
+  fsUnmount();
+  fsMount();
+  if (g_super.numFree != numFree) ++bad;
+  for (i32 k = 0; k < CHECKNAMES; ++k) {
+    checkName(name, k);
+    bad += checkFile(name, -1);
+  }
+  fsUnmount();
+  return bad;
+}
+
+
+
+// ============================================================================
+// Set 'name' to name # 'k' of checkMany
+// ============================================================================
+static void checkManyName(char* name, i32 k) {
+  sprintf(name, "many-%07d", k);
+  if (k % CHECKLONGEVERY != 0) return;
+  i32 len = strlen(name);
+  memset(name + len, '-', 2 * FNAMESIZE - len);
+  sprintf(name + 2 * FNAMESIZE, "%d", k);
+}
+
+
+
+// ============================================================================
+// See the top of this file.  Return the # of faults found
+// ============================================================================
+static i32 checkMany() {
+  fsFormat(CHECKMANYBLOCKS, CHECKMANY, CHECKBSIZE);
+  fsMount();
+  i32 numFree = g_super.numFree;
+  i32 bad = 0;
+
+  char name[FNAMEMAX];
+  for (i32 k = 0; k < CHECKMANY; ++k) {
+    checkManyName(name, k);
+    i32 fd = fsCreate(name);
+    if (fd < 0) ++bad;
+    else fsClose(fd);
+  }
+  fsUnmount();
+  fsMount();
+  for (i32 k = 0; k < CHECKMANY; ++k) {
+    checkManyName(name, k);
+    bad += checkFile(name, 0);
+    if (fsDelete(name) != 0) ++bad;
+  }
+  fsUnmount();
+  fsMount();
+  if (g_super.numFree != numFree) ++bad;
+  checkManyName(name, 0);
+  bad += checkFile(name, -1);
+  fsUnmount();
+  return bad;
+}
+
+
+
+// ============================================================================
+// Return the size of file 'fname', opened afresh, or EFNF if there is none
+// ============================================================================
+static i64 checkSize(str fname) {
+  i32 fd = fsOpen(fname);
+  if (fd < 0) return EFNF;
+  i64 size = fsSize(fd);
+  fsClose(fd);
+  return size;
+}
+
+
+
+// ============================================================================
+// See the top of this file.  Return the # of faults found
+// ============================================================================
+static i32 checkNameCache() {
+  fsFormat(CHECKBLOCKS, CHECKINODES, CHECKBSIZE);
+  fsMount();
+  i32 bad = 0;
+
+  if (checkSize("x") != EFNF) ++bad;        // miss, then create
+  checkWriteFile("x", 10);
+  if (checkSize("x") != 10) ++bad;
+  if (fsDelete("x") != 0) ++bad;            // hit, then delete
+  if (checkSize("x") != EFNF) ++bad;
+
+  checkWriteFile("p", 20);                  // rename "p" => "q", and back
+  if (checkSize("p") != 20 || checkSize("q") != EFNF) ++bad;
+  if (fsRename("p", "q") != 0) ++bad;
+  if (checkSize("p") != EFNF || checkSize("q") != 20) ++bad;
+  if (fsRename("q", "p") != 0) ++bad;
+  if (checkSize("p") != 20 || checkSize("q") != EFNF) ++bad;
+
+  checkWriteFile("r", 30);                  // rename "p" over "r"
+  if (checkSize("r") != 30) ++bad;
+  if (fsRename("p", "r") != 0) ++bad;
+  if (checkSize("p") != EFNF || checkSize("r") != 20) ++bad;
+
+  fsUnmount();                              // and the disk agrees
+  fsMount();
+  if (checkSize("x") != EFNF || checkSize("p") != EFNF) ++bad;
+  if (checkSize("q") != EFNF || checkSize("r") != 20)   ++bad;
+  fsUnmount();
+  return bad;
+}
+
+
+
+// ============================================================================
+// Return the # of faults in the 'numb' bytes at offset 'pos' of the file open
+// on 'fd', which should be zeroes before offset 'at', and from there on, those
+// given by checkByte for file 'fname'
+// ============================================================================
+static i32 checkZeroes(i32 fd, i64 pos, i32 numb, str fname, i64 at) {
+  if (fsPread(fd, pos, numb, g_data) != numb) return 1;
+  i32 bad = 0;
+  for (i32 i = 0; i < numb; ++i) {
+    i8 want = (pos + i < at) ? 0 : checkByte(fname, (i32)(pos + i - at));
+    if (g_data[i] != want) ++bad;
+  }
+  return bad;
+}
+
+
+
+// ============================================================================
+// See the top of this file.  Return the # of faults found
+// ============================================================================
+static i32 checkSparse() {
+  fsFormat(CHECKBLOCKS, CHECKINODES, CHECKBSIZE);
+  fsMount();
+  i32 fd = fsCreate("s");
+  fsClose(fd);
+  fsUnmount();
+  fsMount();
+  i32 numFree = g_super.numFree;            // all but the file's data
+  i64 at      = CHECKSPARSEAT;
+  i64 size    = at + CHECKSPARSEN;
+  i64 blk     = at - at % CHECKBSIZE;       // start of the one block written
+  i32 bad     = 0;
+
+  fd = fsOpen("s");
+  for (i32 i = 0; i < CHECKSPARSEN; ++i) g_data[i] = checkByte("s", i);
+  fsPwrite(fd, at, CHECKSPARSEN, g_data);
+  for (i32 pass = 0; pass < 2; ++pass) {    // before and after a remount
+    if (fsSize(fd) != size) ++bad;
+    bad += checkZeroes(fd, 0, CHECKBSIZE, "s", at);
+    bad += checkZeroes(fd, at / 2, CHECKBSIZE, "s", at);
+    bad += checkZeroes(fd, blk - CHECKBSIZE, (i32)(size - blk) + CHECKBSIZE,
+                       "s", at);
+    fsClose(fd);
+    fsUnmount();
+    fsMount();
+    if (g_super.numFree != numFree - 1) ++bad;
+    fd = fsOpen("s");
+  }
+  fsClose(fd);
+
+  if (fsDelete("s") != 0) ++bad;
+  fsUnmount();
+  fsMount();
+  if (g_super.numFree != numFree) ++bad;
+  fsUnmount();
+  return bad;
+}
+
+
+
+// ============================================================================
+// See the top of this file.  Return the # of faults found
+// ============================================================================
+static i32 checkDelay() {
+  fsFormat(CHECKBLOCKS, CHECKINODES, CHECKBSIZE);
+  fsMount();
+  i32 numFree = g_super.numFree;
+  i32 bad = 0;
+
+  checkCommit();                            // start a fresh group
+  JrnStats before;
+  jrnStats(&before);
+  char name[FNAMESIZE];
+  for (i32 k = 0; k < CHECKDELAYFILES; ++k) {
+    sprintf(name, "d%d", k);
+    checkWriteFile(name, CHECKDELAYN);
+    if (fsDelete(name) != 0) ++bad;
+  }
+  JrnStats after;
+  jrnStats(&after);
+  if (after.commits != before.commits) ++bad;
+  if (bfsDirtyBitmap() != 0) ++bad;
+
+  checkWriteFile("f", numFree * CHECKBSIZE);
+  fsSync();
+  if (g_super.numFree != 0) ++bad;
+  if (fsDelete("f") != 0) ++bad;
+  fsUnmount();
+  fsMount();
+  if (g_super.numFree != numFree) ++bad;
+  fsUnmount();
+  return bad;
+}
+
+
+
+// ============================================================================
+// Run fn('arg') in a child process, reading no input, and copy what it prints
+// into 'out': up to 'max' - 1 chars, then a NUL.  Return the # copied
+// ============================================================================
+static i32 checkChild(void (*fn)(i32), i32 arg, char* out, i32 max) {
+  int fds[2];
+  out[0] = 0;
+  if (pipe(fds) != 0) return 0;
+  fflush(stdout);
+  pid_t pid = fork();
+  if (pid == 0) {
+    close(fds[0]);
+    dup2(fds[1], 1);
+    freopen("/dev/null", "r", stdin);     // RepPause waits for a key
+    fn(arg);
+    fflush(stdout);
+    _exit(0);
+  }
+  close(fds[1]);
+  i32 num = 0;
+  ssize_t n = 0;
+  while (num < max - 1 && (n = read(fds[0], out + num, max - 1 - num)) > 0) {
+    num += n;
+  }
+  out[num] = 0;
+  close(fds[0]);
+  if (pid > 0) waitpid(pid, NULL, 0);
+  return num;
+}
+
+
+
+// ============================================================================
+// Return 0 if fn('arg') aborts as FATAL('err') does: its output ends with
+// what RepError prints for 'err'.  Otherwise 1.  It runs in a child process,
+// so that the abort leaves this one going on; the child must not write to
+// the disk, which it shares
+// ============================================================================
+static i32 checkFatal(void (*fn)(i32), i32 arg, i32 err) {
+  static char got[CHECKOUTPUT];
+  static char want[CHECKOUTPUT];
+  i32 ngot  = checkChild(fn, arg, got, CHECKOUTPUT);
+  i32 nwant = checkChild(RepError, err, want, CHECKOUTPUT);
+  if (nwant == 0 || ngot < nwant) return 1;
+  return (strcmp(got + ngot - nwant, want) == 0) ? 0 : 1;
+}
+
+
+
+// ============================================================================
+// Return the # of faults in reading 'numb' bytes through 'fd', on file
+// 'fname' as checkWriteFile wrote it, whose cursor should be at 'pos'
+// ============================================================================
+static i32 checkCursor(i32 fd, str fname, i64 pos, i32 numb) {
+  i32 bad = (fsTell(fd) == pos) ? 0 : 1;
+  if (fsRead(fd, numb, g_data) != numb) return bad + 1;
+  for (i32 i = 0; i < numb; ++i) {
+    if (g_data[i] != checkByte(fname, (i32)pos + i)) ++bad;
+  }
+  if (fsTell(fd) != pos + numb) ++bad;
+  return bad;
+}
+
+
+
+// ============================================================================
+// Read a byte through File Descriptor 'fd': for checkFatal
+// ============================================================================
+static void checkReadFd(i32 fd) {
+  i8 b;
+  fsRead(fd, 1, &b);
+}
+
+
+
+// ============================================================================
+// Open file "f": for checkFatal
+// ============================================================================
+static void checkOpenF(i32 unused) {
+  fsOpen("f");
+}
+
+
+
+// ============================================================================
+// See the top of this file.  Return the # of faults found
+// ============================================================================
+static i32 checkFds() {
+  fsFormat(CHECKBLOCKS, CHECKINODES, CHECKBSIZE);
+  fsMount();
+  checkWriteFile("f", CHECKFDFILE);
+  i32 a = fsOpen("f");
+  i32 b = fsOpen("f");
+  if (a < 0 || b < 0 || a == b) {
+    fsUnmount();
+    return 1;
+  }
+
+  i32 bad = checkCursor(a, "f", 0, 100);    // each cursor on its own
+  bad += checkCursor(b, "f", 0, 50);
+  fsSeek(b, 1000, SEEK_SET);
+  bad += checkCursor(b, "f", 1000, 100);
+  bad += checkCursor(a, "f", 100, 100);
+  fsSeek(a, 50, SEEK_CUR);
+  bad += checkCursor(a, "f", 250, 100);
+  bad += checkCursor(b, "f", 1100, 100);
+
+  fsClose(a);                               // "b" goes on working
+  bad += checkCursor(b, "f", 1200, 100);
+  fsSeek(b, 0, SEEK_SET);
+  bad += checkCursor(b, "f", 0, 100);
+  bad += checkFatal(checkReadFd, a, ENOTOPEN);
+
+  i32 fds[NUMFDS];                          // every descriptor but "b"
+  for (i32 i = 0; i < NUMFDS - 1; ++i) {
+    fds[i] = fsOpen("f");
+    if (fds[i] < 0) ++bad;
+  }
+  checkCommit();                            // so the child commits none
+  bad += checkFatal(checkOpenF, 0, EFDFULL);
+  for (i32 i = 0; i < NUMFDS - 1; ++i) {
+    if (fds[i] >= 0) fsClose(fds[i]);
+  }
+  bad += checkCursor(b, "f", 100, 100);
+  fsClose(b);
+
+  bad += checkFile("f", CHECKFDFILE);       // descriptors free once more
+  fsUnmount();
+  return bad;
+}
+
+
+
+// ============================================================================
+// See the top of this file.  Return the # of faults found
+// ============================================================================
+static i32 checkPread() {
+  fsFormat(CHECKBLOCKS, CHECKINODES, CHECKBSIZE);
+  fsMount();
+  i64 numb = CHECKPREADFILE;
+  i64 at   = CHECKPWRITEAT;
+  i64 size = at + CHECKPWRITEN;
+  checkWriteFile("p", (i32)numb);
+  i32 fd = fsOpen("p");
+  fsSeek(fd, 123, SEEK_SET);
+
+  i32 bad = 0;
+  if (fsPread(fd, 1000, 200, g_data) != 200) ++bad;
+  for (i32 i = 0; i < 200; ++i) {
+    if (g_data[i] != checkByte("p", 1000 + i)) ++bad;
+  }
+  if (fsTell(fd) != 123) ++bad;
+  if (fsPread(fd, numb - 100, 200, g_data) != 100) ++bad; // clipped at EOF
+  if (fsPread(fd, numb, 200, g_data) != 0) ++bad;
+  if (fsTell(fd) != 123) ++bad;
+
+  for (i32 i = 0; i < CHECKPWRITEN; ++i) g_data[i] = checkByte("p", i);
+  if (fsPwrite(fd, at, CHECKPWRITEN, g_data) != 0) ++bad;
+  if (fsTell(fd) != 123) ++bad;
+  bad += checkCursor(fd, "p", 123, 100);
+  for (i32 pass = 0; pass < 2; ++pass) {    // before and after a remount
+    if (fsSize(fd) != size) ++bad;
+    bad += checkZeroes(fd, numb, (i32)(size - numb), "p", at);
+    fsClose(fd);
+    fsUnmount();
+    fsMount();
+    fd = fsOpen("p");
+  }
+  fsClose(fd);
+  fsUnmount();
+  return bad;
+}
+
+
+
+// ============================================================================
+// See the top of this file.  Return the # of faults found
+// ============================================================================
+static i32 checkBigFormat() {
+  struct timespec t0, t1;
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  fsFormat(CHECKBIGBLOCKS, CHECKINODES, CHECKBIGBSIZE);
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  i64 ms = (t1.tv_sec - t0.tv_sec) * 1000 +
+           (t1.tv_nsec - t0.tv_nsec) / 1000000;
+  i32 bad = (ms < CHECKBIGMS) ? 0 : 1;
+  struct stat st;
+  if (stat(CHECKDISK, &st) != 0) ++bad;
+  else if ((i64)st.st_blocks * 512 >= CHECKBIGBYTES) ++bad;
+
+  fsMount();
+  i32 numFree = g_super.numFree;
+  if (numFree != CHECKBIGBLOCKS - g_super.dbnData) ++bad;
+
+  checkWriteFile("b", 10);                  // the first block written
+  fsSync();
+  i32 fd = fsOpen("b");
+  if (bfsFbnToDbn(bfsFdToInum(fd), 0) != g_super.dbnData) ++bad;
+  fsClose(fd);
+  if (g_super.numFree != numFree - 1) ++bad;
+
+  i32 mid = CHECKBIGBLOCKS / 2;             // in a bitmap hole
+  i32 got = 0;
+  jrnBegin();
+  if (bfsFindFreeRun(mid, CHECKBIGRUN, &got) != mid) ++bad;
+  jrnEnd();
+  if (got != CHECKBIGRUN) ++bad;
+  fsUnmount();
+  fsMount();
+  if (g_super.numFree != numFree - 1 - CHECKBIGRUN) ++bad;
+  bad += checkFile("b", 10);
+  fsUnmount();
+  return bad;
+}
+
+
+
+// ============================================================================
+// Add 'delta' to the i32 at byte offset 'pos' of CHECKDISK.  Return 0 on
+// success
+// ============================================================================
+static i32 checkPoke(i64 pos, i32 delta) {
+  FILE* fp = fopen(CHECKDISK, "r+b");
+  if (fp == NULL) return 1;
+  i32 v = 0;
+  fseek(fp, (long)pos, SEEK_SET);
+  i32 bad = (fread(&v, sizeof(i32), 1, fp) == 1) ? 0 : 1;
+  v += delta;
+  fseek(fp, (long)pos, SEEK_SET);
+  if (fwrite(&v, sizeof(i32), 1, fp) != 1) ++bad;
+  fclose(fp);
+  return bad;
+}
+
+
+
+// ============================================================================
+// Return the byte offset in CHECKDISK of the Dir entry of file 'fname' - a
+// name short enough to be held in the entry itself - or -1 if none
+// ============================================================================
+static i64 checkDirEntry(str fname) {
+  FILE* fp = fopen(CHECKDISK, "rb");
+  if (fp == NULL) return -1;
+  i64 pos = (i64)g_super.dbnDir * g_super.blockSize;
+  i64 end = pos + (i64)g_super.numDirBlocks * g_super.blockSize;
+  DirEntry e;
+  fseek(fp, (long)pos, SEEK_SET);
+  while (pos < end && fread(&e, sizeof(DirEntry), 1, fp) == 1) {
+    if (strcmp(e.fname, fname) == 0) break;
+    pos += sizeof(DirEntry);
+  }
+  fclose(fp);
+  return (pos < end) ? pos : -1;
+}
+
+
+
+// ============================================================================
+// Mount CHECKDISK: for checkFatal
+// ============================================================================
+static void checkMount(i32 unused) {
+  fsMount();
+}
+
+
+
+// ============================================================================
+// See the top of this file.  Return the # of faults found
+// ============================================================================
+static i32 checkCorrupt() {
+  static const i32 geoms[][3] = {           // blocks, Inodes, block size
+    { CHECKBLOCKS, CHECKINODES, CHECKBSIZE },
+    { 3000, 300, 1024 }, { 1200, 40, 2048 }, { 20000, 16, 4096 } };
+  static const i32 fields[] = { offsetof(Super, numInodes),
+                                offsetof(Super, dbnDir),
+                                offsetof(Super, numFree) };
+  i32 bad = 0;
+  for (i32 g = 0; g < (i32)(sizeof(geoms) / sizeof(geoms[0])); ++g) {
+    fsFormat(geoms[g][0], geoms[g][1], geoms[g][2]);
+    fsMount();
+    checkWriteFile("c", CHECKFILE);
+    fsUnmount();
+    fsMount();
+    if (g_super.numBlocks != geoms[g][0]) ++bad;
+    if (g_super.blockSize != geoms[g][2]) ++bad;
+    bad += checkFile("c", CHECKFILE);
+    fsUnmount();
+  }
+
+  fsFormat(CHECKBLOCKS, CHECKINODES, CHECKBSIZE);
+  fsMount();
+  checkWriteFile("c", CHECKFILE);
+  fsUnmount();
+  for (i32 f = 0; f < (i32)(sizeof(fields) / sizeof(fields[0])); ++f) {
+    bad += checkPoke(fields[f], CHECKBLOCKS);
+    bad += checkFatal(checkMount, 0, EBADGEOM);
+    bad += checkPoke(fields[f], -CHECKBLOCKS);
+  }
+  i64 pos = checkDirEntry("c");
+  if (pos < 0) return bad + 1;
+  pos += offsetof(DirEntry, inum);
+  bad += checkPoke(pos, CHECKINODES);
+  bad += checkFatal(checkMount, 0, EBADINUM);
+  bad += checkPoke(pos, -CHECKINODES);
+
+  fsMount();                                // all undone
+  bad += checkFile("c", CHECKFILE);
+  fsUnmount();
+  return bad;
+}
+
+
+
+static Check g_checks[] = {
+  { "replay", checkReplay },
+  { "refill", checkRefill },
+  { "names",  checkNames  },
+  { "many",   checkMany   },
+  { "namecache", checkNameCache },
+  { "sparse", checkSparse },
+  { "delay",  checkDelay  },
+  { "fds",    checkFds    },
+  { "pread",  checkPread  },
+  { "bigformat", checkBigFormat },
+  { "corrupt", checkCorrupt },
+};
+
+
+
+// ============================================================================
+// Run the check called 'name', or every check if 'name' is NULL.  Return 0 if
+// all pass, else 1
+// ============================================================================
+i32 checkRun(str name) {
+  i32 failed = 0;
+  i32 ran    = 0;
+  fsSetDisk(CHECKDISK);
+  for (i32 i = 0; i < (i32)(sizeof(g_checks) / sizeof(Check)); ++i) {
+    if (name && strcmp(name, g_checks[i].name) != 0) continue;
+    i32 bad = g_checks[i].fn();
+    printf("%s: %s \n", g_checks[i].name, (bad == 0) ? "OK" : "FAILED");
+    if (bad) ++failed;
+    ++ran;
+  }
+  remove(CHECKDISK);
+  fsSetDisk(NULL);
+  if (ran == 0) printf("check: no check called %s \n", name);
+  return (failed == 0 && ran > 0) ? 0 : 1;
+}
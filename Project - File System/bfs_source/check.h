@@ -0,0 +1,52 @@
+#ifndef CHECK_H
+#define CHECK_H
+
+// ============================================================================
+// check.h - correctness checks of BFS, run as "main check"
+// ============================================================================
+
+#include "alias.h"
+
+#define CHECKDISK    "BFSDISK.check"    // scratch image each check formats
+#define CHECKBLOCKS  4000               // ... # blocks
+#define CHECKBSIZE   512                // ... bytes per block
+#define CHECKINODES  64                 // ... and # of Inodes
+#define CHECKBYTES   (64 * 1024)        // largest file a check reads back
+
+#define CHECKFILE    20000              // checkReplay: bytes in file "a"
+#define CHECKWRAPPED 4                  // ... commits after a checkpoint
+#define CHECKNOFLUSH 3600000            // ... flusher age: never, in effect
+#define CHECKCRASH   "BFSDISK.crash"    // ... image after one commit
+#define CHECKTORN    "BFSDISK.torn"     // ... after two, the last torn
+#define CHECKWRAP    "BFSDISK.wrap"     // ... after a checkpoint
+
+#define CHECKREFILL  1500               // checkRefill: blocks in its file
+
+#define CHECKNAMES   14                 // checkNames: # of files
+
+#define CHECKMANY       300000          // checkMany: # of files
+#define CHECKMANYBLOCKS 131072          // ... blocks in its disk
+#define CHECKLONGEVERY  10              // ... 1 in this many: long names
+
+#define CHECKSPARSEAT ((1LL << 30) + 100) // checkSparse: offset written
+#define CHECKSPARSEN  100                 // ... # of bytes written there
+
+#define CHECKDELAYFILES 6               // checkDelay: # of files
+#define CHECKDELAYN     2500            // ... bytes in each
+
+#define CHECKFDFILE  3000               // checkFds: bytes in its file
+#define CHECKOUTPUT  1024               // checkFatal: chars of output kept
+
+#define CHECKPREADFILE 3000             // checkPread: bytes in its file
+#define CHECKPWRITEAT  5000             // ... offset fsPwrite writes at
+#define CHECKPWRITEN   100              // ... # of bytes it writes
+
+#define CHECKBIGBLOCKS (1 << 20)        // checkBigFormat: blocks in its disk
+#define CHECKBIGBSIZE  4096             // ... bytes per block: 4 GB in all
+#define CHECKBIGMS     1000             // ... most ms fsFormat may take
+#define CHECKBIGBYTES  (16 << 20)       // ... most bytes the image may use
+#define CHECKBIGRUN    100              // ... blocks sought mid-disk
+
+i32 checkRun(str name);
+
+#endif
\ No newline at end of file
@@ -4,22 +4,50 @@
 
 #include "bfs.h"
 #include "deb.h"
+#include "jrn.h"
+
+// ============================================================================
+// Dump the block cache statistics
+// ============================================================================
+i32 debDumpCache() {
+  CacheStats stats;
+  cacheStats(&stats);
+
+  u64 lookups = stats.hits + stats.misses;
+  printf("\n");
+  printf("Cache.blocks     = %d \n",   NUMCACHEBLOCKS);
+  printf("Cache.hits       = %llu \n", (unsigned long long)stats.hits);
+  printf("Cache.misses     = %llu \n", (unsigned long long)stats.misses);
+  printf("Cache.evictions  = %llu \n", (unsigned long long)stats.evictions);
+  printf("Cache.writebacks = %llu \n", (unsigned long long)stats.writebacks);
+  printf("Cache.prefetches = %llu \n", (unsigned long long)stats.prefetches);
+  printf("Cache.flushes    = %llu \n", (unsigned long long)stats.flushes);
+  if (lookups > 0) {
+    printf("Cache.hitrate    = %.1f%% \n", 100.0 * stats.hits / lookups);
+  }
+  printf("\n"); fflush(stdout);
+
+  return 0;
+}
+
+
 
 // ============================================================================
 // Dump block DBN
 // ============================================================================
 i32 debDumpDbn(i32 dbn, i32 size) {
-  i8 buf[BYTESPERBLOCK] = {0};
+  i8 buf[MAXBLOCKSIZE] = {0};
+  i32 bsize = g_super.blockSize;
 
   i8*  buf8  = (i8*) buf;
   i16* buf16 = (i16*)buf;
   i32* buf32 = (i32*)buf;
 
-  bioRead(dbn, buf);
+  cacheRead(dbn, buf);
 
   printf("\n");
   if (size == 1) {
-    for (int i = 0; i < BYTESPERBLOCK; ++i) {
+    for (int i = 0; i < bsize; ++i) {
       printf("%02x ", buf8[i]);
       if ((i + 1) % 16 == 0) {
         for (int i = 0; i < 16; ++i) {
@@ -31,12 +59,12 @@ i32 debDumpDbn(i32 dbn, i32 size) {
       }
     }
   } else if (size == 2) {
-    for (int i = 0; i < BYTESPERBLOCK / sizeof(i16); ++i) {
+    for (int i = 0; i < bsize / sizeof(i16); ++i) {
       printf("%04x ", buf16[i]);
       if ((i + 1) % 8 == 0) printf("\n");
     }
   } else if (size == 4) {
-    for (int i = 0; i < BYTESPERBLOCK / sizeof(i32); ++i) {
+    for (int i = 0; i < bsize / sizeof(i32); ++i) {
       printf("%08x ", buf32[i]);
       if ((i + 1) % 4 == 0) printf("\n");
     }
@@ -50,16 +78,22 @@ i32 debDumpDbn(i32 dbn, i32 size) {
 
 
 // ============================================================================
-// Dump the Dir
+// Dump the Dir: each slot in use, and the inum it names
 // ============================================================================
 i32 debDumpDir() {
-  i8 buf[BYTESPERBLOCK] = {0};
-  bioRead(DBNDIR, buf);
-  Dir* dir = (Dir*)buf;
+  i8 buf[MAXBLOCKSIZE] = {0};
+  DirEntry* dir = (DirEntry*)buf;
+  i32 perBlock  = g_super.blockSize / sizeof(DirEntry);
+
+  i32 numSlots  = g_super.numDirBlocks * perBlock;
 
   printf("\n");
-  for (int inum = 0; inum < NUMINODES; ++inum) {
-    printf("[%02d]  %s \n", inum, dir->fname[inum]);
+  for (int s = 0; s < numSlots; ++s) {
+    if (s % perBlock == 0) cacheRead(g_super.dbnDir + s / perBlock, buf);
+    DirEntry* e = &dir[s % perBlock];
+    if (e->fname[0] == 0) continue;
+    printf("[%02d]  %s%s => inum %d \n", s, e->fname,
+           (e->nameDbn != 0) ? "..." : "", e->inum);
   }
   printf("\n"); fflush(stdout);
 
@@ -72,19 +106,23 @@ i32 debDumpDir() {
 // Dump the Inodes
 // ============================================================================
 i32 debDumpInodes() {
-  i8 buf[BYTESPERBLOCK] = {0};
-  bioRead(DBNINODES, buf);
-
+  i8 buf[MAXBLOCKSIZE] = {0};
   Inode* inodes = (Inode*) buf;
+  i32 perBlock  = g_super.blockSize / INODESIZE;
 
   printf("\n");
-  for (int inum = 0; inum < NUMINODES; ++inum) {
-    Inode inode = inodes[inum];
-    printf("[%d] size = %d \n", inum, inode.size);
-    for (i32 d = 0; d < NUMDIRECT; ++d) {
-      printf("    [%d] direct[%d] = %d \n", inum, d, inode.direct[d]);
+  for (int inum = 0; inum < g_super.numInodes; ++inum) {
+    if (inum % perBlock == 0) {
+      cacheRead(g_super.dbnInodes + inum / perBlock, buf);
+    }
+    Inode inode = inodes[inum % perBlock];
+    printf("[%d] size = %lld \n", inum, (long long)inode.size);
+    printf("        depth = %d \n", inode.depth);
+    for (i32 e = 0; e < inode.numExt && e < NUMEXTENTS; ++e) {
+      Extent* ext = &inode.ext[e];
+      printf("    [%d] ext[%d] = fbn %d, dbn %d, len %d \n",
+             inum, e, ext->fbn, ext->dbn, ext->len);
     }
-    printf("        indirect  = %d \n", inode.indirect);
   }
   printf("\n"); fflush(stdout);
 
@@ -92,25 +130,63 @@ i32 debDumpInodes() {
 }
 
 
+// ============================================================================
+// Dump the journal header, and the journal statistics since mount
+// ============================================================================
+i32 debDumpJournal() {
+  i8 buf[MAXBLOCKSIZE] = {0};
+  bioRead(g_super.dbnJournal, buf);         // journal bypasses the cache
+  JrnSuper* js = (JrnSuper*)buf;
+
+  JrnStats stats;
+  jrnStats(&stats);
+
+  printf("\n");
+  printf("Jrn.magic       = %08x \n", js->magic);
+  printf("Jrn.seq         = %u \n",   js->seq);
+  printf("Jrn.commits     = %llu \n", (unsigned long long)stats.commits);
+  printf("Jrn.blocks      = %llu \n", (unsigned long long)stats.blocks);
+  printf("Jrn.checkpoints = %llu \n", (unsigned long long)stats.checkpoints);
+  printf("Jrn.replayed    = %llu \n", (unsigned long long)stats.replayed);
+  printf("\n"); fflush(stdout);
+
+  return 0;
+}
+
+
+
 // ============================================================================
 // Dump the Superblock
 // ============================================================================
 i32 debDumpSuper() {
-  i8 buf[BYTESPERBLOCK] = {0};
+  i8 buf[MAXBLOCKSIZE] = {0};
 
-  bioRead(DBNSUPER, buf);
+  cacheRead(DBNSUPER, buf);
 
   Super* super = (Super*)buf;
 
   printf("\n");
-  printf("Super.numBlocks = %d \n", super->numBlocks);
-  printf("Super.numInodes = %d \n", super->numInodes);
-  printf("Super.firstFree = %d \n", super->firstFree);
+  printf("Super.magic           = %08x \n", super->magic);
+  printf("Super.blockSize       = %d \n", super->blockSize);
+  printf("Super.numBlocks       = %d \n", super->numBlocks);
+  printf("Super.numInodes       = %d \n", super->numInodes);
+  printf("Super.numFree         = %d \n", super->numFree);
+  printf("Super.dbnInodes       = %d \n", super->dbnInodes);
+  printf("Super.numInodeBlocks  = %d \n", super->numInodeBlocks);
+  printf("Super.dbnDir          = %d \n", super->dbnDir);
+  printf("Super.numDirBlocks    = %d \n", super->numDirBlocks);
+  printf("Super.dbnBitmap       = %d \n", super->dbnBitmap);
+  printf("Super.numBitmapBlocks = %d \n", super->numBitmapBlocks);
+  printf("Super.dbnInodeMap     = %d \n", super->dbnInodeMap);
+  printf("Super.numInodeMapBlks = %d \n", super->numInodeMapBlocks);
+  printf("Super.dbnJournal      = %d \n", super->dbnJournal);
+  printf("Super.numJournal      = %d \n", super->numJournal);
+  printf("Super.dbnData         = %d \n", super->dbnData);
   printf("\n"); fflush(stdout);
 
   // Check that remainder of Superblock is all zeroes
 
-  for (i32 b = sizeof(Super); b < BYTESPERBLOCK; ++b) {
+  for (i32 b = sizeof(Super); b < super->blockSize; ++b) {
     if (buf[b] != 0) {
       printf("Super[%d] == %02x, should be 0x00 \n", b, buf[b]);
     }
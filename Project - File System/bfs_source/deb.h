@@ -9,9 +9,11 @@
 #include <stdio.h>
 #include "alias.h"
 
+i32 debDumpCache ();
 i32 debDumpDbn   (i32 dbn, i32 size);
 i32 debDumpDir   ();
 i32 debDumpInodes();
+i32 debDumpJournal();
 i32 debDumpSuper ();
 
 #endif
\ No newline at end of file
@@ -6,7 +6,7 @@
 #include <stdlib.h>
 #include "errors.h"
 
-void pause() {
+void RepPause() {
   printf("\nHit any key to finish ");
   getchar();
   exit(0);
@@ -17,56 +17,71 @@ void pause() {
 void RepTest(int err, str file, int line) {
   RepError(err);
   printf(" in file %s at line %d \n", file, line);
-  pause();
+  RepPause();
 }
 
 
 void RepError(i32 e) {
   switch(e) {
     case EBADDBN:
-      printf("\nERROR: Bad DBN: negative or too large \n");    pause(); break;
+      printf("\nERROR: Bad DBN: negative or too large \n");    RepPause(); break;
     case EBADFBN:
-      printf("\nERROR: Bad FBN: negative or too large \n");    pause(); break;
+      printf("\nERROR: Bad FBN: negative or too large \n");    RepPause(); break;
     case EBADINUM:
-      printf("\nERROR: Bad Inum: negative or too large \n");   pause(); break;
+      printf("\nERROR: Bad Inum: negative or too large \n");   RepPause(); break;
     case EBADCURS:
-      printf("\nERROR: Bad cursor within file \n");           pause(); break;
+      printf("\nERROR: Bad cursor within file \n");           RepPause(); break;
     case EBADREAD:
-      printf("\nERROR: Error writing to BFS disk \n");         pause(); break;
+      printf("\nERROR: Error reading from BFS disk \n");       RepPause(); break;
     case EBADWRITE:
-      printf("\nERROR: Error writing to BFS disk \n");         pause(); break;
+      printf("\nERROR: Error writing to BFS disk \n");         RepPause(); break;
     case EBIGFNAME:
-      printf("\nERROR: Filename too big \n");                  pause(); break;
+      printf("\nERROR: Filename too big \n");                  RepPause(); break;
     case EBIGNUMB:
-      printf("\nERROR: Read or write is too big \n");          pause(); break;
+      printf("\nERROR: Read or write is too big \n");          RepPause(); break;
     case EDIRFULL:
-      printf("\nERROR: Directory is already full \n");         pause(); break;
+      printf("\nERROR: Directory is already full \n");         RepPause(); break;
     case EDISKCREATE:
-      printf("\nERROR: Failure creating BFS disk \n");         pause(); break;
+      printf("\nERROR: Failure creating BFS disk \n");         RepPause(); break;
     case EDISKFULL:
-      printf("\nERROR: Disk is full \n");                      pause(); break;
+      printf("\nERROR: Disk is full \n");                      RepPause(); break;
     case EEXISTS:
-      printf("\nERROR: Format would destroy current disk \n"); pause(); break;
+      printf("\nERROR: Format would destroy current disk \n"); RepPause(); break;
     case EFNF:
-      printf("\nERROR: File Not Found \n");                    pause(); break;
+      printf("\nERROR: File Not Found \n");                    RepPause(); break;
     case ENEGNUMB:
-      printf("\nERROR: Negative # bytes in read or write \n"); pause(); break;
+      printf("\nERROR: Negative # bytes in read or write \n"); RepPause(); break;
     case ENODBN:
-      printf("\nERROR: No DBN yet allocated - non-fatal \n");  pause(); break;
+      printf("\nERROR: No DBN yet allocated - non-fatal \n");  RepPause(); break;
     case ENODISK:
-      printf("\nERROR: Cannot open the BFS disk \n");          pause(); break;
+      printf("\nERROR: Cannot open the BFS disk \n");          RepPause(); break;
     case ENOMEM:
-      printf("\nERROR: Failure to malloc memory \n");          pause(); break;
+      printf("\nERROR: Failure to malloc memory \n");          RepPause(); break;
     case ENULLPTR:
-      printf("\nERROR: About to deref a null pointer \n");     pause(); break;
+      printf("\nERROR: About to deref a null pointer \n");     RepPause(); break;
     case ENYI:
-      printf("\nERROR: Function Note Yet Implemented \n");     pause(); break;
+      printf("\nERROR: Function Note Yet Implemented \n");     RepPause(); break;
     case EOFTFULL:
-      printf("\nERROR: OpenFileTable is full \n");             pause(); break;
+      printf("\nERROR: OpenFileTable is full \n");             RepPause(); break;
+    case EBADMAGIC:
+      printf("\nERROR: BFS disk has a bad magic number \n");  RepPause(); break;
+    case EBADMODE:
+      printf("\nERROR: Invalid mode in fsMountMode \n");     RepPause(); break;
+    case EQFULL:
+      printf("\nERROR: Too many block IO requests in flight \n"); RepPause(); break;
+    case EJRNFULL:
+      printf("\nERROR: Journal transaction too big \n");    RepPause(); break;
+    case EBADGEOM:
+      printf("\nERROR: Invalid BFS disk geometry \n");      RepPause(); break;
+    case EFILEOPEN:
+      printf("\nERROR: File is open \n");                   RepPause(); break;
+    case ENOTOPEN:
+      printf("\nERROR: File descriptor is not open \n");    RepPause(); break;
+    case EFDFULL:
+      printf("\nERROR: Every file descriptor is in use \n"); RepPause(); break;
     case EBADWHENCE:
-      printf("\nERROR: Invalid 'whence' in fsSeek \n");        pause(); break;
+      printf("\nERROR: Invalid 'whence' in fsSeek \n");        RepPause(); break;
     default:
-      printf("\nERROR: Miscellaneous error \n");               pause(); break;
+      printf("\nERROR: Miscellaneous error \n");               RepPause(); break;
   }
 }
-
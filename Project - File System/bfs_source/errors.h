@@ -29,8 +29,16 @@ void RepTest(int err, str file, int line);
 #define ENULLPTR    -19   // about to deref a NULL pointer
 #define ENYI        -20   // not yet implemented
 #define EOFTFULL    -21   // OpenFileTable is full
+#define EBADMODE    -22   // invalid mode in fsMountMode
+#define EBADMAGIC   -23   // BFSDISK is not a BFS disk of this format
+#define EQFULL      -24   // too many block IO requests in flight
+#define EJRNFULL    -25   // journal transaction has too many blocks
+#define EBADGEOM    -26   // invalid disk geometry
+#define EFILEOPEN   -27   // file is open, so cannot be deleted
+#define ENOTOPEN    -28   // file descriptor is not open
+#define EFDFULL     -29   // every file descriptor is in use
 
-void pause();
+void RepPause();
 void RepError(i32 ret);
 
 #endif
\ No newline at end of file
@@ -9,15 +9,262 @@
 // clear the BFSDISK and start from the beginning.
 // ============================================================================
 
+#include <unistd.h>
+
 #include "bfs.h"
 #include "fs.h"
+#include "jrn.h"
+
+static str g_disk = BFSDISK;                // image fsFormat and fsMount use
+
+// ============================================================================
+// Copy the 'numb' bytes at offset 'pos' of file 'inum' into 'buf'.  They must
+// lie within the file.  Delayed blocks are copied from memory; holes - blocks
+// never written - read as zeroes.  The caller holds the file's Inode lock,
+// shared or exclusive.  On success, return 0
+// ============================================================================
+static i32 fsReadAt(i32 inum, i64 pos, i32 numb, void* buf) {
+  // block size, and number of blocks a file can have, on this disk
+  i32 bsize = g_super.blockSize;
+  i32 max_fbn = bfsMaxFbn();
+  // to obtain starting block number 
+  i32 fnb = (i32)(pos / bsize); 
+  // to obtain the starting byte number for reading
+  i32 start_byte = (i32)(pos % bsize); 
+  // this is a pointer to the buf array to help copy the data
+  i8 * buf_prt = (i8*)buf;
+  while(fnb < max_fbn && numb > 0){
+    // the block's DBN, and the number of blocks of its extent from there on
+    i32 run = 0;
+    i32 dbn = bfsMapRun(inum, fnb, &run);
+    // not mapped: a block written, but not yet given a DBN, is held in
+    // memory - see bfsDelayBlock
+    i32 gap = 0;
+    i8 * delayed = NULL;
+    if (dbn == ENODBN) delayed = (i8*)bfsGetDelayed(inum, fnb, &gap);
+    if (delayed != NULL){
+      i32 count = bsize - start_byte;
+      if (count > numb) count = numb;
+      memcpy(buf_prt, delayed + start_byte, count);
+      buf_prt += count;
+      numb -= count;
+      start_byte = 0;
+      fnb ++;
+      continue;
+    }
+    // a hole, up to the next delayed block: never written, so reads as
+    // zeroes, with no IO
+    if (dbn == ENODBN){
+      if (run > gap) run = gap;
+      i64 count = (i64)run * bsize - start_byte;
+      if (count > numb) count = numb;
+      memset(buf_prt, 0, count);
+      buf_prt += count;
+      numb -= (i32)count;
+      start_byte = 0;
+      fnb += run;
+      continue;
+    }
+    // whole blocks in the middle of the read: take as many as the rest of
+    // the extent holds, and read the lot straight into buf with a single IO
+    if (start_byte == 0 && numb >= bsize){
+      if (run > numb / bsize) run = numb / bsize;
+      bfsReadRun(dbn, run, buf_prt);
+      buf_prt += run * bsize;
+      numb -= run * bsize;
+      fnb += run;
+      continue;
+    }
+    // a partial block at the head or tail of the read: copy just the bytes
+    // needed - up to the block's end, or fewer if the read stops inside it
+    i32 count = bsize - start_byte;
+    if (count > numb) count = numb;
+    // copy straight out of the block (cache or mapped disk) into buf
+    i8 * blk = (i8*)bfsGetData(dbn);
+    memcpy(buf_prt, blk + start_byte, count);
+    bfsPutData(dbn, 0);
+    buf_prt += count;
+    numb -= count;
+    // every block after the first is read from its beginning
+    start_byte = 0;
+    fnb ++;
+  }
+  return 0;
+}
+
+
+
+// ============================================================================
+// First half of copying the 'numb' bytes in 'buf' to offset 'pos' of file
+// 'inum': the metadata.  Grow the file if they reach past its end, and give
+// DBNs to the blocks written that have none - but not to those kept in
+// memory, as delayed blocks, into which their bytes are copied here, and
+// that are written no further.  Any gap left before them stays a hole.  Set
+// fresh[0], and fresh[1], to 1 if the first, and last, block written got its
+// DBN here - so holds nothing of the file's.  The caller has begun a journal
+// operation, and holds the file's Inode lock exclusive.  On success, return 0
+// ============================================================================
+static i32 fsWriteMeta(i32 inum, i64 pos, i32 numb, void* buf, i32* fresh) {
+  // block size on this disk
+  i32 bsize = g_super.blockSize;
+  // offset just past the last byte written
+  i64 offset = pos + numb;
+  // the first and last block written
+  i32 fnb_first = (i32)(pos/bsize);
+  i32 fnb_last = (i32)((offset - 1)/bsize);
+  fresh[0] = 0;
+  fresh[1] = 0;
+  // to extend the file if needed
+  if (offset > bfsGetSize(inum)){
+    bfsSetSize(inum, offset);
+  }
+  i32 fnb_cur = fnb_first;
+  while(fnb_cur <= fnb_last){
+    // the block's DBN, and the number of blocks of its extent from there on
+    i32 run = 0;
+    i32 dbn = bfsMapRun(inum, fnb_cur, &run);
+    // mapped already: written by fsWriteData
+    if (dbn != ENODBN){
+      fnb_cur += run;
+      continue;
+    }
+    // the bytes of the write in this block, and the number from there on
+    i32 start_byte = (fnb_cur == fnb_first) ? (i32)(pos % bsize) : 0;
+    i64 left = offset - ((i64)fnb_cur * bsize + start_byte);
+    i32 n = (left < bsize - start_byte) ? (i32)left : bsize - start_byte;
+    i8 * src = (i8*)buf + ((i64)fnb_cur * bsize + start_byte - pos);
+    // a hole: unless the write is big enough to know how to lay it out
+    // already, keep the block in memory, and give it a DBN only when
+    // flushed - see bfsDelayBlock.  It may already be there
+    i32 gap = 0;
+    i8 * delayed = (i8*)bfsGetDelayed(inum, fnb_cur, &gap);
+    if (delayed == NULL && (start_byte != 0 || left < DELAYWRITE * bsize)){
+      delayed = (i8*)bfsDelayBlock(inum, fnb_cur);
+    }
+    if (delayed != NULL){
+      memcpy(delayed + start_byte, src, n);
+      fnb_cur ++;
+      continue;
+    }
+    // a big write, or no room to delay it: allocate blocks now, for the
+    // part of the hole this write covers, as few contiguous runs as the disk
+    // allows
+    if (run > gap) run = gap;
+    i32 last = (run - 1 < fnb_last - fnb_cur) ? fnb_cur + run - 1 : fnb_last;
+    run = bfsAllocRun(inum, fnb_cur, last, &dbn);
+    if (fnb_cur == fnb_first) fresh[0] = 1;
+    if (fnb_cur + run > fnb_last) fresh[1] = 1;
+    fnb_cur += run;
+  }
+  return 0;
+}
+
+
 
 // ============================================================================
-// Close the file currently open on file descriptor 'fd'.
+// Second half of copying the 'numb' bytes in 'buf' to offset 'pos' of file
+// 'inum': the data, into the blocks fsWriteMeta mapped.  'fresh' is as it set
+// it.  The caller holds the file's Inode lock exclusive - but, unless a
+// commit is due, is not within a journal operation: see jrnEndData.  On
+// success, return 0
+// ============================================================================
+static i32 fsWriteData(i32 inum, i64 pos, i32 numb, void* buf, i32* fresh) {
+  // block size on this disk
+  i32 bsize = g_super.blockSize;
+  // to obtain the current block number, and the last one written
+  i32 fnb_cur = (i32)(pos/bsize);
+  i32 fnb_first = fnb_cur;
+  i32 fnb_last = (i32)((pos + numb - 1)/bsize);
+  // to obtain the starting byte number for writing
+  i32 start_byte = (i32)(pos % bsize);
+  // to obtain the number of bytes left in the block
+  i32 count = numb;
+  // this is a pointer to the buf array to help copy the data
+  i8 * buf_start = (i8*)buf;
+  while(count > 0){
+    // the block's DBN, and the number of blocks of its extent from there on
+    i32 run = 0;
+    i32 dbn = bfsMapRun(inum, fnb_cur, &run);
+    i32 n = bsize - start_byte;
+    if (n > count) n = count;
+    // not mapped: a delayed block, which fsWriteMeta has written already
+    if (dbn == ENODBN){
+      buf_start += n;
+      count -= n;
+      start_byte = 0;
+      fnb_cur ++;
+      continue;
+    }
+    // whole blocks: nothing of their old contents survives, so they are not
+    // read first.  Take as many as the rest of the extent holds, and write
+    // the lot from buf with one IO
+    if (start_byte == 0 && count >= bsize){
+      if (run > count / bsize) run = count / bsize;
+      bfsWriteRun(dbn, run, buf_start);
+      buf_start += run * bsize;
+      count -= run * bsize;
+      fnb_cur += run;
+      continue;
+    }
+    // a partial block at the head or tail of the write: read-modify-write
+    // just the bytes covered - up to the block's end, or fewer if the write
+    // stops inside it
+    if ((fnb_cur == fnb_first && fresh[0]) ||
+        (fnb_cur == fnb_last && fresh[1])){
+      // a new block: its old contents are not the file's, so are not read.
+      // The bytes not written are zeroes
+      i8 blk[MAXBLOCKSIZE] = {0};
+      memcpy(blk + start_byte, buf_start, n);
+      bfsWriteRun(dbn, 1, blk);
+    } else {
+      // copy straight from buf into the block (cache or mapped disk)
+      i8 * blk = (i8*)bfsGetData(dbn);
+      memcpy(blk + start_byte, buf_start, n);
+      bfsPutData(dbn, 1);
+    }
+    buf_start += n;
+    count -= n;
+    // every block after the first is written from its beginning
+    start_byte = 0;
+    // update the file block number
+    fnb_cur ++;
+  } 
+  return 0;
+}
+
+
+
+// ============================================================================
+// Copy the 'numb' bytes in 'buf' to offset 'pos' of file 'inum', growing the
+// file if they reach past its end.  Only the blocks written are allocated:
+// any gap left before them stays a hole.  The caller has begun a journal
+// operation, and holds the file's Inode lock exclusive.  The operation is
+// ended here, once the metadata is done - see jrnEndData - so that other
+// operations need not wait for the data IO; and then the Inode lock is
+// dropped.  On success, return 0
+// ============================================================================
+static i32 fsWriteAt(i32 inum, i64 pos, i32 numb, void* buf) {
+  i32 fresh[2] = {0, 0};
+  if (numb > 0) fsWriteMeta(inum, pos, numb, buf, fresh);
+  jrnEndData();
+  if (numb > 0) fsWriteData(inum, pos, numb, buf, fresh);
+  bfsUnlockInode(inum);
+  jrnDataDone();
+  return 0;
+}
+
+
+
+// ============================================================================
+// Close the file currently open on file descriptor 'fd'.  The file stays
+// open on any other descriptors
 // ============================================================================
 i32 fsClose(i32 fd) { 
   i32 inum = bfsFdToInum(fd);
+  bfsCloseFd(fd);
+  jrnBegin();
   bfsDerefOFT(inum);
+  jrnEnd();
   return 0; 
 }
 
@@ -25,64 +272,208 @@ i32 fsClose(i32 fd) {
 
 // ============================================================================
 // Create the file called 'fname'.  Overwrite, if it already exsists.
-// On success, return its file descriptor.  On failure, EFNF
+// On success, return a new file descriptor for it.  On failure, EFNF
 // ============================================================================
 i32 fsCreate(str fname) {
+  jrnBegin();
   i32 inum = bfsCreateFile(fname);
+  jrnEnd();
   if (inum == EFNF) return EFNF;
-  return bfsInumToFd(inum);
+  return bfsOpenFd(inum);
 }
 
 
 
 // ============================================================================
-// Format the BFS disk by initializing the SuperBlock, Inodes, Directory and 
-// Freelist.  On succes, return 0.  On failure, abort
+// Delete the file called 'fname', and free its blocks.  It must not be open.
+// On success, return 0.  If not found, EFNF; if still open, EFILEOPEN
 // ============================================================================
-i32 fsFormat() {
-  FILE* fp = fopen(BFSDISK, "w+b");
+i32 fsDelete(str fname) {
+  jrnBegin();
+  i32 ret = bfsDeleteFile(fname);
+  jrnEnd();
+  return ret;
+}
+
+
+
+// ============================================================================
+// Format the BFS disk by initializing the SuperBlock, Inodes, Directory,
+// allocation bitmap, Inode map and journal.  The disk has 'numBlocks' blocks of
+// 'blockSize' bytes - a power of 2, from BYTESPERBLOCK to MAXBLOCKSIZE - and
+// room for 'numInodes' files.  A value < 1 picks the default: BLOCKSPERDISK,
+// NUMINODES or BYTESPERBLOCK.  The geometry is recorded in the SuperBlock.
+// The image is created sparse, at its full size, so blocks never written -
+// the data blocks, and allocation bitmap blocks with every block free - cost
+// nothing, and read as zeroes: formatting takes no longer for a large disk.
+// The disk is left unmounted; call fsMount to use it.  On succes, return 0.
+// On failure, abort
+// ============================================================================
+i32 fsFormat(i32 numBlocks, i32 numInodes, i32 blockSize) {
+  if (numBlocks < 1) numBlocks = BLOCKSPERDISK;
+  if (numInodes < 1) numInodes = NUMINODES;
+  if (blockSize < 1) blockSize = BYTESPERBLOCK;
+
+  FILE* fp = fopen(g_disk, "w+b");
   if (fp == NULL) FATAL(EDISKCREATE);
 
-  i32 ret = bfsInitSuper(fp);               // initialize Super block
+  i32 ret = bioOpen(g_disk, BIOPREAD);      // all writes below go via bio
   if (ret != 0) { fclose(fp); FATAL(ret); }
 
-  ret = bfsInitInodes(fp);                  // initialize Inodes block
+  ret = bfsInitGeometry(numBlocks, numInodes, blockSize);
   if (ret != 0) { fclose(fp); FATAL(ret); }
 
-  ret = bfsInitDir(fp);                     // initialize Dir block
+  ret = ftruncate(fileno(fp), (i64)numBlocks * blockSize);   // sparse
+  if (ret != 0) { fclose(fp); FATAL(EDISKCREATE); }
+
+  cacheInit();                              // ... through an empty cache
+
+  ret = bfsInitSuper(fp);                   // initialize Super block
+  if (ret != 0) { fclose(fp); FATAL(ret); }
+
+  ret = bfsInitInodes(fp);                  // initialize Inodes blocks
+  if (ret != 0) { fclose(fp); FATAL(ret); }
+
+  ret = bfsInitDir(fp);                     // initialize Dir blocks
   if (ret != 0) { fclose(fp); FATAL(ret); }
 
-  ret = bfsInitFreeList();                  // initialize Freelist
+  ret = bfsInitFreeList();                  // initialize bitmap
+  if (ret != 0) { fclose(fp); FATAL(ret); }
+
+  ret = bfsInitInodeMap(fp);                // initialize Inode map
+  if (ret != 0) { fclose(fp); FATAL(ret); }
+
+  ret = jrnInit();                          // initialize empty journal
   if (ret != 0) { fclose(fp); FATAL(ret); }
 
   ret = bfsInitOFT();                  	   // initialize OFT
   if (ret != 0) { fclose(fp); FATAL(ret); }
 
+  cacheStop();                              // no readahead left running
+  cacheFlush();
+  bioClose();
   fclose(fp);
   return 0;
 }
 
 
 // ============================================================================
-// Mount the BFS disk.  It must already exist
+// Make the file open on File Descriptor 'fd' durable: give its delayed blocks
+// DBNs, write back its dirty data blocks, then commit the journal, so its
+// Inode and block map are safe too.  The commit takes every other pending
+// metadata change with it.  On success, return 0.  On failure, abort
+// ============================================================================
+i32 fsFsync(i32 fd) {
+  i32 inum = bfsFdToInum(fd);
+  jrnBegin();
+  bfsLockInode(inum, 1);
+  bfsAllocDelayed(inum);
+  bfsUnlockInode(inum);
+  jrnEnd();
+  bfsLockInode(inum, 0);
+  bfsFlushFile(inum);
+  bfsUnlockInode(inum);
+  jrnCommit();
+  return bioSync();
+}
+
+
+
+// ============================================================================
+// Mount the BFS disk, in the default BIOPREAD mode.  See fsMountMode
 // ============================================================================
 i32 fsMount() {
-  FILE* fp = fopen(BFSDISK, "rb");
-  if (fp == NULL) FATAL(ENODISK);           // BFSDISK not found
-  fclose(fp);
-  return 0;
+  return fsMountMode(BIOPREAD);
 }
 
 
 
 // ============================================================================
-// Open the existing file called 'fname'.  On success, return its file 
-// descriptor.  On failure, return EFNF
+// Mount the BFS disk.  It must already exist; its geometry is read from the
+// SuperBlock, and checked.  The disk stays open until fsUnmount, so that block
+// IO need not reopen it for every block.  Any metadata committed to the
+// journal, but not yet written home, is written home first.  Then all the
+// metadata - Inodes, Directory, allocation bitmap and Inode map - is read
+// into memory, with a few large sequential reads, and every later lookup is
+// served from there.  Blocks are cached from here on.
+// 'mode' selects how the disk is accessed:
+//
+//  BIOPREAD : pread/pwrite of each block, via the block cache
+//  BIOMMAP  : the disk is mmap'd, and fsRead/fsWrite copy file data straight
+//             between the mapping and the caller's buffer
+//  BIOURING : as BIOPREAD, but multi-block transfers are issued together
+//             through an io_uring.  Falls back to BIOPREAD if unavailable
+// ============================================================================
+i32 fsMountMode(i32 mode) {
+  if (mode != BIOPREAD && mode != BIOMMAP && mode != BIOURING) FATAL(EBADMODE);
+  bioOpen(g_disk, mode);                    // FATAL if not found
+  bfsLoadSuper();                           // FATAL if not a BFS disk
+  cacheInit();
+  jrnReplay();                              // recover from a crash
+  bfsLoadBitmap();
+  return bfsLoadMeta();
+}
+
+
+
+// ============================================================================
+// Open the existing file called 'fname'.  On success, return a new file
+// descriptor for it, with its own cursor, at 0: opening a file again does not
+// disturb its other opens.  On failure, return EFNF
 // ============================================================================
 i32 fsOpen(str fname) {
+  jrnBegin();                             // may write back an evicted Inode
   i32 inum = bfsLookupFile(fname);        // lookup 'fname' in Directory
+  jrnEnd();
   if (inum == EFNF) return EFNF;
-  return bfsInumToFd(inum);
+  return bfsOpenFd(inum);
+}
+
+
+
+// ============================================================================
+// Read 'numb' bytes of data from offset 'offset' in the file currently
+// fsOpen'd on File Descriptor 'fd' into 'buf'.  The cursor is neither used nor
+// moved, so any number of threads may read through one descriptor at once.
+// On success, return actual number of bytes read (may be less than 'numb' if
+// we hit EOF).  On failure, abort
+// ============================================================================
+i32 fsPread(i32 fd, i64 offset, i32 numb, void* buf) {
+  if (numb < 0) FATAL(ENEGNUMB);
+  if (offset < 0) FATAL(EBADCURS);
+  i32 inum = bfsFdToInum(fd);
+  // shut out writers, but not other readers, until done
+  bfsLockInode(inum, 0);
+  // clip the read at EOF
+  i64 size = bfsGetSize(inum);
+  if (offset >= size) {
+    numb = 0;
+  } else if (numb > size - offset) {
+    numb = (i32)(size - offset);
+  }
+  fsReadAt(inum, offset, numb, buf);
+  bfsUnlockInode(inum);
+  return numb;
+}
+
+
+
+// ============================================================================
+// Write 'numb' bytes of data from 'buf' to offset 'offset' in the file
+// currently fsOpen'd on File Descriptor 'fd', growing the file if need be.  The
+// cursor is neither used nor moved.  It waits for any reads of the file to
+// finish, and they for it.  On success, return 0.  On failure, abort
+// ============================================================================
+i32 fsPwrite(i32 fd, i64 offset, i32 numb, void* buf) {
+  if (numb < 0) FATAL(ENEGNUMB);
+  if (offset < 0) FATAL(EBADCURS);
+  // the metadata changes below are one operation, for the journal
+  jrnBegin();
+  i32 inum = bfsFdToInum(fd);
+  // keep readers out until done.  fsWriteAt ends the operation, and unlocks
+  bfsLockInode(inum, 1);
+  fsWriteAt(inum, offset, numb, buf);
+  return 0;
 }
 
 
@@ -90,7 +481,8 @@ i32 fsOpen(str fname) {
 // ============================================================================
 // Read 'numb' bytes of data from the cursor in the file currently fsOpen'd on
 // File Descriptor 'fd' into 'buf'.  On success, return actual number of bytes
-// read (may be less than 'numb' if we hit EOF).  On failure, abort
+// read (may be less than 'numb' if we hit EOF).  Any number of threads may
+// read a file at once; a write to it waits for them.  On failure, abort
 // ============================================================================
 i32 fsRead(i32 fd, i32 numb, void* buf) {
   // printf("numb %d\n", numb);
@@ -98,78 +490,34 @@ i32 fsRead(i32 fd, i32 numb, void* buf) {
   if (numb < 0) FATAL(ENEGNUMB);
   // get the inode number
   i32 inum = bfsFdToInum(fd);
-  // get the current position of the cursor on the file
-  i32 cur_pos = fsTell(fd); 
-  // check if the cursor is out of bound
-  if (cur_pos < 0) FATAL(EBADCURS);
-  // check if past the end of the file
-  if (cur_pos > fsSize(fd)) FATAL(EBADCURS);
-  // ret is the number of bytes we can read
-  int ret = numb;
-  if (ret + cur_pos > fsSize(fd)){
-    ret = fsSize(fd) - cur_pos;
-    numb = fsSize(fd) - cur_pos;
-  }
-  // to offset the cursor after reading
-  i32 offset = ret + cur_pos;
-  // to obtain starting block number 
-  i32 fnb = cur_pos / BYTESPERBLOCK; 
-  // to obtain the starting byte number for reading
-  i32 start_byte = cur_pos % BYTESPERBLOCK; 
-  // this will temporarily store the data read from the disk
-  i8 temp[BYTESPERBLOCK];
-  // this is a pointer to the temp array
-  i8 * temp_prt = (i8*)temp;
-  // this is a pointer to the buf array to help copy the data
-  i8 * buf_prt = (i8*)buf;
-  while(fnb < MAXFBN && numb > 0){
-    //printf("reading nunb %d\n", numb);
-    // read entire block
-    bfsRead(inum, fnb, temp);
-    // if the reading does not start from the beginning of the block
-    if (start_byte != 0){
-      // In case when the number of bytes to read is less than 
-      //the number of bytes left in the block
-      if (numb < BYTESPERBLOCK - start_byte){
-        // copy the data from the temp array to the buf array
-        memcpy(buf_prt, temp_prt + start_byte, numb);
-        numb = 0;
-      }
-      else{
-        // copy the data from the temp array to the buf array
-        memcpy(buf_prt, temp_prt + start_byte, BYTESPERBLOCK - start_byte);
-        buf_prt += BYTESPERBLOCK - start_byte;
-        numb -= BYTESPERBLOCK - start_byte;
-        start_byte = 0;
-      }
-    }
-    else{
-      // In case when the number of bytes to read is less than
-      // the number of bytes in the block
-      if (numb < BYTESPERBLOCK){
-        // copy the data from the temp array to the buf array
-        memcpy(buf_prt, temp_prt, numb);
-        numb = 0;
-      }
-      else{
-        // copy the data from the temp array to the buf array
-        memcpy(buf_prt, temp_prt, BYTESPERBLOCK);
-        buf_prt += BYTESPERBLOCK;
-        numb -= BYTESPERBLOCK;
-      }
-    }
-    fnb ++;
-    // reset the temp pointer
-    temp_prt = (i8*)temp;
-  }
-  // update the cursor position
-  fsSeek(fd, offset, SEEK_SET);
-  //printf("ret = %d\n", ret);
-  return ret;
+  // shut out writers, but not other readers, until done
+  bfsLockInode(inum, 0);
+  // take the bytes from the cursor on, clipped at EOF, and move the cursor
+  // past them: a concurrent read through the same descriptor gets the next
+  i64 cur_pos = bfsAdvanceCursor(fd, &numb);
+  // if the file is being read sequentially, start reading ahead of it
+  bfsReadahead(fd, cur_pos, numb);
+  fsReadAt(inum, cur_pos, numb, buf);
+  bfsUnlockInode(inum);
+  return numb;
   //FATAL(ENYI);                                  // Not Yet Implemented!
 }
 
 
+// ============================================================================
+// Rename the file called 'oldName' to 'newName'.  A file already called
+// 'newName' is deleted.  On success, return 0.  If 'oldName' is not found,
+// EFNF; if 'newName' is open, EFILEOPEN
+// ============================================================================
+i32 fsRename(str oldName, str newName) {
+  jrnBegin();
+  i32 ret = bfsRenameFile(oldName, newName);
+  jrnEnd();
+  return ret;
+}
+
+
+
 // ============================================================================
 // Move the cursor for the file currently open on File Descriptor 'fd' to the
 // byte-offset 'offset'.  'whence' can be any of:
@@ -180,23 +528,20 @@ i32 fsRead(i32 fd, i32 numb, void* buf) {
 //
 // On success, return 0.  On failure, abort
 // ============================================================================
-i32 fsSeek(i32 fd, i32 offset, i32 whence) {
+i32 fsSeek(i32 fd, i64 offset, i32 whence) {
 
   if (offset < 0) FATAL(EBADCURS);
  
-  i32 inum = bfsFdToInum(fd);
-  i32 ofte = bfsFindOFTE(inum);
-  
   switch(whence) {
     case SEEK_SET:
-      g_oft[ofte].curs = offset;
+      bfsSetCursor(fd, offset);
       break;
     case SEEK_CUR:
-      g_oft[ofte].curs += offset;
+      bfsSetCursor(fd, bfsTell(fd) + offset);
       break;
     case SEEK_END: {
-        i32 end = fsSize(fd);
-        g_oft[ofte].curs = end + offset;
+        i64 end = fsSize(fd);
+        bfsSetCursor(fd, end + offset);
         break;
       }
     default:
@@ -210,20 +555,70 @@ i32 fsSeek(i32 fd, i32 offset, i32 whence) {
 // ============================================================================
 // Return the cursor position for the file open on File Descriptor 'fd'
 // ============================================================================
-i32 fsTell(i32 fd) {
+i64 fsTell(i32 fd) {
   return bfsTell(fd);
 }
 
 
 
+// ============================================================================
+// Use disk image 'path' in place of BFSDISK for later fsFormat and fsMount
+// calls; NULL => BFSDISK again.  Only while unmounted.  Lets a test run on a
+// scratch image, leaving BFSDISK as it is
+// ============================================================================
+i32 fsSetDisk(str path) {
+  g_disk = (path != NULL) ? path : BFSDISK;
+  return 0;
+}
+
+
+
 // ============================================================================
 // Retrieve the current file size in bytes.  This depends on the highest offset
 // written to the file, or the highest offset set with the fsSeek function.  On
 // success, return the file size.  On failure, abort
 // ============================================================================
-i32 fsSize(i32 fd) {
+i64 fsSize(i32 fd) {
   i32 inum = bfsFdToInum(fd);
-  return bfsGetSize(inum);
+  bfsLockInode(inum, 0);
+  i64 size = bfsGetSize(inum);
+  bfsUnlockInode(inum);
+  return size;
+}
+
+
+
+// ============================================================================
+// Make everything written so far durable: give every delayed block a DBN,
+// write back every dirty data block, commit the journal, and wait for the
+// disk.  On success, return 0
+// ============================================================================
+i32 fsSync() {
+  jrnBegin();
+  bfsSyncDelayed(1);
+  jrnEnd();
+  cacheFlush();
+  jrnCommit();
+  return bioSync();
+}
+
+
+
+// ============================================================================
+// Unmount the BFS disk: give every delayed block a DBN; commit the Inodes of
+// open files, and the allocation bitmap, to the journal - other changes to
+// the metadata held in memory went to it as they were made; write back all
+// dirty cached blocks, and empty the journal; then close the disk opened by
+// fsMount.  Files still open are closed.  On success, return 0
+// ============================================================================
+i32 fsUnmount() {
+  cacheStop();                              // no thread left, nor started
+  jrnBegin();
+  bfsSyncDelayed(1);
+  jrnEnd();
+  jrnClose();
+  bfsInitOFT();
+  return bioClose();
 }
 
 
@@ -231,97 +626,23 @@ i32 fsSize(i32 fd) {
 // ============================================================================
 // Write 'numb' bytes of data from 'buf' into the file currently fsOpen'd on
 // filedescriptor 'fd'.  The write starts at the current file offset for the
-// destination file.  On success, return 0.  On failure, abort
+// destination file.  It waits for any reads of the file to finish, and they
+// for it.  On success, return 0.  On failure, abort
 // ============================================================================
 
 i32 fsWrite(i32 fd, i32 numb, void* buf) {
   if (numb < 0){
     FATAL(ENEGNUMB);
   }
-  // get the current position of the cursor on the file
-  i32 cur_pos = fsTell(fd);
+  // the metadata changes below are one operation, for the journal
+  jrnBegin();
   // get the inode number
   i32 inum = bfsFdToInum(fd);
-  // get the size of the file
-  i32 size = fsSize(fd);
-  i32 diff = 0;
-  // determine the difference between the current position and the size of the file
-  if (cur_pos > size){
-    diff = cur_pos - size;
-  }
-  // to set the cursor once the writing is done
-  i32 offset = cur_pos + numb;
-  // to obtain the last block number
-  i32 fnb_last = (size + 1)/BYTESPERBLOCK;
-  // to obtain the current block number
-  i32 fnb_cur = cur_pos/BYTESPERBLOCK;
-  // to obtain the number of blocks needed to write
-  i32 num_block = (numb + diff - 1)/BYTESPERBLOCK + 1;
-  // to extend the file if needed
-  if(fnb_cur + num_block > fnb_last){
-    bfsExtend(inum, fnb_last+ num_block);
-    bfsSetSize(inum, offset);
-  }else{
-    if(cur_pos + numb > size){
-      bfsSetSize(inum, cur_pos + numb);
-    }
-  }
-  // to obtain the starting byte number for writing
-  i32 start_byte = cur_pos % BYTESPERBLOCK;
-  // to obtain the number of bytes left in the block
-  i32 count = numb;
-  // this is a pointer to the buf array to help copy the data
-  i8 * buf_start = (i8*)buf;
-  //printf("cur_pos %d\n", cur_pos);
-  while(count > 0){
-    //printf("count %d\n", count);
-    i8 temp[BYTESPERBLOCK];
-    // to ensure that only the bytes left in the block are written
-    bfsRead(inum, fnb_cur, temp);
-    // in case when the number of bytes to write is less than the number of 
-    //bytes left in the block
-    if (count < BYTESPERBLOCK){
-      // to check if the writing does not start from the beginning of the block
-      if (start_byte != 0){
-        memcpy(temp + start_byte, buf_start, count);
-      }
-      // only write certain number of bytes
-      else{
-        memcpy(temp, buf_start, count);
-        buf_start += count;
-      }
-      // obtain the disk block number
-      i32 dbn = bfsFbnToDbn(inum, fnb_cur);
-      // write the data to the disk
-      bioWrite(dbn, temp);
-      // update the number of bytes left to write
-      count = 0;
-    }
-    else{
-      // to check if the writing does not start from the beginning of the block
-      if (start_byte != 0){
-        memcpy(temp + start_byte, buf_start, BYTESPERBLOCK - start_byte);
-        count -= BYTESPERBLOCK;
-        count += start_byte;
-        buf_start += BYTESPERBLOCK;
-        buf_start -= start_byte;
-        start_byte = 0;
-      }
-      else{
-        memcpy(temp, buf_start, BYTESPERBLOCK);
-        buf_start += BYTESPERBLOCK;
-        count -= BYTESPERBLOCK;
-      }
-      // obtain the disk block number
-      i32 dbn = bfsFbnToDbn(inum, fnb_cur);
-      // write the data to the disk
-      bioWrite(dbn, temp);
-      // update the number of bytes left to write
-    }
-    // update the file block number
-    fnb_cur ++;
-  } 
-  // update the cursor position
-  fsSeek(fd, offset, SEEK_SET);
+  // keep readers out until done.  fsWriteAt ends the operation, and unlocks
+  bfsLockInode(inum, 1);
+  // move the cursor past the bytes about to be written at it, then write
+  i64 cur_pos = fsTell(fd);
+  bfsSetCursor(fd, cur_pos + numb);
+  fsWriteAt(inum, cur_pos, numb, buf);
   return 0;
 }
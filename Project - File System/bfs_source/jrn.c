@@ -0,0 +1,399 @@
+// ============================================================================
+// jrn.c - Metadata journal, with group commit
+//
+// Metadata blocks are modified in the cache as usual, but released with
+// jrnPut (or written with jrnWrite), which holds them there: they are not
+// written back to their home DBN until committed.  Each is listed in the
+// running transaction.
+//
+// File system operations are bracketed by jrnBegin and jrnEnd.  Once no
+// operation is in progress, jrnEnd commits the transaction if it has batched
+// JRNGROUP operations, or has grown too close to g_txMax blocks.  A commit
+// copies the in-memory Inodes and bitmap into their blocks, writes file data
+// to disk, then writes a descriptor and an image of each block in the
+// transaction into the journal with one sequential write, and syncs.  Only
+// then are the blocks released, to be written home lazily by the cache - and
+// blocks the transaction freed, allocated again.
+//
+// The journal is a header block, followed by transactions laid end to end,
+// with increasing sequence numbers.  When there is no room for another,
+// every committed block is written home, and the journal emptied: the header
+// is updated to start at the next sequence number.  At mount, jrnReplay
+// writes home every transaction whose sequence number follows on, and whose
+// checksum is right; a transaction torn by a crash is ignored.
+//
+// Where the journal lies, and how big it is, come from the SuperBlock.  A
+// transaction may fill at most half of it, so that there is always room for
+// two, and never more than JRNMAXBLOCKS blocks.
+//
+// Threads: the outermost jrnBegin takes g_lock, and the matching jrnEnd
+// drops it, so operations run one at a time, and a commit - which takes
+// g_lock too - never sees half of one.  File reads take no part, and run
+// alongside.  A write ends its operation with jrnEndData instead, once it has
+// allocated the blocks it needs, and writes their data after, without g_lock,
+// so that other operations need not wait for its IO; then calls jrnDataDone.
+// Till then, no commit starts: committed metadata must never point at blocks
+// whose data is not yet written - see g_dataOps
+// ============================================================================
+
+#include <pthread.h>
+
+#include "bfs.h"
+#include "jrn.h"
+
+static i32      g_tx[JRNMAXBLOCKS];         // DBNs in running transaction
+static i32      g_txNum = 0;                // # of DBNs in g_tx
+static __thread i32 g_depth = 0;            // this thread's open jrnBegin's
+static i32      g_ops   = 0;                // operations since last commit
+static u32      g_seq   = 0;                // sequence # of next transaction
+static i32      g_pos   = 0;                // DBN for next transaction
+static i32      g_txMax = 0;                // most DBNs in a transaction
+static JrnStats g_stats;
+static i8*      g_txBuf = NULL;             // descriptor + g_txMax blocks
+static __thread i32 g_held = 0;             // 1 => jrnEndData kept g_lock
+static __thread i32 g_writing = 0;          // 1 => jrnEndData counted us
+
+static pthread_mutex_t g_lock = PTHREAD_MUTEX_INITIALIZER; // see above
+
+// Writes between jrnEndData and jrnDataDone, into blocks the running
+// transaction may have allocated.  A commit waits for them all to finish
+
+static i32             g_dataOps  = 0;
+static pthread_mutex_t g_dataLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  g_dataDone = PTHREAD_COND_INITIALIZER;
+
+
+
+// ============================================================================
+// Return the FNV-1a checksum of the 'numb' bytes at 'buf'
+// ============================================================================
+static u32 jrnSum(void* buf, i32 numb) {
+  u8* p = (u8*)buf;
+  u32 h = 2166136261u;
+  for (i32 i = 0; i < numb; ++i) {
+    h ^= p[i];
+    h *= 16777619u;
+  }
+  return h;
+}
+
+
+
+// ============================================================================
+// Size the transaction limit, and buffer, to the journal of the disk described
+// by g_super.  The blocks of the running transaction are held in the cache
+// until it commits, so it may fill no more than half the cache
+// ============================================================================
+static void jrnSetup() {
+  g_txMax = (g_super.numJournal - 1) / 2 - 1;
+  if (g_txMax > JRNMAXBLOCKS)       g_txMax = JRNMAXBLOCKS;
+  if (g_txMax > NUMCACHEBLOCKS / 2) g_txMax = NUMCACHEBLOCKS / 2;
+  if (g_txMax < 1) FATAL(EBADGEOM);
+
+  free(g_txBuf);
+  g_txBuf = (i8*)malloc((i64)(1 + g_txMax) * g_super.blockSize);
+  if (g_txBuf == NULL) FATAL(ENOMEM);
+}
+
+
+
+// ============================================================================
+// Write every committed block home, then empty the journal, so that the next
+// transaction goes at its start.  Only called with no transaction running
+// ============================================================================
+static void jrnCheckpoint() {
+  cacheFlush();
+  bioSync();
+
+  i8 buf[MAXBLOCKSIZE] = {0};
+  JrnSuper* js = (JrnSuper*)buf;
+  js->magic = JRNMAGIC;
+  js->seq   = g_seq;
+  bioWrite(g_super.dbnJournal, buf);
+  bioSync();
+
+  g_pos = g_super.dbnJournal + 1;
+  ++g_stats.checkpoints;
+}
+
+
+
+// ============================================================================
+// Commit the running transaction to the journal, as described above.  Return
+// once it is on stable storage.  If nothing has changed, do nothing.  Called
+// with g_lock held
+// ============================================================================
+static void jrnCommitTx() {
+  pthread_mutex_lock(&g_dataLock);          // writes after jrnEndData
+  while (g_dataOps > 0) pthread_cond_wait(&g_dataDone, &g_dataLock);
+  pthread_mutex_unlock(&g_dataLock);
+
+  bfsSyncInodes();                          // in-memory metadata to blocks
+  bfsSyncBitmap();
+  g_ops = 0;
+  if (g_txNum == 0) return;
+
+  cacheFlush();                             // data first: committed metadata
+  bioSync();                                // never points at stale blocks
+
+  i32 bsize = g_super.blockSize;
+  memset(g_txBuf, 0, bsize);
+  JrnDesc* desc = (JrnDesc*)g_txBuf;
+  desc->magic = JRNMAGIC;
+  desc->seq   = g_seq;
+  desc->count = g_txNum;
+  for (i32 i = 0; i < g_txNum; ++i) {
+    desc->dbn[i] = g_tx[i];
+    cacheRead(g_tx[i], g_txBuf + (1 + i) * bsize);
+  }
+  desc->sum = jrnSum(g_txBuf, (1 + g_txNum) * bsize);
+
+  bioWriteRun(g_pos, 1 + g_txNum, g_txBuf);
+  bioSync();
+
+  for (i32 i = 0; i < g_txNum; ++i) cacheRelease(g_tx[i]);
+  bfsReleaseFreed();                        // safe to reuse them now
+
+  g_stats.blocks += g_txNum;
+  ++g_stats.commits;
+  g_pos += 1 + g_txNum;
+  ++g_seq;
+  g_txNum = 0;
+
+  i32 end = g_super.dbnJournal + g_super.numJournal;
+  if (g_pos + 1 + g_txMax > end) jrnCheckpoint();
+}
+
+
+
+// ============================================================================
+// Start a file system operation.  No commit happens until the matching
+// jrnEnd, so a transaction never holds half an operation.  Calls may nest.
+// The outermost waits for any other thread's operation to end
+// ============================================================================
+i32 jrnBegin() {
+  if (g_depth++ == 0) pthread_mutex_lock(&g_lock);
+  return 0;
+}
+
+
+
+// ============================================================================
+// Commit the running transaction, then empty the journal.  Called by
+// fsUnmount, so that a cleanly unmounted disk has nothing to replay
+// ============================================================================
+i32 jrnClose() {
+  jrnCommit();
+  jrnCheckpoint();
+  return 0;
+}
+
+
+
+// ============================================================================
+// Commit the running transaction - see jrnCommitTx.  Outside an operation,
+// first wait for any other thread's to end
+// ============================================================================
+i32 jrnCommit() {
+  if (g_depth++ == 0) pthread_mutex_lock(&g_lock);
+  jrnCommitTx();
+  if (--g_depth == 0) pthread_mutex_unlock(&g_lock);
+  return 0;
+}
+
+
+
+// ============================================================================
+// Finish the data writes of an operation ended with jrnEndData, so that a
+// commit may start.  If jrnEndData found a commit due, and so kept g_lock,
+// end the operation now, as jrnEnd: the commit follows the data
+// ============================================================================
+i32 jrnDataDone() {
+  if (g_held) {
+    g_held = 0;
+    return jrnEnd();
+  }
+  if (!g_writing) return 0;                 // ended within another operation
+  g_writing = 0;
+  pthread_mutex_lock(&g_dataLock);
+  if (--g_dataOps == 0) pthread_cond_broadcast(&g_dataDone);
+  pthread_mutex_unlock(&g_dataLock);
+  return 0;
+}
+
+
+
+// ============================================================================
+// End a file system operation, started by jrnBegin.  If it was the outermost,
+// commit if enough operations, or blocks, have been batched up - counting the
+// blocks the commit itself will add (bfsPendingMeta), and leaving room for one
+// more operation.  Before committing, give DBNs to the blocks of closed files
+// whose allocation was delayed - see bfsSyncDelayed
+// ============================================================================
+i32 jrnEnd() {
+  if (g_depth == 0) return 0;               // no jrnBegin
+  if (g_depth > 1) {
+    --g_depth;
+    return 0;
+  }
+  ++g_ops;
+  i32 blocks = g_txNum + bfsPendingMeta() + JRNOPBLOCKS;
+  if (g_ops >= JRNGROUP || blocks > g_txMax) {
+    bfsSyncDelayed(0);                      // closed files' delayed data
+    jrnCommitTx();
+  }
+  g_depth = 0;
+  pthread_mutex_unlock(&g_lock);
+  return 0;
+}
+
+
+
+// ============================================================================
+// End the metadata part of a file system operation - a write, which has
+// allocated the blocks it will write - so that other operations may run
+// while it writes its data.  No commit starts till the matching jrnDataDone.
+// If jrnEnd would commit now, keep g_lock instead, and leave the operation,
+// and its commit, to jrnDataDone; likewise, within another operation, which
+// only jrnEnd can end
+// ============================================================================
+i32 jrnEndData() {
+  if (g_depth != 1) return jrnEnd();        // no jrnBegin, or nested
+  i32 blocks = g_txNum + bfsPendingMeta() + JRNOPBLOCKS;
+  if (g_ops + 1 >= JRNGROUP || blocks > g_txMax) {
+    g_held = 1;
+    return 0;
+  }
+  ++g_ops;
+  pthread_mutex_lock(&g_dataLock);
+  ++g_dataOps;
+  pthread_mutex_unlock(&g_dataLock);
+  g_writing = 1;
+  g_depth = 0;
+  pthread_mutex_unlock(&g_lock);
+  return 0;
+}
+
+
+
+// ============================================================================
+// Write an empty journal: a header, with no transactions after it.  Called
+// by fsFormat, once g_super describes the new disk
+// ============================================================================
+i32 jrnInit() {
+  jrnSetup();
+
+  i8  buf[MAXBLOCKSIZE] = {0};
+  i32 end = g_super.dbnJournal + g_super.numJournal;
+  for (i32 dbn = g_super.dbnJournal + 1; dbn < end; ++dbn) {
+    cacheWrite(dbn, buf);
+  }
+
+  JrnSuper* js = (JrnSuper*)buf;
+  js->magic = JRNMAGIC;
+  js->seq   = 1;
+  return cacheWrite(g_super.dbnJournal, buf);
+}
+
+
+
+// ============================================================================
+// Release metadata block 'dbn', pinned by cacheGet and modified, into the
+// running transaction.  It stays in the cache until committed.  On failure
+// (transaction full), abort
+// ============================================================================
+i32 jrnPut(i32 dbn) {
+  cachePut(dbn, CACHEHELD);
+  for (i32 i = 0; i < g_txNum; ++i) {
+    if (g_tx[i] == dbn) return 0;           // already in transaction
+  }
+  if (g_txNum == g_txMax) FATAL(EJRNFULL);
+  g_tx[g_txNum++] = dbn;
+  return 0;
+}
+
+
+
+// ============================================================================
+// Write home the metadata of every complete transaction in the journal, then
+// empty it.  Called by fsMount, after bfsLoadSuper, but before any other
+// metadata is read.  On success, return 0.  If the disk has no journal, abort
+// ============================================================================
+i32 jrnReplay() {
+  jrnSetup();
+
+  i32 bsize = g_super.blockSize;
+  i8  buf[MAXBLOCKSIZE];
+  bioRead(g_super.dbnJournal, buf);
+  JrnSuper* js = (JrnSuper*)buf;
+  if (js->magic != JRNMAGIC) FATAL(EBADMAGIC);
+
+  memset(&g_stats, 0, sizeof(JrnStats));
+  g_txNum = 0;
+  g_depth = 0;
+  g_ops   = 0;
+  g_seq   = js->seq;
+  g_pos   = g_super.dbnJournal + 1;
+
+  i32 end = g_super.dbnJournal + g_super.numJournal;
+  JrnDesc* desc = (JrnDesc*)g_txBuf;
+  while (g_pos < end) {
+    bioRead(g_pos, g_txBuf);
+    i32 count = desc->count;
+    if (desc->magic != JRNMAGIC || desc->seq != g_seq) break;
+    if (count < 1 || count > g_txMax || g_pos + 1 + count > end) break;
+
+    bioReadRun(g_pos + 1, count, g_txBuf + bsize);
+    u32 sum = desc->sum;
+    desc->sum = 0;
+    if (jrnSum(g_txBuf, (1 + count) * bsize) != sum) break;        // torn
+
+    for (i32 i = 0; i < count; ++i) {
+      bioWrite(desc->dbn[i], g_txBuf + (1 + i) * bsize);
+    }
+    g_pos += 1 + count;
+    ++g_seq;
+    ++g_stats.replayed;
+  }
+
+  if (g_stats.replayed > 0) jrnCheckpoint();
+  g_pos = g_super.dbnJournal + 1;
+  return 0;
+}
+
+
+
+// ============================================================================
+// Make room in the running transaction for 'num' more metadata blocks,
+// committing it first if need be - even in the middle of an operation.  For
+// operations too big for one transaction, such as allocating the blocks of a
+// large write: each step must leave the metadata consistent, and calls this
+// before it starts
+// ============================================================================
+i32 jrnReserve(i32 num) {
+  if (g_txNum + bfsPendingMeta() + num > g_txMax) jrnCommit();
+  return 0;
+}
+
+
+
+// ============================================================================
+// Copy the journal statistics into 'stats'
+// ============================================================================
+i32 jrnStats(JrnStats* stats) {
+  if (stats == NULL) FATAL(ENULLPTR);
+  memcpy(stats, &g_stats, sizeof(JrnStats));
+  return 0;
+}
+
+
+
+// ============================================================================
+// Overwrite metadata block 'dbn' with the contents of 'buf', as part of the
+// running transaction.  See jrnPut
+// ============================================================================
+i32 jrnWrite(i32 dbn, void* buf) {
+  void* p = cacheGet(dbn);
+  memcpy(p, buf, g_super.blockSize);
+  return jrnPut(dbn);
+}
@@ -0,0 +1,51 @@
+#ifndef JRN_H
+#define JRN_H
+
+// ===================================================================
+// jrn.h - Metadata journal.  Changes to metadata blocks (Super,
+// Inodes, Dir, bitmap, extent tree) are batched into transactions,
+// written to the journal region of the BFS disk in one sequential
+// write, and replayed at mount if the disk was not cleanly unmounted
+// ===================================================================
+
+#include "alias.h"
+
+#define JRNMAGIC     0x4C4E524A   // "JRNL"
+#define JRNMAXBLOCKS 120          // most metadata blocks in any transaction
+#define JRNOPBLOCKS  5            // most metadata blocks one operation dirties
+#define JRNGROUP     32           // most operations batched into one commit
+
+typedef struct {          // Journal header: first block of the journal
+  i32 magic;              // JRNMAGIC
+  u32 seq;                // sequence number of the first transaction
+} JrnSuper;
+
+typedef struct {          // Descriptor: first block of each transaction
+  i32 magic;              // JRNMAGIC
+  u32 seq;                // sequence number of this transaction
+  i32 count;              // # of block images that follow
+  u32 sum;                // checksum of descriptor (sum = 0) and images
+  i32 dbn[JRNMAXBLOCKS];  // home DBN of each image
+} JrnDesc;
+
+typedef struct {          // Journal statistics
+  u64 commits;            // transactions written to the journal
+  u64 blocks;             // metadata block images written to the journal
+  u64 checkpoints;        // times the journal was emptied
+  u64 replayed;           // transactions replayed at mount
+} JrnStats;
+
+i32 jrnBegin();
+i32 jrnClose();
+i32 jrnCommit();
+i32 jrnDataDone();
+i32 jrnEnd();
+i32 jrnEndData();
+i32 jrnInit();
+i32 jrnPut(i32 dbn);
+i32 jrnReplay();
+i32 jrnReserve(i32 num);
+i32 jrnStats(JrnStats* stats);
+i32 jrnWrite(i32 dbn, void* buf);
+
+#endif
\ No newline at end of file
@@ -1,11 +1,54 @@
 #include <stdio.h>
 
+#include "bench.h"
 #include "bfs.h"
+#include "check.h"
 #include "errors.h"
+#include "fs.h"
 #include "p5test.h"
 
-int main() {
+// ============================================================================
+// Run p5test against BFSDISK.  "main mmap" mounts the disk in BIOMMAP mode;
+// "main uring" in BIOURING mode; otherwise, BIOPREAD.  "main format" instead
+// creates a fresh BFSDISK, holding just file P5, ready for p5test; "main
+// format <blocks> <inodes> <blocksize>" gives it that geometry, rather than
+// the default.  "main bench" times block IO at a range of queue depths, on
+// BFSDISK.  "main stress" runs the file system from many threads at once, and
+// "main check [name]" runs correctness checks - see bench.c and check.c -
+// each on a scratch image of its own.  "main alloc" times free-space search
+// ============================================================================
+int main(int argc, char* argv[]) {
   bfsInitOFT();
+  if (argc > 1 && strcmp(argv[1], "format") == 0) {
+    i32 numBlocks = (argc > 2) ? atoi(argv[2]) : 0;     // 0 => default
+    i32 numInodes = (argc > 3) ? atoi(argv[3]) : 0;
+    i32 blockSize = (argc > 4) ? atoi(argv[4]) : 0;
+    fsFormat(numBlocks, numInodes, blockSize);
+    fsMount();
+    createP5();
+    fsUnmount();
+    return 0;
+  }
+  if (argc > 1 && strcmp(argv[1], "bench") == 0) {
+    return benchQueueDepth(BFSDISK);
+  }
+  if (argc > 1 && strcmp(argv[1], "stress") == 0) {
+    return benchStress();
+  }
+  if (argc > 1 && strcmp(argv[1], "alloc") == 0) {
+    return benchFreeRun();
+  }
+  if (argc > 1 && strcmp(argv[1], "check") == 0) {
+    return checkRun((argc > 2) ? argv[2] : NULL);
+  }
+  if (argc > 1 && strcmp(argv[1], "mmap") == 0) {
+    fsMountMode(BIOMMAP);
+  } else if (argc > 1 && strcmp(argv[1], "uring") == 0) {
+    fsMountMode(BIOURING);
+  } else {
+    fsMount();
+  }
   p5test();
+  fsUnmount();
   return 0;
 }
\ No newline at end of file
@@ -0,0 +1,313 @@
+// ============================================================================
+// map.c - free-space search over an allocation bitmap
+//
+// Bits are scanned a 64-bit word at a time: within a word, __builtin_ctzll
+// finds the first bit wanted; words wholly in use (or wholly free) are
+// skipped four at a time - with one AVX2 compare, where the CPU supports it,
+// or else by OR'ing them together.  mapSimd picks which, at run time.
+//
+// Each region of MAPREGION bits has a MapRegion summary: how many of its bits
+// are free, the free runs at its head and tail, and its longest free run.
+// mapFindRun walks the summaries, not the bits: a region all free, or all in
+// use, costs one test; a region whose longest run is no longer than the best
+// found so far costs two, for its head and tail, which may join runs in the
+// regions either side.  Only regions that may hold a longer run are scanned.
+// Summaries are made lazily: mapInit marks every region unsummarized, and
+// each is summarized the first time a search reaches it, so that taking over
+// the bitmap of a large disk costs nothing up front.  mapSet and mapClear
+// bring the summaries of the regions they touch up to date.  The caller
+// serializes all calls on one Map
+// ============================================================================
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+#include "errors.h"
+#include "map.h"
+
+static i32 g_simd = -1;           // 1 => mapSkip uses AVX2.  -1 => not set
+
+
+
+#if defined(__x86_64__)
+// ============================================================================
+// mapSkip, with AVX2: compare four words at once with 'skip'
+// ============================================================================
+__attribute__((target("avx2")))
+static i32 mapSkipAvx2(u64* bits, i32 w, i32 wEnd, u64 skip) {
+  __m256i s = _mm256_set1_epi64x((long long)skip);
+  while (w + 4 <= wEnd) {
+    __m256i v = _mm256_loadu_si256((__m256i*)(bits + w));
+    if (_mm256_movemask_epi8(_mm256_cmpeq_epi64(v, s)) != -1) break;
+    w += 4;
+  }
+  while (w < wEnd && bits[w] == skip) ++w;
+  return w;
+}
+#endif
+
+
+
+// ============================================================================
+// Return the first of words 'w' .. 'wEnd' - 1 of 'bits' that is not equal to
+// 'skip' - all 1's, to skip blocks in use; or 0, free ones.  If there is
+// none, return 'wEnd'
+// ============================================================================
+static i32 mapSkip(u64* bits, i32 w, i32 wEnd, u64 skip) {
+#if defined(__x86_64__)
+  if (g_simd == 1) return mapSkipAvx2(bits, w, wEnd, skip);
+#endif
+  while (w + 4 <= wEnd) {
+    u64 diff = (bits[w]     ^ skip) | (bits[w + 1] ^ skip) |
+               (bits[w + 2] ^ skip) | (bits[w + 3] ^ skip);
+    if (diff != 0) break;
+    w += 4;
+  }
+  while (w < wEnd && bits[w] == skip) ++w;
+  return w;
+}
+
+
+
+// ============================================================================
+// Set (if 'used') or clear the 'count' bits of 'bits' from 'first' onwards, a
+// word at a time
+// ============================================================================
+static void mapFill(u64* bits, i32 first, i32 count, i32 used) {
+  i32 n   = first;
+  i32 end = first + count;
+  while (n < end) {
+    i32 b = n % 64;
+    i32 k = (end - n < 64 - b) ? end - n : 64 - b;
+    u64 mask = (k == 64) ? ~0ULL : ((1ULL << k) - 1) << b;
+    if (used) {
+      bits[n / 64] |= mask;
+    } else {
+      bits[n / 64] &= ~mask;
+    }
+    n += k;
+  }
+}
+
+
+
+// ============================================================================
+// Recompute the summary of region 'r' of 'map'
+// ============================================================================
+static void mapSum(Map* map, i32 r) {
+  i32 first = r * MAPREGION;
+  i32 end   = (map->num - first < MAPREGION) ? map->num : first + MAPREGION;
+  MapRegion* g = &map->regions[r];
+  memset(g, 0, sizeof(MapRegion));
+
+  for (i32 w = first / 64; w < (end + 63) / 64; ++w) {
+    u64 used = map->bits[w];
+    if (w * 64 + 64 > end) used |= ~0ULL << (end - w * 64);  // past the end
+    g->free += __builtin_popcountll(~used);
+  }
+  if (g->free == 0) return;
+
+  for (i32 n = first; n < end; ) {
+    n = mapNextFree(map->bits, n, end);
+    if (n == end) break;
+    i32 u = mapNextUsed(map->bits, n, end);
+    if (n == first)          g->head    = u - n;
+    if (u == end)            g->tail    = u - n;
+    if (u - n > g->longest)  g->longest = u - n;
+    n = u;
+  }
+}
+
+
+
+// ============================================================================
+// Note the free run 'start' .. 'end' - 1: if it is longer than *len, the
+// longest found so far, it becomes the best, at *best
+// ============================================================================
+static void mapNote(i32 start, i32 end, i32* best, i32* len) {
+  if (end - start > *len) {
+    *best = start;
+    *len  = end - start;
+  }
+}
+
+
+
+// ============================================================================
+// Scan bits 'n' .. 'end' - 1 of 'bits' for free runs, noting each - see
+// mapNote - until one reaches 'want'.  *open is the start of a free run that
+// reaches bit 'n', or -1; on return, of one that reaches 'end'
+// ============================================================================
+static void mapScan(u64* bits, i32 n, i32 end, i32* open, i32* best,
+                    i32* len, i32 want) {
+  while (n < end && *len < want) {
+    if (*open < 0) {
+      n = mapNextFree(bits, n, end);
+      if (n == end) return;
+      *open = n;
+    }
+    n = mapNextUsed(bits, n, end);
+    if (n == end) return;                   // run goes on past 'end'
+    mapNote(*open, n, best, len);
+    *open = -1;
+  }
+}
+
+
+
+// ============================================================================
+// Search bits 'from' .. 'to' - 1 of 'map' for the first free run of at least
+// 'want' bits, via the region summaries - see the top of this file.  Set *len
+// to the length of the run found - or, if none is that long, of the longest
+// run there, if longer than *len already - and return its start.  If no run
+// longer than *len is found, return 'best'
+// ============================================================================
+static i32 mapSearch(Map* map, i32 from, i32 to, i32 want, i32 best,
+                     i32* len) {
+  i32 open = -1;                            // start of run reaching 'n'
+  i32 n    = from;
+  while (n < to && *len < want) {
+    i32 r    = n / MAPREGION;
+    i32 rEnd = (r + 1) * MAPREGION;
+    MapRegion* g = &map->regions[r];
+    if (g->free < 0) mapSum(map, r);        // first search to reach it
+    if (n % MAPREGION != 0 || rEnd > to) {  // part of a region: scan it
+      if (rEnd > to) rEnd = to;
+      mapScan(map->bits, n, rEnd, &open, &best, len, want);
+    } else if (g->free == MAPREGION) {      // all free
+      if (open < 0) open = n;
+    } else if (g->longest > *len) {         // may hold a longer run
+      mapScan(map->bits, n, rEnd, &open, &best, len, want);
+    } else {                                // just its head and tail count
+      if (open >= 0) mapNote(open, n + g->head, &best, len);
+      open = (g->tail > 0) ? rEnd - g->tail : -1;
+    }
+    n = rEnd;
+    if (open >= 0 && n - open >= want) mapNote(open, n, &best, len);
+  }
+  if (open >= 0 && *len < want) mapNote(open, n, &best, len);
+  return best;
+}
+
+
+
+// ============================================================================
+// Mark the 'count' bits of 'map' from 'first' onwards free, and update the
+// summaries of their regions.  On success, return 0
+// ============================================================================
+i32 mapClear(Map* map, i32 first, i32 count) {
+  mapFill(map->bits, first, count, 0);
+  for (i32 r = first / MAPREGION; r <= (first + count - 1) / MAPREGION; ++r) {
+    mapSum(map, r);
+  }
+  return 0;
+}
+
+
+
+// ============================================================================
+// Find a run of 'want' free bits of 'map', between 'first' and 'last' - 1:
+// the first at or after 'hint'; or failing that, the first after 'first'.
+// If there is none that long, find the longest run instead.  Set *len to the
+// length of the run found - possibly more than 'want' - and return its start.
+// If no bit is free, set *len to 0, and return -1
+// ============================================================================
+i32 mapFindRun(Map* map, i32 first, i32 last, i32 hint, i32 want, i32* len) {
+  if (hint < first || hint >= last) hint = first;
+  *len = 0;
+  i32 best = mapSearch(map, hint, last, want, -1, len);
+  if (*len < want) best = mapSearch(map, first, hint, want, best, len);
+  return best;
+}
+
+
+
+// ============================================================================
+// Take over bitmap 'bits', of 'num' bits, as 'map'.  Its regions are left
+// unsummarized, until first searched.  Any earlier bitmap 'map' held is
+// forgotten.  On success, return 0.  On failure, abort
+// ============================================================================
+i32 mapInit(Map* map, u64* bits, i32 num) {
+  if (g_simd < 0) mapSimd(1);
+
+  i32 numRegions = (num + MAPREGION - 1) / MAPREGION;
+  free(map->regions);
+  map->bits    = bits;
+  map->num     = num;
+  map->regions = (MapRegion*)calloc(numRegions + 1, sizeof(MapRegion));
+  if (map->regions == NULL) FATAL(ENOMEM);
+
+  for (i32 r = 0; r < numRegions; ++r) map->regions[r].free = -1;
+  return 0;
+}
+
+
+
+// ============================================================================
+// Return the first 0 bit of 'bits' - the first free block, or Inode - at or
+// after bit 'n', and before 'end'.  If there is none, return 'end'
+// ============================================================================
+i32 mapNextFree(u64* bits, i32 n, i32 end) {
+  if (n >= end) return end;
+  u64 free = ~bits[n / 64] >> (n % 64);               // 1 bits => free
+  if (free == 0) {                                    // rest of word in use
+    i32 w = mapSkip(bits, n / 64 + 1, (end + 63) / 64, ~0ULL);
+    if (w * 64 >= end) return end;
+    n    = w * 64;
+    free = ~bits[w];
+  }
+  n += __builtin_ctzll(free);
+  return (n < end) ? n : end;
+}
+
+
+
+// ============================================================================
+// Return the first 1 bit of 'bits' - the first block, or Inode, in use - at
+// or after bit 'n', and before 'end'.  If there is none, return 'end'
+// ============================================================================
+i32 mapNextUsed(u64* bits, i32 n, i32 end) {
+  if (n >= end) return end;
+  u64 used = bits[n / 64] >> (n % 64);
+  if (used == 0) {                                    // rest of word free
+    i32 w = mapSkip(bits, n / 64 + 1, (end + 63) / 64, 0);
+    if (w * 64 >= end) return end;
+    n    = w * 64;
+    used = bits[w];
+  }
+  n += __builtin_ctzll(used);
+  return (n < end) ? n : end;
+}
+
+
+
+// ============================================================================
+// Mark the 'count' bits of 'map' from 'first' onwards in use, and update the
+// summaries of their regions.  On success, return 0
+// ============================================================================
+i32 mapSet(Map* map, i32 first, i32 count) {
+  mapFill(map->bits, first, count, 1);
+  for (i32 r = first / MAPREGION; r <= (first + count - 1) / MAPREGION; ++r) {
+    mapSum(map, r);
+  }
+  return 0;
+}
+
+
+
+// ============================================================================
+// Skip whole words with AVX2 if 'on', and the CPU supports it; otherwise with
+// plain 64-bit operations.  Return 1 if AVX2 is now in use; otherwise 0
+// ============================================================================
+i32 mapSimd(i32 on) {
+  g_simd = 0;
+#if defined(__x86_64__)
+  if (on && __builtin_cpu_supports("avx2")) g_simd = 1;
+#endif
+  return g_simd;
+}
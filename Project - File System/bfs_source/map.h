@@ -0,0 +1,36 @@
+#ifndef MAP_H
+#define MAP_H
+
+// ============================================================================
+// map.h - free-space search over an allocation bitmap.  Finds runs of free
+// (0) bits a 64-bit word at a time - with AVX2, four words at a time, where
+// the CPU has it - and keeps a summary of each region of MAPREGION bits, so
+// that a search for a long run skips regions that cannot hold one
+// ============================================================================
+
+#include "alias.h"
+
+#define MAPREGION 4096            // bits summarized by each MapRegion
+
+typedef struct {          // Summary of one region of a Map
+  i32 free;               // # of free bits.  -1 => not yet summarized
+  i32 head;               // # of free bits at its start
+  i32 tail;               // # of free bits at its end
+  i32 longest;            // longest run of free bits within it
+} MapRegion;
+
+typedef struct {          // Allocation bitmap, with a summary per region
+  u64*       bits;        // bit 'n' is 1 if block 'n' is in use
+  i32        num;         // # of bits
+  MapRegion* regions;     // one per MAPREGION bits
+} Map;
+
+i32 mapClear   (Map* map, i32 first, i32 count);
+i32 mapFindRun (Map* map, i32 first, i32 last, i32 hint, i32 want, i32* len);
+i32 mapInit    (Map* map, u64* bits, i32 num);
+i32 mapNextFree(u64* bits, i32 n, i32 end);
+i32 mapNextUsed(u64* bits, i32 n, i32 end);
+i32 mapSet     (Map* map, i32 first, i32 count);
+i32 mapSimd    (i32 on);
+
+#endif
\ No newline at end of file
@@ -1,7 +1,7 @@
 rm BFSDISK 
 rm *.gch
 cp ../BFSDISK .
-gcc *.c *.h -o main
+gcc -pthread *.c *.h -o main
 ./main
 rm BFSDISK 
 cp ../BFSDISK .